@@ -1,10 +1,24 @@
+#define _GNU_SOURCE     // for syscall
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>     // for strcmp, strlen, strcpy, strcat, ...
+#include <stdint.h>     // for the fixed width payload of queued alarms
 
 // Imports for Forks
 #include <unistd.h>
 #include <signal.h>     // for kill (killing child processes)
+#include <fcntl.h>      // for the close-on-exec stop pipe
+#include <sys/wait.h>   // for reaping the child processes
+#include <sys/resource.h>   // for the resources used by external commands (wait4)
+#include <sys/mman.h>   // for the statistics shared by every process
+#include <sys/syscall.h>    // for reading directories with getdents64
+#ifdef __SSE2__
+#include <emmintrin.h>  // for finding the end of plain text in command output 16 bytes at a time
+#endif
+#include <sys/stat.h>   // for creating the PID file directory
+#include <limits.h>     // for PATH_MAX
+#include <sys/file.h>   // for flock on the directory history
+#include <malloc.h>     // for mallopt in lean mode
 
 // Imports for Shared Memory Segment
 #include  <sys/types.h>
@@ -14,7 +28,24 @@
 // Imports for ncurses functionality
 #include <ncurses.h>
 #include <sys/ioctl.h>  // for max window size
-#include <pthread.h>    // for mutex locks
+#include <termios.h>    // for the raw terminal of --attach
+#include <pthread.h>    // for mutex locks, and the panels when running as threads
+#include <stdatomic.h>  // for the lock-free hand over between producers and panels
+#include <poll.h>       // for waiting on input without holding printLock
+#include <errno.h>
+#include <stdarg.h>     // for commandPrint
+#include <regex.h>      // for searching the output history
+#include <ctype.h>
+#include <locale.h>     // for drawing UTF-8 output
+#include <wchar.h>
+
+// Imports for the control socket
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>     // for /metrics
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 // Imports for Alarm and Time Panel
 #include <time.h>
@@ -22,19 +53,153 @@
 
 int task1();
 int task2(); void signal_handler(int sig);
+void rt_signal_handler(int sig, siginfo_t * info, void * context); void replay_signal_handler(int sig, siginfo_t * info, void * context);
 int task3();
+void * task2Thread(void * arg); void * task3Thread(void * arg);
+int runServer(const char * path); int runAttach(const char * path); struct serverSession; struct serverTask;
+void serverPost(struct serverTask * task); void serverPush(struct serverTask * task); struct serverTask * serverTake(int queue);
+void * serverWorker(void * arg); void serverRun(struct serverTask * task); void serverRetire(struct serverSession * session);
+void serverWaitBegin(); void serverWaitEnd();
+int setScreenSize(int rows, int columns); int sessionOpen(struct serverSession * session); void sessionKeys(struct serverSession * session);
+void sessionFrame(struct serverSession * session); void sessionEnd(struct serverSession * session);
+int stopWait(unsigned int seconds); void requestStop(); void stop_handler(int sig);
+int reapChild(pid_t pid, int timeoutMs);
+void signalReady(); int waitReady(int count); int pidDirOpen(const char * dir); int writePidFile(const char * dir); double elapsedMs(struct timespec * since);
+struct alarmInfo; struct timeZones;
+void alarmPanelLoop(struct alarmInfo * alarm_shm); void * alarmPanelThread(void * arg);
+void timePanelLoop(struct timeZones * time_shm); void * timePanelThread(void * arg);
+struct alarmPanelState; struct timePanelState; struct panelSet; struct promptLine;
+void alarmPanelStart(struct alarmPanelState * state, WINDOW * alarmPanel, WINDOW * colourPanel, int ownLine);
+void alarmPanelFrame(struct alarmPanelState * state, struct alarmInfo * alarm_shm);
+void timePanelFrame(struct timePanelState * state, struct timeZones * time_shm);
+void createPanels(struct panelSet * panels, int rows, int columns); void deletePanels(struct panelSet * panels);
+void promptShow(struct promptLine * prompt); int promptKey(struct promptLine * prompt, char key); void promptNext(struct promptLine * prompt);
+void readAlarmInfo(struct alarmInfo * src, struct alarmInfo * dst); int nextAlarmLine(int line, int queued, int rows);
+void readTimeZones(struct timeZones * src, struct timeZones * dst);
+void seqlockWriteBegin(atomic_uint * version); void seqlockWriteEnd(atomic_uint * version);
+struct commandOutput; struct byteBuffer; struct histogram;
+int executeCommand(const char * line, struct commandOutput * out); int runCommand(const char * line, struct commandOutput * out);
+void histogramRecord(struct histogram * histogram, unsigned long long ns); void frameDone(unsigned long long frameStart);
+int bufferPrintf(struct byteBuffer * buffer, const char * format, ...);
+void * metricsThread(void * arg);
+void initShell(const char * transcript); int runBatch(const char * script); unsigned long long allocationsMade();
+int changeDirectory(const char * dir, struct commandOutput * out); int dirsOpen(); struct dirEntry;
+void dirsVisit(const char * path); double dirsScore(struct dirEntry * entry, time_t now);
+uint32_t dirsHash(const char * path, size_t length); struct dirSignature;
+void dirsSignature(const char * text, size_t length, struct dirSignature * signature);
+uint32_t dirsFind(const char * path, size_t length, uint32_t hash); void dirsReindex(); void dirsRepair();
+int dirsMatch(struct dirEntry * entry, char ** fragments, int count); void dirsForget(const char * path);
+void jumpDirectory(char ** fragments, int count, struct commandOutput * out);
+struct shellConfig;
+void configLoad(const char * path); int configParse(const char * path, struct shellConfig * parsed);
+const char * configSet(struct shellConfig * parsed, char * assignment); uint64_t configChecksum(struct shellConfig * parsed);
+void configSave(const char * path, struct shellConfig * parsed, struct stat * rc);
+struct commandRecord;
+int runExternal(const char * name, const char * line, struct commandRecord * record, struct commandOutput * out);
+void streamOutput(int fd, struct commandOutput * out); void commandWrite(struct commandOutput * out, const char * data, size_t length);
+void streamBlock(const char * data, size_t length, struct commandOutput * out);
+int runNative(const char * command, const char * line, struct commandOutput * out);
+int nativeParse(const char * value, unsigned int * mask); void nativeFormat(unsigned int mask, char * value, size_t size);
+struct nativeFile{
+    char * data;
+    size_t size;
+    int mapped;
+    int fd;
+};
+int nativeOpen(const char * path, struct nativeFile * file); void nativeClose(struct nativeFile * file);
+int nativeMappable(int argc, char ** argv, int first);
+int nativeLs(int argc, char ** argv, struct commandOutput * out); int nativeCat(int argc, char ** argv, struct commandOutput * out);
+int nativeEcho(int argc, char ** argv, struct commandOutput * out); int nativePwd(int argc, char ** argv, struct commandOutput * out);
+int nativeWc(int argc, char ** argv, struct commandOutput * out); int nativeHead(int argc, char ** argv, struct commandOutput * out);
+void nativeCounts(unsigned long long counts[3], int show[3], int width, const char * name, struct commandOutput * out);
+struct sgrState;
+void panelLine(const char * line, size_t length, struct sgrState * sgr); void panelAdvance(unsigned long lines);
+void streamLine(const char * line, size_t length, struct sgrState * sgr);
+size_t streamLines(const char * data, size_t end, struct sgrState * sgr, struct commandOutput * out);
+void streamTail(const char * line, size_t length, struct sgrState * sgr, struct commandOutput * out);
+size_t plainRun(const char * data, size_t length); size_t escapeLength(const char * data, size_t length);
+size_t panelCharacter(const char * data, size_t length, int * columns);
+void sgrApply(struct sgrState * sgr, const char * params, size_t length); void sgrScan(struct sgrState * sgr, const char * data, size_t length);
+void recordCommand(struct commandRecord * record); void formatRecord(struct commandRecord * record, char * text, size_t size);
+void printCommandTable(struct commandOutput * out); void drawPromptBox(WINDOW * promptPanel);
+struct statCounter;
+unsigned long long rawNs(); void statRecord(struct statCounter * counter, unsigned long long ns);
+void lockPrint(); void unlockPrint(); int timedRefresh(WINDOW * window); int releasePrint(); void retakePrint(int held);
+unsigned long long threadWritten(); void threadForked();
+struct ttySnapshot; int statsLines(char lines[][160], int max, struct ttySnapshot * seen); int dumpStats(const char * path);
+void updateStatsOverlay(WINDOW ** overlay, struct ttySnapshot * seen, WINDOW * outputPanel);
+void commandPrint(struct commandOutput * out, const char * format, ...);
+int setVariable(const char * var, const char * value, struct commandOutput * out);
+const char * checkVariable(const char * var, const char * value);
+int getVariable(const char * var, char * value, size_t size);
+int bufferAppend(struct byteBuffer * buffer, const char * data, size_t length);
+void bufferConsume(struct byteBuffer * buffer, size_t length);
+void * controlThread(void * arg); void notifyAlarm(struct alarmInfo * alarm_shm);
+int removeSocket(const char * path); int listenPrivate(int listener, const char * path); int peerIsUser(int fd);
+struct panelShadow;
+void shadowInit(struct panelShadow * shadow, WINDOW * window); void shadowLine(struct panelShadow * shadow, int y, const char * text);
+void shadowRefresh(struct panelShadow * shadow); void shadowCell(struct panelShadow * shadow, int y, int x, chtype c);
+struct adaptiveState; int adaptiveFrame(struct adaptiveState * state); int adaptiveDegraded(struct adaptiveState * state);
+void dropSeconds(char * text);
+void recordEvent(int type, int detail, uint32_t value); void * replayThread(void * arg);
+struct replayTarget; void publishTimes(struct timeZones * time_shm, time_t now);
+struct sharedClock; struct sharedClock * clockOpen(int producer); void clockClose(struct sharedClock * clock, int producer);
+int clockRead(struct sharedClock * clock, struct timeZones * dst, time_t now); uint64_t clocksSignature();
+int clockPublish(struct sharedClock * clock, time_t now);
+int alarmLogOpen(const char * path, int kept); void alarmLogClose(); void alarmLogAppend(struct alarmInfo * alarm_shm, const struct timespec * received);
+uint64_t alarmLogOldest(uint64_t count); uint64_t alarmLogFind(int64_t timeNs, uint64_t count, int * probes);
+int parseAlarmTime(const char * text, int64_t * timeNs); void alarmsCommand(const char * argument, struct commandOutput * out);
+void drawTimeline(struct panelShadow * shadow, int secondsPerColumn, long long end);
+struct historyPattern;
+void historyAdd(const char * line, size_t length); unsigned int trigramBit(const char * text);
+void historyReserve(size_t bytes, size_t lines); int historyNextBlock(); int historyGrowLines();
+int patternCompile(struct historyPattern * pattern, const char * source, char * error, size_t size);
+int patternMatch(struct historyPattern * pattern, const char * text, size_t length);
+size_t historySearch(struct historyPattern * pattern, size_t * found, size_t max, size_t * scanned);
+void patternLiteral(struct historyPattern * pattern, const char * run, size_t length);
+void printMatches(struct historyPattern * pattern, const char * label, struct commandOutput * out);
+
+// Layout of the 64-bit payload carried by queued real-time alarms sent by presblock -q (must match presblock.c).
+// The top 24 bits hold a sequence number and the low 40 bits the CLOCK_MONOTONIC send time in microseconds.
+#define RT_SEQ_BITS 24
+#define RT_TIME_BITS 40
+#define RT_TIME_MASK ((1ULL << RT_TIME_BITS) - 1)
+// Number of real-time signals, starting from SIGRTMIN, which are treated as alarms
+#define RT_ALARM_SIGNALS 8
 
 // Shared Memory Segment structs:
 struct alarmInfo{
     int colour;
     char message[32];
     int alarmLC;
+    // Whether the latest alarm was a queued real-time signal, and its sequence number
+    int queued;
+    unsigned int seq;
+    // Delivery accounting for queued real-time alarms: received, lost (gaps in the sequence numbers) and the
+    // end to end latency between presblock sending the alarm and the handler running
+    unsigned long rtReceived;
+    unsigned long rtLost;
+    long long rtLatencySumUs;
+    long long rtLatencyMaxUs;
+    // Alarms received in each colour bucket (indexed by colour pair)
+    unsigned long colourCounts[6];
+    // Every alarm received, and the number of control socket clients subscribed to them (the handlers only wake the
+    // control socket while there are some)
+    unsigned long received;
+    atomic_int subscribers;
+    // Seqlock version, odd while a signal handler is updating the alarm; lets the panel read without locking
+    atomic_uint version;
 };
 
 struct timeZones{
     char USAtime[64];
     char MALTAtime[64];
     char TOKYOtime[64];
+    // The clocks the times are for (clocksSignature), and the second they were produced for
+    uint64_t clocks;
+    int64_t produced;
+    // Seqlock version, odd while task3 is updating the times
+    atomic_uint version;
 };
 
 // Global Variables:
@@ -51,553 +216,6463 @@ int alarmY;
 
 // Boolean value (stored as int) which terminates all infinite loops when exiting the program, thus allowing
 // the methods to complete the clean up tasks after the end of their loops
-int runLoop = 1;
+atomic_int runLoop = 1;
 
 // Declaring the printLock Mutex Lock as a global variable
 pthread_mutex_t printLock;
+// Held (before printLock) for the whole of a command run from the prompt or the control socket, so that commands run
+// one at a time even while an external command lets printLock go to wait for its output
+pthread_mutex_t commandLock;
+
+// Boolean value (stored as int) set by --threads: the producers (task2, task3) and the panel updaters run as threads
+// of a single process sharing the structs below, rather than as 4 extra processes sharing SysV segments
+int threadMode = 0;
+struct alarmInfo threadAlarmInfo;
+struct timeZones threadTimeZones;
+// The structs used in thread mode (and by a server, for all of its sessions)
+struct alarmInfo * threadAlarm = &threadAlarmInfo;
+struct timeZones * threadTimes = &threadTimeZones;
+
+// The clock shared by every Orange Wave of this user on the host (POSIX shared memory /orangewave-clock-UID). The
+// first task3 to lock it publishes the times in it once a second, and every other task3 leaves it alone, so the times
+// are produced once however many sessions are running. The time panels map it read-only and show its times instead of
+// their own while they are fresh and for the same clocks; otherwise their task3 goes on producing their own. The lock
+// goes with the publisher, so when it exits the next task3 to find the times stale takes over.
+#define CLOCK_MAGIC "OWCLK01\n"
+// How old (in seconds) the shared times may be before they are no longer shown, and someone else publishes them
+#define CLOCK_STALE 2
+struct sharedClock{
+    char magic[8];
+    int32_t publisher;
+    uint32_t reserved;
+    struct timeZones times;
+};
+// task3's descriptor, which holds the lock while it publishes, and the mapping read by the time panel
+int sharedClockFd = -1;
+int clockPublisher = 0;
+struct sharedClock * panelClock = NULL;
+
+// The alarm log: every alarm received is appended to a file of ALARM_LOG_RECORDS fixed records (the oldest overwritten
+// once it is full), mapped before forking so that every process of the session reads the same records. The alarm panel
+// draws its timeline from it and "alarms since" searches it. Only the alarm handlers append, one at a time, so the
+// records are in the order the alarms came in, and count only moves on once a record is complete. By default it is
+// PID.alarms next to the PID file and removed on exit; --alarm-log file keeps it (locked while in use), carrying on
+// from the records of earlier sessions.
+#define ALARM_LOG_MAGIC "OWALM01\n"
+#define ALARM_LOG_RECORDS (1 << 18)
+// Records this close to being overwritten are not read, as the handler may be writing them
+#define ALARM_LOG_MARGIN 1024
+struct alarmRecord{
+    int64_t timeNs;             // CLOCK_REALTIME
+    uint64_t interarrivalNs;    // since the alarm before (0 for the first one of a session)
+    uint8_t colour;
+    uint8_t queued;
+    uint16_t reserved;
+    uint32_t seq;
+};
+struct alarmLog{
+    char magic[8];
+    uint32_t capacity;
+    uint32_t reserved;
+    atomic_ullong count;        // alarms ever appended; alarm n is in records[n % ALARM_LOG_RECORDS]
+    char padding[40];
+    struct alarmRecord records[ALARM_LOG_RECORDS];
+};
+struct alarmLog * alarmLog = NULL;
+char alarmLogPath[PATH_MAX] = "";
+int alarmLogKept = 0;
+// The widest timeline drawn, in columns
+#define TIMELINE_COLUMNS 256
+
+// The output of external commands is read into this buffer, which is reused for every command. Only an unfinished
+// line at the end of a read is moved back to the start; nothing else is copied. The workers of a server each have
+// their own, as they read the output of several commands at once.
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+char outputStorage[OUTPUT_BUFFER_SIZE];
+_Thread_local char * outputBuffer = outputStorage;
+// How much of it is used: all of it, or only the start in lean mode (so that the rest is never touched)
+size_t outputBufferSize = OUTPUT_BUFFER_SIZE;
+// Boolean value (stored as int) set by --lean, for hosts running many sessions: thread mode, with one malloc arena,
+// smaller thread stacks, and an output history and stream buffer of fixed size set aside at startup, so that once
+// running nothing is allocated. LEAN_HISTORY_LINES is how many lines fit in the history, whatever their length.
+int leanMode = 0;
+#define LEAN_STACK_SIZE (512 * 1024)
+#define LEAN_HISTORY_BYTES (1 << 20)
+#define LEAN_HISTORY_LINES (32 * 1024)
+#define LEAN_OUTPUT_BUFFER_SIZE (32 * 1024)
+pthread_attr_t leanThreads;
+// Set by --check-allocations: how many commands of a batch script warm up, after which none may allocate (-1 if
+// the allocations are not checked)
+long allocationWarmup = -1;
+// The attributes threads are created with (NULL for the defaults)
+pthread_attr_t * threadAttributes = NULL;
+
+// In thread mode, threads wait on stopCond instead of sleeping, so that requestStop() wakes them all at once
+pthread_mutex_t stopLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stopCond = PTHREAD_COND_INITIALIZER;
+
+// SIGALRM and the real-time signals used for queued alarms
+sigset_t alarmSignals;
+
+// Stop pipe: every child process polls the read end while it waits, and the main process holds the only write end.
+// Closing the write end (requestStop) wakes every child at once, and also happens if the main process dies.
+int stopPipe[2] = {-1, -1};
+
+// Ready pipe: task2 and task3 write a byte to it once their Shared Memory Segments exist, and main waits for both
+// before task1 attaches to them
+int readyPipe[2] = {-1, -1};
+
+// The time at which OrangeWave was started, used to report how long startup took
+struct timespec startTime;
+
+// Session recording (--record file): every key read by the prompt, every alarm signal and every time produced for
+// the time panel, with the CLOCK_MONOTONIC time since startTime. Every process appends to the same file (it is
+// opened with O_APPEND before forking) with one write per event, so the events of different processes never tear.
+// The alarm handlers record their alarms too, which is why recording only uses async-signal-safe calls.
+enum { EVENT_KEY = 1, EVENT_ALARM, EVENT_RT_ALARM, EVENT_TICK };
+#define SESSION_MAGIC "OWREC01\n"
+struct sessionEvent{
+    uint64_t offsetNs;
+    uint8_t type;
+    uint8_t detail;     // the key, or which real-time signal (from SIGRTMIN)
+    uint16_t reserved;
+    uint32_t value;     // the sequence number of a queued alarm, or the time produced (seconds since the epoch)
+};
+int recordFd = -1;
+
+// Session replay (--replay file [--fast]): a thread of the prompt's process feeds the events back at the time they
+// were recorded, or straight after each other with --fast. Keys reach the prompt through replayKeys, and the prompt
+// writes to replayAck once it has finished with each one, so that the next event waits for it either way.
+const char * replayPath = NULL;
+int replayFast = 0;
+int replayKeys[2] = {-1, -1};
+int replayAck[2] = {-1, -1};
+// Set while the replay is running: the keyboard is ignored then (except for q, which exits), and so are alarms which
+// this process did not raise itself, so that nothing but the log changes what is replayed
+atomic_int replayActive;
+// What the replay thread needs from task1: the Shared Memory Segments it raises alarms and stores times in
+struct replayTarget{
+    struct alarmInfo * alarm_shm;
+    struct timeZones * time_shm;
+};
+
+// The PID file through which presblock finds this session (presblock -D <directory>), removed on exit
+char pidFilePath[PATH_MAX] = "";
+
+// The panels, shared with the panel updaters
+WINDOW * alarmPanel, * colourPanel;
+WINDOW * timePanel;
+
+// The windows of a terminal running Orange Wave (the one task1 runs on, or the client's of a server session), and the
+// heights the prompt and the panel updaters need
+struct panelSet{
+    WINDOW * main;
+    WINDOW * prompt, * output, * alarm, * colour, * time;
+    int promptY, outputY, alarmY;
+};
+
+// The line being typed at the prompt, and which line of the prompt panel it is on
+struct promptLine{
+    WINDOW * panel;
+    // counter which stores which line the program is on in the Prompt Panel(for cursor)
+    int line;
+    int length;
+    char text[256];
+};
+
+// What a panel updater last drew inside a panel (the cells within its border), so that a frame only writes the cells
+// which changed, and only refreshes the panel if there were any. ncurses would find the same differences when
+// refreshing, but only after every line had been written again, and each wrefresh also moves the cursor. Every
+// updater has its own, as in process mode each process has its own copy of the panels.
+struct panelShadow{
+    WINDOW * window;
+    int rows;
+    int columns;
+    chtype * cells;     // with their attributes, as the timeline of the alarm panel is drawn in colour
+    int dirty;      // cells were written since the last refresh
+};
+
+// Adaptive refresh (set adaptive=on), for slow links: before every frame, a panel updater checks how much output is
+// still queued for the terminal (TIOCOUTQ). Pseudo terminals (ssh sessions among them) always report 0, so the
+// terminal also counts as backed up when it cannot take any more output right now, or when a write to it has blocked
+// for more than TTY_STALL_NS since the updater's last frame. While it is backed up, the frame is skipped (the next
+// one shows the latest state anyway), and the time between frames doubles, up to ADAPTIVE_MAX_BACKOFF times the usual
+// one; it halves again with every frame drawn. For ADAPTIVE_HOLD_SECONDS after the queue was last found backed up, the
+// time panel only shows hours and minutes, so that it only changes once a minute. This leaves the link (and
+// printLock, which is held while ncurses waits for the terminal) to the prompt.
+#define ADAPTIVE_QUEUE_BYTES 512
+#define ADAPTIVE_MAX_BACKOFF 4
+#define ADAPTIVE_HOLD_SECONDS 30
+#define TTY_STALL_NS 20000000ULL
+struct adaptiveState{
+    unsigned int backoff;
+    unsigned long long congestedNs;     // when the terminal was last backed up (rawNs), 0 if never
+    unsigned long long checkedNs;       // when the terminal was last checked
+    int fd;     // the terminal (standard output, or the socket of a server session's client)
+    atomic_ullong * stallNs;        // when a refresh of that terminal last stalled
+};
+
+// What an alarm panel updater last drew, and where the next alarm goes (see alarmPanelStart)
+struct alarmPanelState{
+    struct panelShadow shadow;
+    WINDOW * colourPanel;
+    int rows;
+    int ownLine;
+    // The line the alarm is printed on
+    int line;
+    // The number of alarms received by the last update
+    unsigned long shown;
+    // The colour of the colour panel, which is only repainted when it changes
+    int shownColour;
+    // Whether the panel shows the alarm lines (0) or the timeline, as it is cleared when that changes
+    int shownTimeline;
+    struct adaptiveState adaptive;
+};
+// What a time panel updater last drew: usually only the seconds change from one update to the next
+struct timePanelState{
+    struct panelShadow shadow;
+    struct adaptiveState adaptive;
+};
+
+// The directory history (~/.orangewave-dirs): every directory the shell changed to, ranked by how often and how recently
+// it was visited, so that 'j fragment' can jump to the best match. It is a sparse file of fixed size records which
+// every session maps, and updates under flock. Paths too long for a record are not kept.
+#define DIRS_MAGIC "OWDIRS1\n"
+#define DIRS_CAPACITY 65536
+#define DIRS_SLOTS (2 * DIRS_CAPACITY)
+#define DIRS_PATH 234
+// Once the ranks add up to more than this, they are all aged and the directories left with almost nothing are forgotten
+// (until then, a full history makes way for new directories by forgetting its lowest ranked one)
+#define DIRS_MAX_RANK 200000
+#define DIRS_AGING 0.9
+#define DIRS_MIN_RANK 0.25
+struct dirEntry{
+    double rank;
+    int64_t lastVisit;
+    uint32_t hash;
+    uint16_t length;
+    char path[DIRS_PATH];
+};
+struct dirSignature{
+    uint64_t bits[4];
+};
+struct dirsFile{
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    double totalRank;
+    char padding[40];
+    // Hash table of the paths (open addressing), holding entry index + 1, or 0 for an empty slot
+    uint32_t slots[DIRS_SLOTS];
+    // 256 bits per path, one per hashed pair of consecutive characters. They are kept apart from the entries so that j
+    // rules out most of the directories by reading only these.
+    struct dirSignature signatures[DIRS_CAPACITY];
+    struct dirEntry entries[DIRS_CAPACITY];
+};
+struct dirsFile * dirs = NULL;
+int dirsFd = -1;
+
+// The configuration file (~/.orangewaverc unless --config is given) holds 'set' lines for the internal shell variables,
+// 'clock' lines for the time panel and a 'colours' line for the alarm colours, e.g.
+//     set prompt=OW
+//     clock 2 +5:30 INDIA [DELHI]
+//     colours 5 10 15 21
+// It is parsed once, and what it gave is saved next to it as a snapshot (<file>.snapshot) which later startups map
+// instead of parsing the file again, for as long as the file's modification time and size match those in the snapshot.
+#define CONFIG_CLOCKS 3
+// Commands with a native version (nativeCommands)
+#define NATIVE_COMMANDS 6
+#define CONFIG_MAGIC "OWCFG01\n"
+struct worldClock{
+    char label[32];
+    int offsetMinutes;
+};
+// Plain data only (no pointers), so that it can be saved and mapped as is
+struct shellConfig{
+    char prompt[32];
+    char path[256];
+    unsigned int refreshTime;
+    int buffery;
+    int bufferx;
+    int adaptive;
+    // The commands run natively (a bit per entry of nativeCommands)
+    unsigned int native;
+    struct worldClock clocks[CONFIG_CLOCKS];
+    // Alarms less than colourLimits[0] seconds apart are white, then red, orange and green; anything slower is blue
+    int colourLimits[4];
+    // The first line of the file which could not be used, reported at startup
+    char problem[128];
+};
+struct configSnapshot{
+    char magic[8];
+    uint32_t configSize;
+    uint32_t reserved;
+    // The configuration file the snapshot was made from
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    int64_t fileSize;
+    // FNV-1a hash of config, so that a damaged snapshot is parsed again rather than used
+    uint64_t checksum;
+    struct shellConfig config;
+};
+const struct shellConfig defaultConfig = {
+    .prompt = "OK", .path = "", .refreshTime = 1, .buffery = 80, .bufferx = 256, .adaptive = 0,
+    .native = (1u << NATIVE_COMMANDS) - 1,
+    .clocks = { { "WHITE HOUSE [USA]", -6*60 }, { "MALTA [MSIDA]", 1*60 }, { "JAPAN [TOKYO]", 9*60 } },
+    .colourLimits = { 5, 10, 15, 21 },
+};
+struct shellConfig config;
+// The configuration file, and how it was loaded (NULL if there is none)
+char configPath[PATH_MAX];
+const char * configSource = NULL;
+double configMs;
+
+// Where the output of a command goes: the output panel, the output file (transcript), a stream (stdout in batch
+// mode) and/or the reply to a control socket client
+struct commandOutput{
+    int screen;
+    int transcript;
+    FILE * stream;
+    struct byteBuffer * reply;
+    // What this caller last saw of the terminal bytes, for "stats" (NULL gives the rate since startup)
+    struct ttySnapshot * ttySeen;
+};
+
+// What an external command took: wall time, CPU time, memory, context switches and how it ended (from wait4)
+struct commandRecord{
+    char name[20];
+    double wallMs;
+    double userMs;
+    double sysMs;
+    long maxRssKb;
+    long voluntarySwitches;
+    long involuntarySwitches;
+    int status;
+};
+
+// Totals for every external command name, so that slow tools stand out (time, without a command, prints them)
+struct commandTotals{
+    char name[20];
+    unsigned long runs;
+    unsigned long failures;
+    double wallMs;
+    double maxWallMs;
+    double cpuMs;
+    long maxRssKb;
+    // When the name was last run (in commands run), so that the least recently used name makes room for new ones
+    unsigned long lastUsed;
+};
+
+// The most recent external commands (for last), and the table of totals per command name. Only used with printLock
+// held.
+#define RECENT_COMMANDS 32
+#define COMMAND_NAMES 64
+struct commandRecord recentCommands[RECENT_COMMANDS];
+struct commandTotals commandTable[COMMAND_NAMES];
+unsigned long commandsRun = 0;
+
+// Instrumentation of the hot paths. Every thread (or process) which draws has its own slot, which only it writes to,
+// so the counters need no locking; the slots live in an anonymous shared mapping so that, in process mode, the panel
+// updaters' slots can be read by the prompt. Times are taken from CLOCK_MONOTONIC_RAW, which is not slewed by NTP.
+enum { STATS_PROMPT, STATS_ALARM_PANEL, STATS_TIME_PANEL, STATS_CONTROL, STATS_SLOTS };
+const char * statSlotNames[STATS_SLOTS] = { "prompt", "alarm panel", "time panel", "control" };
+
+struct statCounter{
+    atomic_ullong count;
+    atomic_ullong totalNs;
+    atomic_ullong maxNs;
+};
+
+struct statSlot{
+    // wrefresh calls, waits for printLock, time printLock is held, getch calls, external commands and whole frames
+    // (one update of a panel, or one key echoed in the prompt)
+    struct statCounter refresh;
+    struct statCounter lockWait;
+    struct statCounter lockHold;
+    struct statCounter input;
+    struct statCounter external;
+    struct statCounter frame;
+    // Bytes written to the terminal, and frames skipped because the terminal was not keeping up (set adaptive=on)
+    atomic_ullong ttyBytes;
+    atomic_ullong skippedFrames;
+    // Alarms received but not yet shown by the alarm panel, when it last updated, and the most there ever were
+    atomic_ullong alarmDepth;
+    atomic_ullong alarmDepthMax;
+    // Heap allocations made (only counted when built with COUNT_ALLOCATIONS)
+    atomic_ullong allocations;
+};
+
+// A latency histogram in the Prometheus style: a count per bucket upper bound, plus the total count and sum
+#define HISTOGRAM_BUCKETS 13
+const double histogramBounds[HISTOGRAM_BUCKETS] = { 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+                                                    0.025, 0.05, 0.1, 0.25, 1 };
+struct histogram{
+    atomic_ullong buckets[HISTOGRAM_BUCKETS + 1];
+    atomic_ullong count;
+    atomic_ullong sumNs;
+};
+
+struct statsRegion{
+    // Whether the overlay is shown (stats on|off), and whether the panels adapt to the speed of the terminal (set
+    // adaptive=on|off); kept here as this mapping is shared with the panel updaters in process mode
+    atomic_int overlay;
+    atomic_int adaptive;
+    // When a refresh last took more than TTY_STALL_NS, waiting for the terminal (rawNs)
+    atomic_ullong ttyStallNs;
+    struct statSlot slots[STATS_SLOTS];
+    // Commands run (from the prompt, the control socket or a script) and how long they took, and how long frames
+    // took to draw, for /metrics
+    atomic_ullong commands;
+    struct histogram commandLatency;
+    struct histogram renderLatency;
+    // The times task3 produced itself, and the publisher of the shared clock while the time panel shows its times
+    atomic_ullong timesProduced;
+    atomic_int clockPublisher;
+    // What the alarm panel shows (alarms timeline|lines): 0 for the alarm lines, otherwise the seconds per column of
+    // the timeline, which ends at alarmTimelineEnd (seconds since the epoch), or now while that is 0
+    atomic_int alarmTimeline;
+    atomic_llong alarmTimelineEnd;
+};
+
+struct statsRegion * stats;
+
+// The terminal bytes of every slot when a caller of statsLines last looked, so that each caller (the overlay, the
+// prompt, a control client, a batch script) gets the bytes per second since it last looked, whoever looked in between
+struct ttySnapshot{
+    unsigned long long bytes[STATS_SLOTS];
+    unsigned long long ns;
+};
+// The slot of the calling thread, when it took printLock and whether it holds it
+_Thread_local struct statSlot * mySlot;
+_Thread_local unsigned long long lockTakenNs;
+_Thread_local int printHeld;
+// The calling thread's /proc/thread-self/io, read by threadWritten (-1 until it is opened, -2 if it can't be)
+_Thread_local int threadIoFd = -1;
+// The C locale, in which search patterns are compiled (the rest of the program uses the character set of the terminal)
+locale_t byteLocale;
+
+// The colours and attributes set by the ANSI SGR (Select Graphic Rendition) sequences in the output of a command,
+// which carry on from line to line until they are reset. -1 is the terminal's default colour.
+struct sgrState{
+    attr_t attributes;
+    short fg;
+    short bg;
+};
+#define SGR_PAIR_BASE 16
+#define SGR_PAIR(fg, bg) (SGR_PAIR_BASE + ((fg) + 1) * 9 + ((bg) + 1))
+
+// History of the output panel, which /pattern and filter search. The text of every line is copied into arena blocks
+// which are never moved or freed but reused in turn: once all HISTORY_BLOCKS are in use, the oldest one is filled
+// again and the lines it held are dropped, so the history always holds the latest output. The lines and the
+// signatures of their groups are rings as well, indexed by line number (which goes on counting as lines are dropped).
+// The lines are indexed in groups of HISTORY_GROUP as they arrive: every group
+// has a signature of TRIGRAM_BITS bits, with the bit of every trigram (three byte sequence) in its lines set. A
+// trigram is hashed to its bit, so a collision only adds a group to look at, never loses one. Setting the bits of a
+// line only touches the signature being filled, which stays in the cache, where posting lists per trigram would
+// take a cache miss for every new trigram. Only used with printLock held.
+#define HISTORY_ARENA_BLOCK (4 << 20)
+#define HISTORY_BLOCKS 32
+#define HISTORY_MAX_LINES (1UL << 22)
+#define HISTORY_MAX_LINE 4096
+#define HISTORY_GROUP 64
+#define TRIGRAM_BITS 4096
+struct historyLine{
+    const char * text;
+    unsigned int length;
+};
+struct groupSignature{
+    uint64_t bits[TRIGRAM_BITS / 64];
+};
+struct outputHistory{
+    char * blocks[HISTORY_BLOCKS];
+    size_t blockFirstLine[HISTORY_BLOCKS];  // the first line whose text went in each block
+    size_t blockSize;
+    size_t blockCount;
+    size_t blocksStarted;   // block (blocksStarted - 1) % blockCount is being filled
+    size_t arenaUsed;       // of the block being filled
+    struct historyLine * lines;     // line n is at n % lineCapacity
+    size_t firstLine;       // the oldest line still kept
+    size_t lineCount;       // the lines added so far, kept or not
+    size_t lineCapacity;
+    struct groupSignature * signatures;     // group g is at g % signatureCapacity
+    size_t signatureCapacity;
+    // Set if memory for the history could not be had, after which new lines are no longer added
+    int full;
+    // Set when everything was set aside at startup (historyReserve), so the rings never grow
+    int fixed;
+};
+struct outputHistory history;
+// Set while search results are printed, as they are not added to the history themselves
+int historyPaused = 0;
+
+// A compiled search pattern (an extended regular expression). Every match contains the longest literal part of the
+// pattern, which is checked with memmem before the regex runs, and every trigram of its literal parts, so only the
+// groups whose signature has all of their bits may hold a match.
+#define PATTERN_TRIGRAMS 64
+struct historyPattern{
+    regex_t regex;
+    int literalOnly;        // the pattern is plain text, so memmem alone decides
+    char literal[HISTORY_MAX_LINE];
+    size_t literalLength;
+    unsigned int trigramBits[PATTERN_TRIGRAMS];
+    int trigramCount;
+};
+
+#define DIR_STACK 32
+// The internal shell variables, and where the output of the commands entered at the prompt goes. These are shared by
+// the prompt and the control socket, and only used with commandLock and printLock held (each session of a server has
+// its own, only used by the worker running its command).
+struct shellState{
+    char prompt[32];
+    char path[256];
+    int buffery;
+    int bufferx;
+    unsigned int native;
+    // The current directory, kept up to date by changeDirectory rather than asked for every time, and the directories
+    // pushd left to go back to (the most recent last), set aside by the first pushd
+    char cwd[PATH_MAX];
+    char (*dirStack)[PATH_MAX];
+    int dirDepth;
+    WINDOW * outputPanel;
+    int outputY;
+    // counter which stores which line the program is on in the Output Panel
+    int outputLC;
+    FILE * outputFP;
+    // The filter set by the filter built-in: while filtering, the output panel only shows the lines which match it
+    struct historyPattern filterPattern;
+    int filtering;
+    // The last external command this shell ran (for time and the status line), and how many it has run
+    struct commandRecord lastCommand;
+    unsigned long commandsRun;
+    // The external command running (0 if none); in a session of a server, it leads a process group of its own, which
+    // the server ends when it stops
+    atomic_int child;
+};
+struct shellState mainShell;
+// The shell whose commands this thread runs: mainShell, or the one of the server session it is working for
+_Thread_local struct shellState * shell = &mainShell;
+// The shell whose current directory the process is in. There is only one, so the sessions of a server take turns in
+// it: executeCommand changes to the calling shell's whenever another one's command ran last (with printLock held).
+struct shellState * cwdShell = &mainShell;
+
+// Server mode (--server socket): one process holds the alarm handlers and the time producer, and hosts a session for
+// every client which attaches (--attach socket), drawing its panels and prompt on the client's terminal. The client
+// sends SERVER_HELLO, its terminal type and its size on a line of their own first. A session is a serverSession: its
+// windows, shell, prompt line and what its panels last drew, and the ncurses SCREEN of its terminal (newterm on the
+// client's socket), which lockPrint selects with set_term. Its work is split into two tasks, one for the keys typed
+// (and the commands they run) and one for the frames of its panels, so that the panels keep updating while a command
+// runs. A task is queued at most once and runs on one worker at a time. Each worker (one per CPU, up to
+// SERVER_WORKERS) takes tasks from its own queue newest first, and once that is empty steals the oldest task of
+// another worker's. The main thread of the server accepts the clients, queues the key task of a session when its
+// client has sent something, and queues the frame task of every session once a second.
+#define SERVER_HELLO "OWATTACH1"
+#define SERVER_SESSIONS 256
+#define SERVER_WORKERS 16
+// A client which has not said hello within this many seconds, or whose terminal has taken none of the output sent to
+// it for SERVER_STALL_SECONDS, is dropped (a session's output is written with printLock held)
+#define SERVER_HELLO_SECONDS 5
+#define SERVER_STALL_SECONDS 10
+enum { TASK_KEYS, TASK_FRAME };
+struct serverTask{
+    struct serverSession * session;
+    int kind;
+    // On a queue or running, and left set once the session is closing so that the task is not queued again
+    atomic_int queued;
+    // Something for the task happened since it last started
+    atomic_int pending;
+};
+struct serverSession{
+    int fd;
+    int id;
+    struct timespec started;
+    char hello[128];
+    size_t helloLength;
+    // The terminal, once the hello has come in
+    struct serverScreen * terminal;
+    struct panelSet panels;
+    struct shellState shell;
+    struct promptLine prompt;
+    struct alarmPanelState alarmPanel;
+    struct timePanelState timePanel;
+    // Frames since the panels were last drawn (or skipped)
+    unsigned int alarmTicks, timeTicks;
+    // The statistics overlay, and what the overlay and the prompt last saw
+    WINDOW * overlay;
+    struct ttySnapshot overlaySeen;
+    struct ttySnapshot promptSeen;
+    atomic_ullong ttyStallNs;
+    atomic_int opened;      // the hello has come in, and the terminal is drawn on
+    atomic_int running;     // a command is running
+    atomic_int closing;     // the session is ending, and its tasks retire
+    atomic_int tasksLeft;       // tasks which have not retired yet; the last one to retire ends the session
+    atomic_int ended;       // it has, and the main thread can free it
+    // Only used by the main thread: since when the client has taken none of the output (0 if it has)
+    time_t stalledSince;
+    struct serverTask keys;
+    struct serverTask frame;
+    struct serverSession * next;
+};
+// The ncurses SCREEN of a session's terminal, on a descriptor of its own onto which the client's socket is duplicated.
+// ncurses (6.4) cannot free a SCREEN without freeing the windows of every other one too, so once its session has ended
+// a SCREEN is kept, its descriptor pointing at /dev/null, for the next client with the same type and size of terminal.
+// Nor can a SCREEN be resized (resizeterm fits the windows of every SCREEN to the new size), so each is made at the
+// size of its client's terminal. These are only used with printLock held.
+struct serverScreen{
+    SCREEN * screen;
+    FILE * file;
+    char term[64];
+    int rows, columns;
+    struct serverScreen * next;
+};
+struct serverScreen * spareScreens = NULL;
+// The queue of a worker: tasks are pushed and taken at the tail, and stolen from the head
+struct serverQueue{
+    pthread_mutex_t lock;
+    struct serverTask * tasks[2 * SERVER_SESSIONS];
+    unsigned int head, tail;
+};
+struct serverQueue serverQueues[SERVER_WORKERS];
+int serverWorkers = 0;
+// The tasks on the queues, which the workers wait for when there are none, and whether the server is stopping
+pthread_mutex_t serverIdleLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t serverIdleCond = PTHREAD_COND_INITIALIZER;
+int serverQueued = 0;
+int serverStopping = 0;
+// Every worker started, and how many of them are waiting for an external command of their session to finish. A worker
+// which has to wait for one first starts another (without a queue of its own) unless serverWorkers would still be
+// free to run tasks, so that a command only ever holds up its own session.
+pthread_t serverThreads[SERVER_WORKERS + SERVER_SESSIONS];
+int serverThreadCount = 0;
+int serverWaiting = 0;
+atomic_int serverBusy;      // workers running a task
+atomic_uint serverNext;     // the queue the main thread pushes to next
+// The epoll set of the client sockets (and the listener), which the key tasks arm again once they have read
+int serverPoll = -1;
+// The worker's own queue (-1 in other threads, and in the workers started for those waiting for a command), and the session a thread is working for (NULL if none)
+_Thread_local int myQueue = -1;
+_Thread_local struct serverSession * currentSession = NULL;
+
+// A growable buffer of bytes, holding what control socket clients send and what they are sent back
+struct byteBuffer{
+    char * data;
+    size_t length;
+    size_t capacity;
+};
+
+// Control socket: a Unix-domain socket on which scripts run commands, set and get the internal shell variables, read
+// the alarm statistics and subscribe to alarms. Empty when disabled (--control none).
+char controlPath[sizeof(((struct sockaddr_un *) 0)->sun_path)] = "";
+
+// The localhost port /metrics is served on (--metrics-port), 0 when it is not served
+int metricsPort = 0;
+
+// The alarm signal handlers bump this eventfd while anyone is subscribed, which wakes the control socket
+int alarmEventFd = -1;
+
+// The Alarm Shared Memory Segment as attached by the signal handlers of this process (attached once, on first use)
+struct alarmInfo * handlerAlarmShm = NULL;
+
+int main(int argc, char ** argv){
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    // Only the character set is taken from the environment, so that the output panel can show UTF-8 text; numbers
+    // (in stats and /metrics) keep their decimal point
+    setlocale(LC_CTYPE, "");
+    byteLocale = newlocale(LC_CTYPE_MASK, "C", (locale_t) 0);
+
+    // The directory holding the PID files of every session, which is where presblock looks for them by default
+    char pidDir[PATH_MAX];
+    snprintf(pidDir, sizeof(pidDir), "/tmp/orangewave-%d", (int) getuid());
+
+    // The control socket, which lives next to the PID file unless given
+    const char * control = NULL;
+    // The script run by batch mode ("-" for stdin)
+    const char * batchScript = NULL;
+    // The session log written by --record
+    const char * recordPath = NULL;
+    // Whether the panels start out adapting to the speed of the terminal (--adaptive)
+    int adaptive = 0;
+    // The socket of server mode, served (--server) or attached to (--attach)
+    const char * serverPath = NULL;
+    const char * attachPath = NULL;
+    // The alarm log kept by --alarm-log
+    const char * alarmLogOption = NULL;
+
+    // Command line options
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--threads") == 0) {
+            threadMode = 1;
+        } else if (strcmp(argv[arg], "--pid-dir") == 0 && arg + 1 < argc) {
+            snprintf(pidDir, sizeof(pidDir), "%s", argv[++arg]);
+        } else if (strcmp(argv[arg], "--control") == 0 && arg + 1 < argc) {
+            control = argv[++arg];
+        } else if (strcmp(argv[arg], "--metrics-port") == 0 && arg + 1 < argc) {
+            char * end;
+            errno = 0;
+            long port = strtol(argv[++arg], &end, 10);
+            if (errno != 0 || end == argv[arg] || *end != '\0' || port < 1 || port > 65535) {
+                fprintf(stderr, "--metrics-port: %s is not a port (1 to 65535)\n", argv[arg]);
+                exit(EXIT_FAILURE);
+            }
+            metricsPort = (int) port;
+        } else if (strcmp(argv[arg], "--batch") == 0 && arg + 1 < argc) {
+            batchScript = argv[++arg];
+        } else if (strcmp(argv[arg], "--check-allocations") == 0 && arg + 1 < argc) {
+            char * end;
+            errno = 0;
+            long warmup = strtol(argv[++arg], &end, 10);
+            if (errno != 0 || end == argv[arg] || *end != '\0' || warmup < 0) {
+                fprintf(stderr, "--check-allocations: %s is not a number of commands\n", argv[arg]);
+                exit(EXIT_FAILURE);
+            }
+            allocationWarmup = warmup;
+        } else if (strcmp(argv[arg], "--record") == 0 && arg + 1 < argc) {
+            recordPath = argv[++arg];
+        } else if (strcmp(argv[arg], "--replay") == 0 && arg + 1 < argc) {
+            replayPath = argv[++arg];
+        } else if (strcmp(argv[arg], "--fast") == 0) {
+            replayFast = 1;
+        } else if (strcmp(argv[arg], "--adaptive") == 0) {
+            adaptive = 1;
+        } else if (strcmp(argv[arg], "--lean") == 0) {
+            leanMode = 1;
+            threadMode = 1;
+        } else if (strcmp(argv[arg], "--config") == 0 && arg + 1 < argc) {
+            snprintf(configPath, sizeof(configPath), "%s", argv[++arg]);
+        } else if (strcmp(argv[arg], "--server") == 0 && arg + 1 < argc) {
+            serverPath = argv[++arg];
+            threadMode = 1;
+        } else if (strcmp(argv[arg], "--attach") == 0 && arg + 1 < argc) {
+            attachPath = argv[++arg];
+        } else if (strcmp(argv[arg], "--alarm-log") == 0 && arg + 1 < argc) {
+            alarmLogOption = argv[++arg];
+        } else {
+            fprintf(stderr, "usage: OrangeWave [--threads] [--pid-dir directory] [--control socket|none] [--metrics-port port]\n"
+                            "                  [--record file] [--replay file [--fast]] [--adaptive] [--config file] [--lean]\n"
+                            "                  [--alarm-log file]\n"
+                            "       OrangeWave [--config file] [--lean] [--check-allocations warmup] --batch script|-\n"
+                            "       OrangeWave [--pid-dir directory] [--adaptive] [--config file] [--lean] [--alarm-log file] --server socket\n"
+                            "       OrangeWave --attach socket\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The client of a server needs none of what follows
+    if (attachPath != NULL) {
+        return runAttach(attachPath);
+    }
+
+    if (leanMode) {
+        // Every thread allocating from the same arena keeps the heap to one set of pages
+        mallopt(M_ARENA_MAX, 1);
+        pthread_attr_init(&leanThreads);
+        pthread_attr_setstacksize(&leanThreads, LEAN_STACK_SIZE);
+        threadAttributes = &leanThreads;
+        outputBufferSize = LEAN_OUTPUT_BUFFER_SIZE;
+        historyReserve(LEAN_HISTORY_BYTES, LEAN_HISTORY_LINES);
+    }
+
+    // Loaded before anything forks, since the panels need the clocks and refresh time too
+    if (configPath[0] == '\0') {
+        snprintf(configPath, sizeof(configPath), "%s/.orangewaverc", getenv("HOME") != NULL ? getenv("HOME") : ".");
+    }
+    configLoad(configPath);
+    refreshTime = config.refreshTime;
+
+    // Created before anything forks, so that every process shares the same statistics
+    stats = mmap(NULL, sizeof(struct statsRegion), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    mySlot = &stats->slots[STATS_PROMPT];
+    atomic_store(&stats->adaptive, adaptive || config.adaptive);
+
+    // Batch mode only needs the command engine
+    if (allocationWarmup >= 0 && batchScript == NULL) {
+        fprintf(stderr, "--check-allocations only checks a --batch script\n");
+        exit(EXIT_FAILURE);
+    }
+#ifndef COUNT_ALLOCATIONS
+    if (allocationWarmup >= 0) {
+        fprintf(stderr, "This build does not count allocations (build it with cmake -DOW_COUNT_ALLOCATIONS=ON)\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+    if (batchScript != NULL) {
+        if (config.problem[0] != '\0') {
+            fprintf(stderr, "%s: %s\n", configPath, config.problem);
+        }
+        return runBatch(batchScript);
+    }
 
-int main(void){
     pthread_mutex_init(&printLock, NULL);
+    pthread_atfork(NULL, NULL, threadForked);
+    pthread_mutex_init(&commandLock, NULL);
 
-    // Declaring the signal handler that will be receiving & handling SIGALRM calls from the presblock daemon
-    signal(SIGALRM, (__sighandler_t) signal_handler);
-    // Displaying the Process ID that presblock needs to be provided
-    printf("Please enter this PID inside presblock: %d", getpid());
-    fflush(stdout);
-    sleep(5);
+    sigemptyset(&alarmSignals);
+    sigaddset(&alarmSignals, SIGALRM);
+    for (int sig = SIGRTMIN; sig < SIGRTMIN + RT_ALARM_SIGNALS; sig++) {
+        sigaddset(&alarmSignals, sig);
+    }
+
+    // Declaring the signal handler that will be receiving & handling SIGALRM calls from the presblock daemon.
+    // All alarm signals are blocked while one is being handled so that the alarm is never updated by 2 handlers at once.
+    struct sigaction alarmAction;
+    memset(&alarmAction, 0, sizeof(alarmAction));
+    alarmAction.sa_handler = signal_handler;
+    alarmAction.sa_flags = SA_RESTART;
+    alarmAction.sa_mask = alarmSignals;
+    if (replayPath != NULL) {
+        alarmAction.sa_sigaction = replay_signal_handler;
+        alarmAction.sa_flags = SA_SIGINFO | SA_RESTART;
+    }
+    sigaction(SIGALRM, &alarmAction, NULL);
+    // Queued real-time alarms carry a sequence number and send time, so they need an SA_SIGINFO handler.
+    struct sigaction rtAction;
+    memset(&rtAction, 0, sizeof(rtAction));
+    rtAction.sa_sigaction = replayPath != NULL ? replay_signal_handler : rt_signal_handler;
+    rtAction.sa_flags = SA_SIGINFO | SA_RESTART;
+    rtAction.sa_mask = alarmSignals;
+    for (int sig = SIGRTMIN; sig < SIGRTMIN + RT_ALARM_SIGNALS; sig++) {
+        sigaction(sig, &rtAction, NULL);
+    }
+    // SIGTERM asks for the same clean exit as the 'exit' command, in every process
+    struct sigaction stopAction;
+    memset(&stopAction, 0, sizeof(stopAction));
+    stopAction.sa_handler = stop_handler;
+    sigaction(SIGTERM, &stopAction, NULL);
+
+    // The write end is close-on-exec, so that external commands (and anything they leave running) never hold it open
+    if (pipe(stopPipe) != 0 || fcntl(stopPipe[1], F_SETFD, FD_CLOEXEC) != 0 || pipe(readyPipe) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    fcntl(readyPipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(readyPipe[1], F_SETFD, FD_CLOEXEC);
+
+    // The session log is opened before forking, so that every process appends to it
+    if (recordPath != NULL) {
+        recordFd = open(recordPath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (recordFd < 0 || write(recordFd, SESSION_MAGIC, 8) != 8) {
+            perror(recordPath);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (replayPath != NULL) {
+        if (access(replayPath, R_OK) != 0) {
+            perror(replayPath);
+            exit(EXIT_FAILURE);
+        }
+        if (pipe2(replayKeys, O_CLOEXEC) != 0 || pipe2(replayAck, O_CLOEXEC) != 0) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Publishing the Process ID that presblock needs to be provided: presblock finds it in the PID file by itself,
+    // and the PID is also shown in the output panel, so there is no need to wait for it to be copied.
+    // The alarm log and the control socket go in the same directory, so none of them is made in one which is not
+    // this user's alone.
+    int pidDirUsable = pidDirOpen(pidDir) == 0;
+    if (!pidDirUsable) {
+        fprintf(stderr, "%s: %s, so there is no PID file, alarm log or control socket there\n", pidDir, strerror(errno));
+    } else if (writePidFile(pidDir) != 0) {
+        perror("PID file");
+    }
+    // Mapped before forking, like the statistics
+    char defaultAlarmLog[PATH_MAX + 16];
+    snprintf(defaultAlarmLog, sizeof(defaultAlarmLog), "%s/%d.alarms", pidDir, (int) getpid());
+    if (alarmLogOption != NULL && alarmLogOpen(alarmLogOption, 1) != 0) {
+        fprintf(stderr, "%s: %s, logging the alarms to %s instead\n", alarmLogOption, strerror(errno), defaultAlarmLog);
+    }
+    if (alarmLog == NULL && pidDirUsable && alarmLogOpen(defaultAlarmLog, 0) != 0) {
+        perror(defaultAlarmLog);
+    }
+    if (control == NULL && !pidDirUsable) {
+        control = "none";
+    }
+    if (control == NULL) {
+        char defaultControl[PATH_MAX + 16];
+        snprintf(defaultControl, sizeof(defaultControl), "%s/%d.sock", pidDir, (int) getpid());
+        control = defaultControl;
+        if (strlen(control) < sizeof(controlPath)) {
+            strcpy(controlPath, control);
+        } else {
+            fprintf(stderr, "%s: the path is too long for a socket, so there is no control socket.\n", control);
+        }
+    } else if (strcmp(control, "none") != 0) {
+        if (strlen(control) >= sizeof(controlPath)) {
+            fprintf(stderr, "The control socket path is too long.\n");
+            exit(EXIT_FAILURE);
+        }
+        strcpy(controlPath, control);
+    }
+    // Created before forking, so that the alarm handlers of every process can wake the control socket
+    alarmEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (serverPath != NULL) {
+        if (config.problem[0] != '\0') {
+            fprintf(stderr, "%s: %s\n", configPath, config.problem);
+        }
+        return runServer(serverPath);
+    }
+
+    if (threadMode) {
+        // The alarm signals are only handled by the task2 thread, so that getch() in task1 is never interrupted.
+        // Threads inherit the signal mask, so the signals are blocked before any thread is created.
+        // SIGTERM is likewise kept for this thread, where it interrupts the wait for input.
+        sigset_t threadSignals = alarmSignals;
+        sigaddset(&threadSignals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &threadSignals, NULL);
+        pthread_t thread1, thread2;
+        if (pthread_create(&thread1, threadAttributes, task2Thread, NULL) != 0 || pthread_create(&thread2, threadAttributes, task3Thread, NULL) != 0) {
+            fprintf(stderr, "Error creating the alarm and time threads.\n");
+            exit(EXIT_FAILURE);
+        }
+        sigemptyset(&threadSignals);
+        sigaddset(&threadSignals, SIGTERM);
+        pthread_sigmask(SIG_UNBLOCK, &threadSignals, NULL);
+        int ready = waitReady(2) == 0;
+        if (ready) {
+            task1();
+        }
+
+        // Every thread waits on stopCond, so they all finish their loops (and clean up) straight away
+        requestStop();
+        pthread_join(thread1, NULL);
+        pthread_join(thread2, NULL);
+        unlink(pidFilePath);
+        alarmLogClose();
+        return ready ? 0 : EXIT_FAILURE;
+    }
 
     // Forking the Parent Process into 2 child processes
     pid_t child1, child2;
+    int ready = 0;
 
     if (!(child1 = fork())) {
         // first child - Alarm Panel
+        close(stopPipe[1]);
         task2();
         _exit(0);
     } else if (!(child2 = fork())) {
         // second child - Time Panel
+        close(stopPipe[1]);
         task3();
         _exit(0);
     } else {
-        // parent
-        task1();
+        // parent - waits until both Shared Memory Segments exist before attaching to them, and gives up (stopping
+        // the children) if they never do
+        ready = waitReady(2) == 0;
+        if (ready) {
+            task1();
+        }
     }
 
-    // By setting runLoop to 0, all 'infinite' loops will terminate
-    runLoop = 0;
-    // Give the methods some time to execute the code after the 'infinite' loops (clean up) before killing the processes
-    sleep(2);
-
-    // Killing off the child processes - (SIGTERM can be used to let processes clean up)
-    kill(child1, SIGKILL);
-    kill(child2, SIGKILL);
+    // Closing the stop pipe ends the 'infinite' loops of every child straight away, and they go on to clean up
+    // (task2 and task3 destroy the Shared Memory Segments)
+    requestStop();
+    // Waiting for the children to finish; one which does not finish within the timeout is terminated, then killed
+    reapChild(child1, 500);
+    reapChild(child2, 500);
+    unlink(pidFilePath);
+    alarmLogClose();
 
-    return 0;
+    return ready ? 0 : EXIT_FAILURE;
 }
 
 int task1(){
     WINDOW * mainwin;
     WINDOW * promptPanel, * outputPanel;
-    WINDOW * alarmPanel, * colourPanel;
-    WINDOW * timePanel;
 
     // Getting maximum dimensions of terminal
     //getmaxyx(mainwin, mainwinY, mainwinX);
     struct winsize mainwinSize;
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &mainwinSize);
-
-    // Setting sizes of every window
-    int mainwinY = mainwinSize.ws_row, mainwinX = mainwinSize.ws_col;
-
-    int promptY  = mainwinY/4, promptX = mainwinX;      // Y=24 or 43 - X=80 or 143 (windowed 24*80)(Fullscreen 43*143)
-    int outputY = mainwinY/2, outputX = mainwinX;
-    //int outputY = 80, outputX = 256;
-
-    alarmY = mainwinY/4; int alarmX = mainwinX*3/8;
-    int colourY = mainwinY/4, colourX = mainwinX/8;
-
-    int timeY = mainwinY/4, timeX = mainwinX/2;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &mainwinSize) != 0 || mainwinSize.ws_row == 0) {
+        // Not a terminal, so the size ncurses uses instead
+        mainwinSize.ws_row = (unsigned short) (getenv("LINES") != NULL ? atoi(getenv("LINES")) : 24);
+        mainwinSize.ws_col = (unsigned short) (getenv("COLUMNS") != NULL ? atoi(getenv("COLUMNS")) : 80);
+    }
 
     // Initialize ncurses
     if ( (mainwin = initscr()) == NULL ) {
         fprintf(stderr, "Error initialising ncurses.\n");
         exit(EXIT_FAILURE);
     }
-
     // Switch off echoing
     //noecho();
+    if (replayPath != NULL) {
+        // The keys typed during a replay are dropped, so they must not be echoed either
+        noecho();
+    }
     // Switch off cursor
     curs_set(0);
 
-    // subwin(WINDOW, sizeY, sizeX, locationY, locationX);
-    // Initializing the prompt panel
-    promptPanel = subwin(mainwin, promptY, promptX, (mainwinY*3/4), 0);
-    // add a border to the prompt panel
-    box(promptPanel, 0, 0);
-    wrefresh(promptPanel);
-    // Initializing the output panel
-    outputPanel = subwin(mainwin, outputY, outputX, (mainwinY*1/4), 0);
-    box(outputPanel, 0, 0);
-    wrefresh(outputPanel);
-
-    // Initializing the alarm panel
-    alarmPanel = subwin(mainwin, alarmY, alarmX, 0, timeX);
-    box(alarmPanel, 0, 0);
-    wrefresh(alarmPanel);
-    // Initializing the colour panel
-    colourPanel = subwin(mainwin, colourY, colourX, 0, (timeX+alarmX));
-    box(colourPanel, 0, 0);
-    wrefresh(colourPanel);
-
-    // Initializing the time panel
-    timePanel = subwin(mainwin, timeY, timeX, 0, 0);
-    box(timePanel, 0, 0);
-    wrefresh(timePanel);
+    struct panelSet panels;
+    createPanels(&panels, mainwinSize.ws_row, mainwinSize.ws_col);
+    promptPanel = panels.prompt;
+    outputPanel = panels.output;
+    alarmPanel = panels.alarm;
+    colourPanel = panels.colour;
+    timePanel = panels.time;
+    alarmY = panels.alarmY;
+    int outputY = panels.outputY;
 
 
 
-    // Private Shared Memory Segments
+    // Private Shared Memory Segments (in thread mode the structs simply live in this process)
+    struct alarmInfo * alarm_shm = threadAlarm;
+    struct timeZones * time_shm = threadTimes;
 
-    // Alarm Panel Private Shared Memory Segment identifier
-    key_t alarmKey = 0x0001;
-    size_t alarmSize = sizeof(struct alarmInfo);   // alarmY*alarmX (+colourY)
-    int alarm_shmid = shmget(alarmKey, alarmSize, 0666);
-    if (alarm_shmid < 0) {
-        perror("shmget");
-        exit(1);
-    }
-    // Attaching to the Private Shared Memory Segment which is storing the Alarm Panel
-    struct alarmInfo * alarm_shm = (struct alarmInfo *) shmat(alarm_shmid, NULL, 0);
-    if (alarm_shm == (struct alarmInfo *) -1) {
-        perror("shmat");
-        exit(1);
-    }
+    if (!threadMode) {
+        // Alarm Panel Private Shared Memory Segment identifier
+        key_t alarmKey = 0x0001;
+        size_t alarmSize = sizeof(struct alarmInfo);   // alarmY*alarmX (+colourY)
+        int alarm_shmid = shmget(alarmKey, alarmSize, 0666);
+        if (alarm_shmid < 0) {
+            perror("shmget");
+            exit(1);
+        }
+        // Attaching to the Private Shared Memory Segment which is storing the Alarm Panel
+        alarm_shm = (struct alarmInfo *) shmat(alarm_shmid, NULL, 0);
+        if (alarm_shm == (struct alarmInfo *) -1) {
+            perror("shmat");
+            exit(1);
+        }
 
-    // Time Panel Private Shared Memory Segment identifier
-    key_t timeKey = 0x0002;
-    size_t timeSize = sizeof(struct timeZones);   // timeY*timeX
-    int time_shmid = shmget(timeKey, timeSize, 0666);
-    if (time_shmid < 0) {
-        perror("shmget");
-        exit(1);
-    }
-    // Attaching to the Private Shared Memory Segment which is storing the Time Panel
-    struct timeZones * time_shm = (struct timeZones *) shmat(time_shmid, NULL, 0);
-    if (time_shm == (struct timeZones *) -1) {
-        perror("shmat");
-        exit(1);
+        // Time Panel Private Shared Memory Segment identifier
+        key_t timeKey = 0x0002;
+        size_t timeSize = sizeof(struct timeZones);   // timeY*timeX
+        int time_shmid = shmget(timeKey, timeSize, 0666);
+        if (time_shmid < 0) {
+            perror("shmget");
+            exit(1);
+        }
+        // Attaching to the Private Shared Memory Segment which is storing the Time Panel
+        time_shm = (struct timeZones *) shmat(time_shmid, NULL, 0);
+        if (time_shm == (struct timeZones *) -1) {
+            perror("shmat");
+            exit(1);
+        }
     }
 
 
-    // Starting Colours in ncurses
-    start_color();
-
-    // Change the RGB values of the colour YELLOW to those of the colour orange
-    init_color(COLOR_YELLOW, 1000, 647, 0);
-
-    // Defining the colour pairs which will be used for the alarm colour bar
-    init_pair(1, COLOR_BLACK, COLOR_WHITE);
-    init_pair(2, COLOR_BLACK, COLOR_RED);
-    init_pair(3, COLOR_BLACK, COLOR_YELLOW);
-    init_pair(4, COLOR_BLACK, COLOR_GREEN);
-    init_pair(5, COLOR_BLACK, COLOR_BLUE);
-
-    // Alarm Panel Updater - Reads from Alarm Shared Memory Segment and outputs to Alarm Panel
-    pid_t alarmPanelMGR = fork();
-    if (alarmPanelMGR < 0){
-        mvwprintw(alarmPanel, 1, 1, "Fork Failed");
-    } else if (alarmPanelMGR == 0){
-        alarm_shm->alarmLC = 1;
-        while(runLoop == 1) {
-            sleep(1);
-
-            pthread_mutex_lock(&printLock);
-            // Printing the time from the shared memory segment + Alarm Received
-            mvwprintw(alarmPanel, alarm_shm->alarmLC, 1, "[%s] Alarm Received",alarm_shm->message);
-            // Changing the colour of the alarm panel
-            wbkgd(colourPanel, COLOR_PAIR(alarm_shm->colour));
-            // Printing that the alarm has been handled
-            mvwprintw(alarmPanel, (alarm_shm->alarmLC + 1), 1, "[%s] Alarm Handled",alarm_shm->message);
-            wrefresh(colourPanel);
-            wrefresh(alarmPanel);
-            pthread_mutex_unlock(&printLock);
-        }
+    // The time panel shows the times of the shared clock when it can (mapped before forking, in process mode)
+    if (replayPath == NULL) {
+        panelClock = clockOpen(0);
     }
 
-
+    // Alarm Panel Updater - Reads from Alarm Shared Memory Segment and outputs to Alarm Panel
     // Time Panel Updater - Reads from Time Shared Memory Segment and outputs to Time Panel
-    pid_t timePanelMGR = fork();
-    if (timePanelMGR < 0){
-        mvwprintw(timePanel, 1, 1, "Fork Failed");
-    } else if (timePanelMGR == 0){
-        while(runLoop == 1) {
-            sleep(refreshTime);
+    pid_t alarmPanelMGR = 0, timePanelMGR = 0;
+    pthread_t alarmPanelTID, timePanelTID;
+    int alarmPanelStarted = 0, timePanelStarted = 0;
+    if (threadMode) {
+        // SIGTERM must reach this thread (the prompt loop), so the updaters are created with it blocked
+        sigset_t termSignal;
+        sigemptyset(&termSignal);
+        sigaddset(&termSignal, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &termSignal, NULL);
+        alarmPanelStarted = pthread_create(&alarmPanelTID, threadAttributes, alarmPanelThread, alarm_shm) == 0;
+        if (!alarmPanelStarted){
+            mvwprintw(alarmPanel, 1, 1, "Thread Failed");
+        }
+        timePanelStarted = pthread_create(&timePanelTID, threadAttributes, timePanelThread, time_shm) == 0;
+        if (!timePanelStarted){
+            mvwprintw(timePanel, 1, 1, "Thread Failed");
+        }
+        pthread_sigmask(SIG_UNBLOCK, &termSignal, NULL);
+    } else {
+        alarmPanelMGR = fork();
+        if (alarmPanelMGR < 0){
+            mvwprintw(alarmPanel, 1, 1, "Fork Failed");
+        } else if (alarmPanelMGR == 0){
+            close(stopPipe[1]);
+            alarmPanelLoop(alarm_shm);
+            _exit(0);
+        }
 
-            pthread_mutex_lock(&printLock);
-            mvwprintw(timePanel, 1, 1, time_shm->USAtime);
-            mvwprintw(timePanel, 2, 1, time_shm->MALTAtime);
-            mvwprintw(timePanel, 3, 1, time_shm->TOKYOtime);
-            wrefresh(timePanel);
-            pthread_mutex_unlock(&printLock);
+        timePanelMGR = fork();
+        if (timePanelMGR < 0){
+            mvwprintw(timePanel, 1, 1, "Fork Failed");
+        } else if (timePanelMGR == 0){
+            close(stopPipe[1]);
+            timePanelLoop(time_shm);
+            _exit(0);
         }
     }
 
 
     // Char which stores the character inputted by the user
-    char inputChar;
-    // Array of characters which will store the command entered by the user
-    char command[20];
-    // Array of characters which will store the argument entered by the user
-    char argument[200];
+    char inputChar = 0;
 
-    // internal shell variables
-    char prompt[32];
-    char path[256];
-    //unsigned int refreshTime;
-    char buffer[16];
-    int buffery;
-    int bufferx;
+    initShell("output");
+    shell->outputPanel = outputPanel;
+    shell->outputY = outputY;
+    shell->outputLC = 1;
 
-    // default values of shell internal variables (set)
-    strcpy(prompt,"OK");
-    //refreshTime = 1;
-    strcpy(buffer, "80x256");
-    sscanf(buffer, "%dx%d",&buffery,&bufferx);  // buffery=80;bufferx=256;
+    // Output of the commands entered at the prompt goes to the output panel and the output file
+    struct ttySnapshot promptSeen = { 0 };
+    struct commandOutput screen = { .screen = 1, .transcript = 1, .ttySeen = &promptSeen };
 
-    // accessing a file to store output in
-    FILE * outputFP;
-    outputFP = fopen("output", "w");
+    // Reporting the PID for presblock, and how long it took to get here
+    commandPrint(&screen, "Orange Wave PID: %d (%s), ready in %.1f ms",getpid(),pidFilePath,elapsedMs(&startTime));
+    if (configSource != NULL) {
+        commandPrint(&screen, "Configuration %s %s in %.2f ms",configPath,configSource,configMs);
+    }
+    if (config.problem[0] != '\0') {
+        commandPrint(&screen, "Configuration %s: %s",configPath,config.problem);
+    }
+    timedRefresh(outputPanel);
 
-    FILE * systemFP;
+    // Serving the control socket from a thread of this process, so that scripts can run commands too
+    pthread_t controlTID;
+    int controlStarted = 0;
+    // And /metrics, for monitoring. Both threads are created with SIGTERM and the alarm signals blocked: SIGTERM
+    // must reach the prompt, and the alarm handlers must never run in two threads at once.
+    sigset_t helperSignals, previousSignals;
+    helperSignals = alarmSignals;
+    sigaddset(&helperSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &helperSignals, &previousSignals);
+    if (controlPath[0] != '\0') {
+        controlStarted = pthread_create(&controlTID, threadAttributes, controlThread, alarm_shm) == 0;
+    }
+    pthread_t metricsTID;
+    int metricsStarted = 0;
+    if (metricsPort > 0) {
+        metricsStarted = pthread_create(&metricsTID, threadAttributes, metricsThread, alarm_shm) == 0;
+    }
+    // And the replay of a session log. The alarms it raises are handled by another thread, as they are blocked in it.
+    pthread_t replayTID;
+    int replayStarted = 0;
+    struct replayTarget replayTarget = { alarm_shm, time_shm };
+    if (replayPath != NULL) {
+        atomic_store(&replayActive, 1);
+        replayStarted = pthread_create(&replayTID, threadAttributes, replayThread, &replayTarget) == 0;
+        if (!replayStarted) {
+            atomic_store(&replayActive, 0);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previousSignals, NULL);
 
-    // counter which stores which line the program is on in the Prompt Panel(for cursor)
-    int promptLC = 1;
-    int outputLC = 1;
-    int i, j;   // counters
-    char var[10];   // will store which internal variable will be changed
-    char temp[256];   // used as a temporary character array
+    // The line being typed
+    struct promptLine prompt = { .panel = promptPanel, .line = 1 };
+    int exiting = 0;
+    // The statistics overlay (stats on), redrawn every second while it is shown, and what it showed last time
+    WINDOW * overlay = NULL;
+    struct ttySnapshot overlaySeen = { 0 };
+    // Whether the last key came from the replay, and has not been acknowledged yet
+    int replayPending = 0;
     do{
         // Outputting the prompt (eg: OK>)
-        pthread_mutex_lock(&printLock);
-        // clear the line you will start writing to
-        wmove(promptPanel, promptLC, 1); wclrtoeol(promptPanel); box(promptPanel, 0, 0);
-        mvwprintw(promptPanel, promptLC, 1, "%s>",prompt);
-        wrefresh(promptPanel);
-        pthread_mutex_unlock(&printLock);
+        lockPrint();
+        promptShow(&prompt);
+        unlockPrint();
         //wnoutrefresh(promptPanel);
         //doupdate();
 
-        // Getting user input
-        pthread_mutex_lock(&printLock);
-        //mvwscanw(promptPanel, promptLC, (int) strlen(prompt)+2, "%s %180[^\n]s",command,argument);
-        //pthread_mutex_unlock(&printLock);
-        i=0;
         // Getting input character by character
         do{
-            // Get the user inputted character and store it
-            inputChar = (char) getch();
-            if (inputChar == 127 && i != 0) {   //KEY_BACKSPACE
-                i--;
-                temp[i] = '\0';
-                wmove(promptPanel, promptLC, (int) (strlen(prompt)+2+i+1)); wclrtoeol(promptPanel); box(promptPanel, 0, 0);
-                wrefresh(promptPanel);
-            } else if (inputChar == 13){
-                temp[i] = '\0';
+            // Wait for a key without holding printLock, so that the panels keep updating while the user is typing.
+            // The stop pipe becomes readable when the program is asked to exit from the control socket, and keys
+            // also come from the replay of a session log.
+            if (replayPending) {
+                // The replayed key has been dealt with (and its command run), so the next event may follow
+                char done = 1;
+                if (write(replayAck[1], &done, 1) != 1) {
+                    perror("replay");
+                }
+                replayPending = 0;
+            }
+            struct pollfd input[3] = { { .fd = STDIN_FILENO, .events = POLLIN }, { .fd = stopPipe[0], .events = POLLIN },
+                                       { .fd = replayKeys[0], .events = POLLIN } };
+            int ready;
+            while ((ready = poll(input, 3, overlay != NULL ? 1000 : -1)) <= 0 && runLoop == 1) {
+                if (ready == 0) {
+                    lockPrint();
+                    updateStatsOverlay(&overlay, &overlaySeen, outputPanel);
+                    unlockPrint();
+                } else if (errno != EINTR) {
+                    break;
+                }
+            }
+            if (runLoop != 1 || input[1].revents != 0) {
+                // SIGTERM (or 'run exit' on the control socket) was received, so carry on as if 'exit' had been entered
+                snprintf(prompt.text, sizeof(prompt.text), "exit");
                 break;
+            }
+
+            unsigned long long frameStart = rawNs();
+            lockPrint();
+            // Get the user inputted character (or the replayed one) and store it
+            if ((input[2].revents & POLLIN) && read(replayKeys[0], &inputChar, 1) == 1) {
+                replayPending = 1;
             } else {
-                temp[i] = inputChar;
-                i++;
-                // echo the user's input in the prompt panel
-                mvwaddch(promptPanel, promptLC, (int) (strlen(prompt)+2+i), inputChar);
-                wrefresh(promptPanel);
+                unsigned long long inputStart = rawNs();
+                int key = getch();
+                statRecord(&mySlot->input, rawNs() - inputStart);
+                if (key == ERR || (key == 'q' && atomic_load(&replayActive))) {
+                    // The terminal has gone, or q was pressed during a replay, so exit as for SIGTERM
+                    unlockPrint();
+                    snprintf(prompt.text, sizeof(prompt.text), "exit");
+                    break;
+                }
+                if (atomic_load(&replayActive)) {
+                    // Any other key is dropped, so that only the replayed ones are typed at the prompt
+                    unlockPrint();
+                    continue;
+                }
+                inputChar = (char) key;
             }
+            recordEvent(EVENT_KEY, (unsigned char) inputChar, 0);
+            if (promptKey(&prompt, inputChar)) {
+                unlockPrint();
+                break;
+            }
+            unlockPrint();
+            frameDone(frameStart);
         } while(inputChar != '\n'); // do this until the user presses 'Enter'
-        temp[i] = '\0';
-        sscanf(temp, "%s %180[^\n]s",command,argument);
-        wrefresh(promptPanel);
-        pthread_mutex_unlock(&printLock);
+        lockPrint();
+        timedRefresh(promptPanel);
+        unlockPrint();
 
+        // Handling the user's chosen command
+        pthread_mutex_lock(&commandLock);
+        lockPrint();
+        exiting = runCommand(prompt.text, &screen);
+        timedRefresh(outputPanel);
+        updateStatsOverlay(&overlay, &overlaySeen, outputPanel);
+        unlockPrint();
+        pthread_mutex_unlock(&commandLock);
 
+        promptNext(&prompt);
 
-        // Handling the user's chosen command
-        pthread_mutex_lock(&printLock);
-        if (strcmp(command, "chdir") == 0) {
-            strcpy(temp, getcwd(0,0));
-            chdir(argument);
-            mvwprintw(outputPanel, outputLC, 1, "Directory changed from: %s to: %s",temp,getcwd(0,0));
-            fprintf(outputFP, "Directory changed from: %s to: %s\n",temp,getcwd(0,0));
-        } else if (strcmp(command, "shdir") == 0){
-            mvwprintw(outputPanel, outputLC, 1, "Current Directory: %s",getcwd(0,0));
-            fprintf(outputFP, "Current Directory: %s\n",getcwd(0,0));
-        } else if (strcmp(command, "print") == 0){
-            //mvwaddstr(outputPanel, outputLC, 1, argument);
-            mvwprintw(outputPanel, outputLC, 1, "%s",argument);
-            fprintf(outputFP, "%s\n",argument);
-        } else if (strcmp(command, "printvar") == 0){
-            if (strcmp(argument, "prompt") == 0){
-                mvwprintw(outputPanel, outputLC, 1, "prompt: %s",prompt);
-                fprintf(outputFP, "prompt: %s\n",prompt);
-            } else if (strcmp(argument, "path") == 0){
-                mvwprintw(outputPanel, outputLC, 1, "path: %s",path);
-                fprintf(outputFP, "path: %s\n",path);
-            } else if (strcmp(argument, "refresh") == 0){
-                mvwprintw(outputPanel, outputLC, 1, "refresh: %u",refreshTime);
-                fprintf(outputFP, "refresh: %u\n",refreshTime);
-            } else if (strcmp(argument, "buffer") == 0){
-                mvwprintw(outputPanel, outputLC, 1, "buffer: %dx%d",buffery,bufferx);
-                fprintf(outputFP, "buffer: %dx%d\n",buffery,bufferx);
-            }
-        } else if (strcmp(command, "set") == 0){
-            // finding out which variable will be set and what value it will be set to
-            i = 0, j = 0;
-            while(argument[i] != '=') {
-                var[j] = argument[i];
-                i++;
-                j++;
-            }
-            var[j] = '\0';
-            i++;    // for = sign
-            j = 0;
-            while(argument[i] != '\0') {
-                temp[j] = argument[i];
-                i++;
-                j++;
-            }
-            temp[j] = '\0';
-
-            //sscanf(argument, "%16[^=]s=%180[^\n]s",var,temp);
-
-            // var now holds the variable to be set
-            // temp holds the value of the variable
-            if (strcmp(var, "prompt") == 0){
-                strcpy(prompt, temp);
-                mvwprintw(outputPanel, outputLC, 1, "prompt was set to: %s",prompt);
-                fprintf(outputFP, "prompt was set to: %s\n",prompt);
-            } else if (strcmp(var, "path") == 0){
-                strcpy(path, temp);
-                mvwprintw(outputPanel, outputLC, 1, "path was set to: %s",path);
-                fprintf(outputFP, "path was set to: %s\n",path);
-            } else if (strcmp(var, "refresh") == 0){
-                refreshTime = atoi(temp);
-                mvwprintw(outputPanel, outputLC, 1, "refresh was set to: %u",refreshTime);
-                fprintf(outputFP, "refresh was set to: %u\n",refreshTime);
-            } else if (strcmp(var, "buffer") == 0){
-                sscanf(temp, "%dx%d",&buffery,&bufferx);
-                wresize(outputPanel, buffery, bufferx); wrefresh(outputPanel);
-                mvwprintw(outputPanel, outputLC, 1, "buffer was set to: %dx%d",buffery,bufferx);
-                fprintf(outputFP, "buffer was set to: %dx%d\n",buffery,bufferx);
-            }
-        } else if (strcmp(command, "move") == 0){
-            mvwprintw(outputPanel, outputLC, 1, "Window was moved by %d",atoi(argument));
-            fprintf(outputFP, "Window was moved by %d\n",atoi(argument));
-        } else if (strcmp(command, "exit") == 0){
-            mvwprintw(outputPanel, outputLC, 1, "Orange Wave will now exit");
-            fprintf(outputFP, "Orange Wave will now exit");
-        } else{     // external command
-            strcpy(temp, command); strcat(temp, " "); strcat(temp, argument);
-            mvwprintw(outputPanel, outputLC, 1, "%s was not found as a built-in function, trying to run as an external command",temp);
-            fprintf(outputFP, "%s was not found as a built-in function, trying to run as an external command\n",temp);
-            // redirecting the output of the system call to the tempOut File
-            strcat(temp, " > tempOut");
-            // emptying tempOut File
-            systemFP = fopen("tempOut", "w");
-            fclose(systemFP);
-            // Making the system call with the user's command + output redirection
-            system(temp);
-            // reading from the text file and outputting the result
-            systemFP = fopen("tempOut", "r");
-            strcpy(temp, "");
-            fgets(temp, 250, systemFP);
-            fclose(systemFP);
-            mvwprintw(outputPanel, ++outputLC, 1, "%s",temp);
-            fprintf(outputFP, "%s\n",temp);
-        }
-        wrefresh(outputPanel);
-        pthread_mutex_unlock(&printLock);
-
-        // if the Line Counter for the Prompt Panel has reached the end, then start from the beginning/top again
-        if(promptLC < (promptY-2)){
-            promptLC++;
-        } else{
-            promptLC = 1;
-        }
+    }while(!exiting);   // loops until exit is entered
 
-        if(outputLC < (outputY-2)){
-            outputLC++;
-        } else{
-            outputLC = 1;
+    // The panel updaters (and the control socket, whose clients may be running commands) are stopped and waited for
+    // before their windows are deleted
+    requestStop();
+    if (controlStarted) {
+        pthread_join(controlTID, NULL);
+    }
+    if (metricsStarted) {
+        pthread_join(metricsTID, NULL);
+    }
+    if (replayStarted) {
+        pthread_join(replayTID, NULL);
+    }
+    if (threadMode) {
+        if (alarmPanelStarted) {
+            pthread_join(alarmPanelTID, NULL);
         }
-
-    }while(strcmp(command, "exit") != 0);   // ==0 means they are equal, so != will loop until exit is entered
+        if (timePanelStarted) {
+            pthread_join(timePanelTID, NULL);
+        }
+    } else {
+        if (alarmPanelMGR > 0) {
+            reapChild(alarmPanelMGR, 500);
+        }
+        if (timePanelMGR > 0) {
+            reapChild(timePanelMGR, 500);
+        }
+    }
 
     // Clean up after ourselves
-    delwin(promptPanel);
-    delwin(outputPanel);
-    delwin(alarmPanel);
-    delwin(colourPanel);
-    delwin(timePanel);
+    if (overlay != NULL) {
+        delwin(overlay);
+    }
+    deletePanels(&panels);
     delwin(mainwin);
     endwin();
     refresh();
 
     // Close the File
-    fclose(outputFP);
-
-    // Detach the Shared Memory segments
-    shmdt(alarm_shm);
-    shmdt(time_shm);
+    fclose(shell->outputFP);
 
-    // killing off the child processes
-    kill(alarmPanelMGR, SIGKILL);
-    kill(timePanelMGR, SIGKILL);
+    if (!threadMode) {
+        // Detach the Shared Memory segments
+        shmdt(alarm_shm);
+        shmdt(time_shm);
+    }
+    clockClose(panelClock, 0);
 
     return 0;
 }
 
-int task2(){
+// Creates the panels of a terminal whose screen ncurses has just started, rows by columns, once the colours are set up
+void createPanels(struct panelSet * panels, int rows, int columns){
+    // Setting sizes of every window
+    int mainwinY = rows, mainwinX = columns;
 
-    // Shared memory segment
+    int promptY  = mainwinY/4, promptX = mainwinX;      // Y=24 or 43 - X=80 or 143 (windowed 24*80)(Fullscreen 43*143)
+    int outputY = mainwinY/2, outputX = mainwinX;
+    //int outputY = 80, outputX = 256;
 
-    // Alarm Panel Private Shared Memory Segment identifier
-    key_t alarmKey = 0x0001;
-    size_t alarmSize = sizeof(struct alarmInfo);   //alarmY*alarmX
-    // Create the Private Shared Memory Segment
-    int alarm_shmid = shmget(alarmKey, alarmSize, IPC_CREAT | 0666);
-    if (alarm_shmid < 0) {
-        perror("shmget");
-        exit(1);
+    int alarmY = mainwinY/4; int alarmX = mainwinX*3/8;
+    int colourY = mainwinY/4, colourX = mainwinX/8;
+
+    int timeY = mainwinY/4, timeX = mainwinX/2;
+
+    // Starting Colours in ncurses, before anything is drawn: changing the default colours afterwards would make every
+    // process repaint the whole screen
+    start_color();
+
+    // Change the RGB values of the colour YELLOW to those of the colour orange
+    init_color(COLOR_YELLOW, 1000, 647, 0);
+
+    // Defining the colour pairs which will be used for the alarm colour bar
+    init_pair(1, COLOR_BLACK, COLOR_WHITE);
+    init_pair(2, COLOR_BLACK, COLOR_RED);
+    init_pair(3, COLOR_BLACK, COLOR_YELLOW);
+    init_pair(4, COLOR_BLACK, COLOR_GREEN);
+    init_pair(5, COLOR_BLACK, COLOR_BLUE);
+
+    // Colour pairs for the ANSI colours in the output of external commands: every foreground and background out of
+    // the terminal's default (-1) and the 8 standard colours, from pair SGR_PAIR_BASE onwards
+    use_default_colors();
+    for (short fg = -1; fg < 8; fg++) {
+        for (short bg = -1; bg < 8; bg++) {
+            if (SGR_PAIR(fg, bg) < COLOR_PAIRS) {
+                init_pair(SGR_PAIR(fg, bg), fg, bg);
+            }
+        }
     }
-    // Attach to the segment
-    struct alarmInfo * alarm_shm = (struct alarmInfo *) shmat(alarm_shmid, NULL, 0);
-    if (alarm_shm == (struct alarmInfo *) -1) {
-        perror("shmat");
-        exit(1);
+
+    WINDOW * mainwin = stdscr;
+    panels->main = mainwin;
+    panels->promptY = promptY;
+    panels->outputY = outputY;
+    panels->alarmY = alarmY;
+    // subwin(WINDOW, sizeY, sizeX, locationY, locationX);
+    // Initializing the prompt panel
+    panels->prompt = subwin(mainwin, promptY, promptX, (mainwinY*3/4), 0);
+    // add a border to the prompt panel
+    box(panels->prompt, 0, 0);
+    timedRefresh(panels->prompt);
+    // Initializing the output panel
+    panels->output = subwin(mainwin, outputY, outputX, (mainwinY*1/4), 0);
+    box(panels->output, 0, 0);
+    timedRefresh(panels->output);
+
+    // Initializing the alarm panel
+    panels->alarm = subwin(mainwin, alarmY, alarmX, 0, timeX);
+    box(panels->alarm, 0, 0);
+    timedRefresh(panels->alarm);
+    // Initializing the colour panel
+    panels->colour = subwin(mainwin, colourY, colourX, 0, (timeX+alarmX));
+    box(panels->colour, 0, 0);
+    timedRefresh(panels->colour);
+
+    // Initializing the time panel
+    panels->time = subwin(mainwin, timeY, timeX, 0, 0);
+    box(panels->time, 0, 0);
+    timedRefresh(panels->time);
+    // The cursor is hidden, so refreshing the panels which update by themselves need not put it back anywhere
+    leaveok(panels->alarm, TRUE);
+    leaveok(panels->colour, TRUE);
+    leaveok(panels->time, TRUE);
+}
+
+// Deletes the panels made by createPanels
+void deletePanels(struct panelSet * panels){
+    delwin(panels->prompt);
+    delwin(panels->output);
+    delwin(panels->alarm);
+    delwin(panels->colour);
+    delwin(panels->time);
+}
+
+// Starts a new line of the prompt panel with the prompt (eg: OK>). Called with printLock held, as are the two below.
+void promptShow(struct promptLine * prompt){
+    // clear the line you will start writing to
+    wmove(prompt->panel, prompt->line, 1); wclrtoeol(prompt->panel); drawPromptBox(prompt->panel);
+    mvwprintw(prompt->panel, prompt->line, 1, "%s>",shell->prompt);
+    timedRefresh(prompt->panel);
+    prompt->length = 0;
+    prompt->text[0] = '\0';
+}
+
+// Adds a key typed at the prompt to the line, echoing it. Returns 1 when the key was Enter, with the line complete.
+int promptKey(struct promptLine * prompt, char key){
+    int column = (int) strlen(shell->prompt) + 2;
+    if (key == 127 && prompt->length != 0) {   //KEY_BACKSPACE
+        prompt->text[--prompt->length] = '\0';
+        wmove(prompt->panel, prompt->line, column + prompt->length + 1); wclrtoeol(prompt->panel); drawPromptBox(prompt->panel);
+        timedRefresh(prompt->panel);
+    } else if (key == 13){
+        return 1;
+    } else if (prompt->length < (int) sizeof(prompt->text) - 1) {
+        prompt->text[prompt->length++] = key;
+        prompt->text[prompt->length] = '\0';
+        // echo the user's input in the prompt panel
+        mvwaddch(prompt->panel, prompt->line, column + prompt->length, key);
+        timedRefresh(prompt->panel);
     }
+    return 0;
+}
 
-    // Set the current time for the presblock
-    clock_gettime(CLOCK_MONOTONIC, &time2);
+// Moves on to the next line of the prompt panel once a command has run
+void promptNext(struct promptLine * prompt){
+    // if the Line Counter for the Prompt Panel has reached the end, then start from the beginning/top again
+    if (prompt->line < getmaxy(prompt->panel) - 2) {
+        prompt->line++;
+    } else {
+        prompt->line = 1;
+    }
+}
 
-    // Does not allow the Shared Memory Segment to be destroyed until the program is ready to exit
-    while(runLoop == 1){
-        pause();
+// Sets the internal shell variables to their starting values (from the configuration file, or the defaults), and
+// opens the output file (transcript)
+void initShell(const char * transcript){
+    // starting values of shell internal variables (set); refresh is set by main, before the panels are started
+    snprintf(shell->prompt, sizeof(shell->prompt), "%s", config.prompt);
+    snprintf(shell->path, sizeof(shell->path), "%s", config.path);
+    shell->buffery = config.buffery;
+    shell->bufferx = config.bufferx;
+    shell->native = config.native;
+    if (getcwd(shell->cwd, sizeof(shell->cwd)) == NULL) {
+        shell->cwd[0] = '\0';
     }
+    shell->dirDepth = 0;
 
-    // Destroying the Shared Memory Segment when we are done
-    if(shmctl(alarm_shmid, IPC_RMID ,NULL) == -1) {
-        perror("shmctl");
-        exit(1);
+    // accessing a file to store output in
+    shell->outputFP = fopen(transcript, "w");
+}
+
+// Loads the configuration file into config: from its snapshot if the file hasn't changed since the snapshot was made,
+// otherwise by parsing the file, after which the snapshot is saved again. Without a file the defaults are used.
+void configLoad(const char * path){
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    config = defaultConfig;
+
+    struct stat rc;
+    if (stat(path, &rc) != 0) {
+        if (errno != ENOENT) {
+            snprintf(config.problem, sizeof(config.problem), "%s", strerror(errno));
+        }
+        return;
+    }
+    char snapshotPath[PATH_MAX + 16];
+    snprintf(snapshotPath, sizeof(snapshotPath), "%s.snapshot", path);
+
+    int fd = open(snapshotPath, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat st;
+        struct configSnapshot * snapshot = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size == (off_t) sizeof(struct configSnapshot)) {
+            snapshot = mmap(NULL, sizeof(struct configSnapshot), PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (snapshot != MAP_FAILED) {
+            int valid = memcmp(snapshot->magic, CONFIG_MAGIC, 8) == 0
+                        && snapshot->configSize == sizeof(struct shellConfig)
+                        && snapshot->mtimeSec == (int64_t) rc.st_mtim.tv_sec
+                        && snapshot->mtimeNsec == (int64_t) rc.st_mtim.tv_nsec
+                        && snapshot->fileSize == (int64_t) rc.st_size
+                        && snapshot->checksum == configChecksum(&snapshot->config);
+            if (valid) {
+                config = snapshot->config;
+            }
+            munmap(snapshot, sizeof(struct configSnapshot));
+            if (valid) {
+                configSource = "from its snapshot";
+                configMs = elapsedMs(&start);
+                return;
+            }
+        }
+    }
+
+    struct shellConfig parsed = defaultConfig;
+    if (configParse(path, &parsed) != 0) {
+        snprintf(config.problem, sizeof(config.problem), "%s", strerror(errno));
+        return;
+    }
+    config = parsed;
+    configSave(snapshotPath, &parsed, &rc);
+    configSource = "parsed";
+    configMs = elapsedMs(&start);
+}
+
+// Parses the configuration file into parsed, which holds the defaults to start from. Lines which can't be used are
+// skipped, and the first of them is kept in parsed->problem. Returns -1 if the file can't be read.
+int configParse(const char * path, struct shellConfig * parsed){
+    FILE * rcFP = fopen(path, "r");
+    if (rcFP == NULL) {
+        return -1;
     }
+    char line[512];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), rcFP) != NULL) {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char * first = line + strspn(line, " \t");
+        if (*first == '\0' || *first == '#') {
+            continue;
+        }
+        char word[16];
+        int used = 0;
+        sscanf(first, "%15s %n", word, &used);
+        char * rest = first + used;
 
+        const char * error = NULL;
+        if (strcmp(word, "set") == 0) {
+            error = configSet(parsed, rest);
+        } else if (strcmp(word, "clock") == 0) {
+            // clock N +H[:MM] label
+            int index = 0, hours = 0, minutes = 0, labelAt = 0;
+            char sign = '+';
+            if (sscanf(rest, "%d %c%d%n:%d%n", &index, &sign, &hours, &labelAt, &minutes, &labelAt) < 3
+                || index < 1 || index > CONFIG_CLOCKS || (sign != '+' && sign != '-')
+                || hours < 0 || minutes < 0 || minutes > 59 || hours*60 + minutes > 14*60) {
+                error = "clock needs a number (1-3), an offset such as +9 or -3:30 and a label";
+            }
+            if (error == NULL) {
+                char * label = rest + labelAt;
+                label += strspn(label, " \t");
+                if (*label == '\0' || strlen(label) >= sizeof(parsed->clocks[0].label)) {
+                    error = "clock labels are 1 to 31 characters";
+                } else {
+                    struct worldClock * clock = &parsed->clocks[index - 1];
+                    clock->offsetMinutes = (sign == '-' ? -1 : 1) * (hours*60 + minutes);
+                    snprintf(clock->label, sizeof(clock->label), "%s", label);
+                }
+            }
+        } else if (strcmp(word, "colours") == 0 || strcmp(word, "colors") == 0) {
+            int limits[4];
+            char extra;
+            if (sscanf(rest, "%d %d %d %d %c", &limits[0], &limits[1], &limits[2], &limits[3], &extra) != 4
+                || limits[0] < 1 || limits[1] <= limits[0] || limits[2] <= limits[1] || limits[3] <= limits[2]) {
+                error = "colours needs 4 increasing limits in seconds";
+            } else {
+                memcpy(parsed->colourLimits, limits, sizeof(limits));
+            }
+        } else {
+            error = "unknown setting";
+        }
+        if (error != NULL && parsed->problem[0] == '\0') {
+            snprintf(parsed->problem, sizeof(parsed->problem), "line %d: %s", lineNumber, error);
+        }
+    }
+    fclose(rcFP);
     return 0;
 }
-// Signal Handling method for the presblock daemon
-void signal_handler(int sig){
 
-    // Attaching to the Alarm Shared Memory Segment
-    key_t alarmKey = 0x0001;
-    size_t alarmSize = sizeof(struct alarmInfo);   // alarmY*alarmX (+colourY?)
-    int alarm_shmid = shmget(alarmKey, alarmSize, 0666);
-    if (alarm_shmid < 0) {
-        perror("shmget");
-        exit(1);
+// Applies one 'set var=value' line of the configuration file. Returns NULL, or why it can't be used.
+const char * configSet(struct shellConfig * parsed, char * assignment){
+    char * value = strchr(assignment, '=');
+    if (value == NULL) {
+        return "set needs var=value";
     }
-    // Attaching to the Private Shared Memory Segment which is storing the Alarm Panel
-    struct alarmInfo * alarm_shm = (struct alarmInfo *) shmat(alarm_shmid, NULL, 0);
-    if (alarm_shm == (struct alarmInfo *) -1) {
-        perror("shmat");
-        exit(1);
+    *value++ = '\0';
+    assignment[strcspn(assignment, " \t")] = '\0';
+
+    char extra;
+    if (strcmp(assignment, "prompt") == 0) {
+        if (strlen(value) >= sizeof(parsed->prompt)) {
+            return "prompt is at most 31 characters";
+        }
+        snprintf(parsed->prompt, sizeof(parsed->prompt), "%s", value);
+    } else if (strcmp(assignment, "path") == 0) {
+        if (strlen(value) >= sizeof(parsed->path)) {
+            return "path is at most 255 characters";
+        }
+        snprintf(parsed->path, sizeof(parsed->path), "%s", value);
+    } else if (strcmp(assignment, "refresh") == 0) {
+        unsigned int refresh;
+        if (sscanf(value, "%u %c", &refresh, &extra) != 1 || refresh < 1 || refresh > 3600) {
+            return "refresh is 1 to 3600 seconds";
+        }
+        parsed->refreshTime = refresh;
+    } else if (strcmp(assignment, "buffer") == 0) {
+        int buffery, bufferx;
+        if (sscanf(value, "%dx%d %c", &buffery, &bufferx, &extra) != 2 || buffery < 1 || bufferx < 1) {
+            return "buffer is rowsxcolumns";
+        }
+        parsed->buffery = buffery;
+        parsed->bufferx = bufferx;
+    } else if (strcmp(assignment, "adaptive") == 0) {
+        if (strcmp(value, "on") != 0 && strcmp(value, "off") != 0) {
+            return "adaptive is on or off";
+        }
+        parsed->adaptive = strcmp(value, "on") == 0;
+    } else if (strcmp(assignment, "native") == 0) {
+        if (nativeParse(value, &parsed->native) != 0) {
+            return "native is all, none or a list of ls,cat,echo,pwd,wc,head";
+        }
+    } else {
+        return "unknown variable";
+    }
+    return NULL;
+}
+
+uint64_t configChecksum(struct shellConfig * parsed){
+    const unsigned char * bytes = (const unsigned char *) parsed;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(struct shellConfig); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
     }
+    return hash;
+}
 
+// Saves the snapshot of a parsed configuration file. It is written to a temporary file which is then renamed, so that
+// a startup running at the same time never maps half a snapshot. Failing to save it only costs parsing the file again.
+void configSave(const char * path, struct shellConfig * parsed, struct stat * rc){
+    struct configSnapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    memcpy(snapshot.magic, CONFIG_MAGIC, 8);
+    snapshot.configSize = sizeof(struct shellConfig);
+    snapshot.mtimeSec = rc->st_mtim.tv_sec;
+    snapshot.mtimeNsec = rc->st_mtim.tv_nsec;
+    snapshot.fileSize = rc->st_size;
+    snapshot.config = *parsed;
+    snapshot.checksum = configChecksum(&snapshot.config);
 
-    if (sig == SIGALRM){
-        time1 = time2;
-        clock_gettime(CLOCK_MONOTONIC, &time2);
+    char temporary[PATH_MAX + 32];
+    snprintf(temporary, sizeof(temporary), "%s.%d", path, (int) getpid());
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return;
+    }
+    int written = write(fd, &snapshot, sizeof(snapshot)) == (ssize_t) sizeof(snapshot);
+    close(fd);
+    if (!written || rename(temporary, path) != 0) {
+        unlink(temporary);
+    }
+}
+
+// Batch mode: runs the commands of a script (or of stdin, for "-") one per line, printing their output to stdout and
+// the output file. Neither ncurses nor any other process is started. Blank lines and lines starting with # are
+// skipped, and 'exit' ends the script early. With --check-allocations, the commands after the first
+// allocationWarmup (which let the buffers grow to fit) must not allocate at all, or batch mode fails.
+int runBatch(const char * script){
+    FILE * scriptFP = strcmp(script, "-") == 0 ? stdin : fopen(script, "r");
+    if (scriptFP == NULL) {
+        perror(script);
+        return EXIT_FAILURE;
+    }
+    initShell("output");
+    struct ttySnapshot batchSeen = { 0 };
+    struct commandOutput batch = { .transcript = 1, .stream = stdout, .ttySeen = &batchSeen };
 
-        int timeDiff = time2.tv_sec - time1.tv_sec;
-
-        // Decide which colour pair to display based on the interarrival time and store it in the Shared Memory Segment
-        if (timeDiff < 5){
-            // white
-            alarm_shm->colour = 1;
-        } else if (timeDiff>=5 && timeDiff<10){
-            // red
-            alarm_shm->colour = 2;
-        } else if (timeDiff>=10 && timeDiff<15){
-            // orange
-            alarm_shm->colour = 3;
-        } else if (timeDiff>=15 && timeDiff<=20){
-            // green
-            alarm_shm->colour = 4;
+    char line[4096];
+    unsigned long commands = 0;
+    unsigned long long allocationsWarm = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (fgets(line, sizeof(line), scriptFP) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char * first = line + strspn(line, " \t");
+        if (*first == '\0' || *first == '#') {
+            continue;
+        }
+        if (commands == (unsigned long) allocationWarmup) {
+            allocationsWarm = allocationsMade();
+        }
+        commands++;
+        if (runCommand(first, &batch)) {
+            break;
+        }
+    }
+    double seconds = elapsedMs(&start) / 1000;
+    fflush(stdout);
+    fprintf(stderr, "%lu commands in %.3f s (%.0f commands/s)\n", commands, seconds,
+            seconds > 0 ? commands / seconds : 0.0);
+    int status = EXIT_SUCCESS;
+    if (allocationWarmup >= 0) {
+        if (commands <= (unsigned long) allocationWarmup) {
+            fprintf(stderr, "Only %lu commands, all of them warming up\n", commands);
+            status = EXIT_FAILURE;
         } else {
-            // blue
-            alarm_shm->colour = 5;
+            unsigned long long made = allocationsMade() - allocationsWarm;
+            fprintf(stderr, "%llu allocations in the %lu commands after warming up\n", made,
+                    commands - (unsigned long) allocationWarmup);
+            if (made > 0) {
+                status = EXIT_FAILURE;
+            }
+        }
+    }
+
+    if (scriptFP != stdin) {
+        fclose(scriptFP);
+    }
+    if (shell->outputFP != NULL) {
+        fclose(shell->outputFP);
+    }
+    return status;
+}
+
+// Runs a command line, counting it and timing it for /metrics
+int runCommand(const char * line, struct commandOutput * out){
+    unsigned long long start = rawNs();
+    int exiting = executeCommand(line, out);
+    atomic_fetch_add_explicit(&stats->commands, 1, memory_order_relaxed);
+    histogramRecord(&stats->commandLatency, rawNs() - start);
+    return exiting;
+}
+
+// Runs one command line of the shell, printing its output to out. Returns 1 if the command was 'exit'.
+// Called with commandLock and printLock held, as it changes the internal shell variables and may draw in the output
+// panel (external commands let printLock go while they wait).
+int executeCommand(const char * line, struct commandOutput * out){
+    // Array of characters which will store the command entered by the user
+    char command[20] = "";
+    // Array of characters which will store the argument entered by the user
+    char argument[200] = "";
+    char temp[PATH_MAX];    // used as a temporary character array
+
+    sscanf(line, "%19s %180[^\n]", command, argument);
+    if (command[0] == '\0') {
+        return 0;
+    }
+    if (cwdShell != shell) {
+        if (chdir(shell->cwd) != 0) {
+            commandPrint(out, "chdir: %s: %s",shell->cwd,strerror(errno));
         }
+        cwdShell = shell;
+    }
 
-        // Store the time at which the alarm was received in the Shared Memory Segment
-        strftime(alarm_shm->message, 31, "%H:%M:%S", gmtime(&time2.tv_sec));
+    // search pattern (or /pattern for short) prints the most recent lines of output which match the pattern. A line
+    // whose first word is the path of a program (/bin/echo hi) runs the program instead.
+    const char * searched = NULL;
+    if (strcmp(command, "search") == 0) {
+        searched = line + strspn(line, " \t") + strlen(command);
+        searched += strspn(searched, " \t");
+    } else if (line[0] == '/') {
+        struct stat st;
+        snprintf(temp, sizeof(temp), "%.*s", (int) strcspn(line, " \t"), line);
+        if (stat(temp, &st) != 0 || !S_ISREG(st.st_mode) || access(temp, X_OK) != 0) {
+            searched = line + 1;
+        }
+    }
+    if (searched != NULL) {
+        struct historyPattern pattern;
+        if (patternCompile(&pattern, searched, temp, sizeof(temp)) != 0) {
+            commandPrint(out, "%s: %s",line,temp);
+            return 0;
+        }
+        printMatches(&pattern, line, out);
+        regfree(&pattern.regex);
+        return 0;
+    }
 
-        // Change the y-coordinate at which the alarm prompts will be printed inside tha alarm panel
-        if(alarm_shm->alarmLC < (alarmY-4)){
-            alarm_shm->alarmLC += 2;
+    if (strcmp(command, "chdir") == 0) {
+        changeDirectory(argument, out);
+    } else if (strcmp(command, "shdir") == 0){
+        commandPrint(out, "Current Directory: %s",shell->cwd);
+    } else if (strcmp(command, "pushd") == 0){
+        // pushd <dir> changes to dir, keeping the current directory to go back to; on its own it swaps the current
+        // directory with the one pushd kept last
+        if (argument[0] == '\0' && shell->dirDepth == 0){
+            commandPrint(out, "pushd: no other directory");
+        } else if (argument[0] == '\0'){
+            snprintf(temp, sizeof(temp), "%s", shell->dirStack[shell->dirDepth - 1]);
+            snprintf(shell->dirStack[shell->dirDepth - 1], PATH_MAX, "%s", shell->cwd);
+            if (changeDirectory(temp, out) != 0){
+                snprintf(shell->dirStack[shell->dirDepth - 1], PATH_MAX, "%s", temp);
+            }
+        } else if (shell->dirDepth == DIR_STACK){
+            commandPrint(out, "pushd: the directory stack is full");
+        } else if (shell->dirStack == NULL && (shell->dirStack = calloc(DIR_STACK, PATH_MAX)) == NULL){
+            commandPrint(out, "pushd: %s",strerror(errno));
+        } else{
+            snprintf(shell->dirStack[shell->dirDepth++], PATH_MAX, "%s", shell->cwd);
+            if (changeDirectory(argument, out) != 0){
+                shell->dirDepth--;
+            }
+        }
+    } else if (strcmp(command, "popd") == 0){
+        if (shell->dirDepth == 0){
+            commandPrint(out, "popd: the directory stack is empty");
+        } else if (changeDirectory(shell->dirStack[shell->dirDepth - 1], out) == 0){
+            shell->dirDepth--;
+        }
+    } else if (strcmp(command, "dirs") == 0){
+        commandPrint(out, "%s",shell->cwd);
+        for (int depth = shell->dirDepth - 1; depth >= 0; depth--){
+            commandPrint(out, "%s",shell->dirStack[depth]);
+        }
+    } else if (strcmp(command, "j") == 0){
+        // j <fragment>... changes to the highest ranked directory containing the fragments in that order; on its own
+        // it lists the highest ranked directories
+        char words[200];
+        char * fragments[16];
+        int count = 0;
+        char * save;
+        snprintf(words, sizeof(words), "%s", argument);
+        for (char * word = strtok_r(words, " \t", &save); word != NULL && count < 16; word = strtok_r(NULL, " \t", &save)){
+            fragments[count++] = word;
+        }
+        jumpDirectory(fragments, count, out);
+    } else if (strcmp(command, "print") == 0){
+        commandPrint(out, "%s",argument);
+    } else if (strcmp(command, "printvar") == 0){
+        if (getVariable(argument, temp, sizeof(temp)) == 0){
+            commandPrint(out, "%s: %s",argument,temp);
+        } else{
+            commandPrint(out, "%s is not an internal variable",argument);
+        }
+    } else if (strcmp(command, "set") == 0){
+        // finding out which variable will be set and what value it will be set to
+        char * equals = strchr(argument, '=');
+        if (equals == NULL){
+            commandPrint(out, "set expects variable=value");
+        } else{
+            *equals = '\0';
+            if (setVariable(argument, equals + 1, out) == -1){
+                commandPrint(out, "%s is not an internal variable",argument);
+            }
+        }
+    } else if (strcmp(command, "move") == 0){
+        commandPrint(out, "Window was moved by %d",atoi(argument));
+    } else if (strcmp(command, "exit") == 0){
+        commandPrint(out, "Orange Wave will now exit");
+        return 1;
+    } else if (strcmp(command, "time") == 0){
+        // time <command> runs the command and reports what it took; on its own, it prints the totals per command
+        if (argument[0] == '\0'){
+            printCommandTable(out);
+            return 0;
+        }
+        unsigned long before = shell->commandsRun;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int exiting = executeCommand(argument, out);
+        if (shell->commandsRun != before){
+            formatRecord(&shell->lastCommand, temp, sizeof(temp));
+            commandPrint(out, "%s",temp);
+        } else{
+            commandPrint(out, "real %.3f ms (built-in)",elapsedMs(&start));
+        }
+        return exiting;
+    } else if (strcmp(command, "alarms") == 0){
+        alarmsCommand(argument, out);
+    } else if (strcmp(command, "stats") == 0){
+        // stats on|off shows or hides the statistics overlay, stats dump [file] writes every counter to a file, and
+        // stats on its own prints them
+        char file[200] = "stats";
+        if (strcmp(argument, "on") == 0 || strcmp(argument, "off") == 0){
+            atomic_store(&stats->overlay, argument[1] == 'n');
+            commandPrint(out, "The statistics overlay is %s",argument);
+        } else if (sscanf(argument, "dump %199s", file) >= 0 && strncmp(argument, "dump", 4) == 0){
+            if (dumpStats(file) == 0){
+                commandPrint(out, "Statistics written to %s",file);
+            } else{
+                commandPrint(out, "Statistics could not be written to %s: %s",file,strerror(errno));
+            }
+        } else{
+            char lines[16][160];
+            int count = statsLines(lines, 16, out->ttySeen);
+            for (int line = 0; line < count; line++){
+                commandPrint(out, "%s",lines[line]);
+            }
+        }
+    } else if (strcmp(command, "filter") == 0){
+        // filter <pattern> only shows the output which matches the pattern from now on, starting with the matches
+        // already in the history; filter off (or filter on its own) shows everything again
+        if (shell->filtering){
+            regfree(&shell->filterPattern.regex);
+            shell->filtering = 0;
+        }
+        if (argument[0] == '\0' || strcmp(argument, "off") == 0){
+            commandPrint(out, "The output is no longer filtered");
+        } else if (patternCompile(&shell->filterPattern, argument, temp, sizeof(temp)) != 0){
+            commandPrint(out, "%s: %s",line,temp);
         } else{
-            alarm_shm->alarmLC = 1;
+            shell->filtering = 1;
+            printMatches(&shell->filterPattern, line, out);
+        }
+    } else if (strcmp(command, "last") == 0){
+        // last [n] prints what the n most recent external commands took, the latest first
+        unsigned long count = argument[0] != '\0' ? strtoul(argument, NULL, 10) : 1;
+        if (count > RECENT_COMMANDS){
+            count = RECENT_COMMANDS;
+        }
+        if (count > commandsRun){
+            count = commandsRun;
+        }
+        if (commandsRun == 0){
+            commandPrint(out, "No external command has been run yet");
+        }
+        for (unsigned long n = 1; n <= count; n++){
+            formatRecord(&recentCommands[(commandsRun - n) % RECENT_COMMANDS], temp, sizeof(temp));
+            commandPrint(out, "%s",temp);
+        }
+    } else if (runNative(command, line, out) == 0){
+        // ran natively, without starting a shell
+    } else{     // external command
+        // The line as it was typed, since a program given by its path may not fit in command
+        snprintf(temp, sizeof(temp), "%s", line + strspn(line, " \t"));
+        commandPrint(out, "%s was not found as a built-in function, trying to run as an external command",temp);
+        // Running the user's command with its output streamed to the output panel, and accounting for what it used
+        struct commandRecord record;
+        if (runExternal(command, temp, &record, out) != 0){
+            commandPrint(out, "%s could not be run: %s",command,strerror(errno));
+            return 0;
+        }
+        recordCommand(&record);
+    }
+    return 0;
+}
+
+// Changes the current directory, printing where from and where to, and ranks the new one in the directory history.
+// Returns -1 (having printed why) if it can't be changed.
+int changeDirectory(const char * dir, struct commandOutput * out){
+    char previous[PATH_MAX];
+    snprintf(previous, sizeof(previous), "%s", shell->cwd);
+    if (chdir(dir) != 0) {
+        commandPrint(out, "chdir: %s: %s",dir,strerror(errno));
+        return -1;
+    }
+    if (getcwd(shell->cwd, sizeof(shell->cwd)) == NULL) {
+        snprintf(shell->cwd, sizeof(shell->cwd), "%s", dir);
+    }
+    commandPrint(out, "Directory changed from: %s to: %s",previous,shell->cwd);
+    dirsVisit(shell->cwd);
+    return 0;
+}
+
+// Maps the directory history, creating it if there is none. Returns -1 if it can't be used.
+int dirsOpen(){
+    if (dirs != NULL) {
+        return 0;
+    }
+    if (dirsFd >= 0) {
+        // It failed before, and won't do any better now
+        return -1;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.orangewave-dirs", getenv("HOME") != NULL ? getenv("HOME") : ".");
+    dirsFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (dirsFd < 0) {
+        dirsFd = INT_MAX;
+        return -1;
+    }
+    flock(dirsFd, LOCK_EX);
+    struct stat st;
+    int fresh = fstat(dirsFd, &st) == 0 && st.st_size == 0;
+    // The file is sparse: only the records in use take up any space
+    if (fresh && ftruncate(dirsFd, sizeof(struct dirsFile)) != 0) {
+        fresh = 0;
+    }
+    if (fresh || (fstat(dirsFd, &st) == 0 && st.st_size == (off_t) sizeof(struct dirsFile))) {
+        struct dirsFile * mapped = mmap(NULL, sizeof(struct dirsFile), PROT_READ | PROT_WRITE, MAP_SHARED, dirsFd, 0);
+        if (mapped != MAP_FAILED) {
+            if (fresh) {
+                memcpy(mapped->magic, DIRS_MAGIC, 8);
+            }
+            if (memcmp(mapped->magic, DIRS_MAGIC, 8) == 0 && mapped->count <= DIRS_CAPACITY) {
+                dirs = mapped;
+                dirsRepair();
+            } else {
+                munmap(mapped, sizeof(struct dirsFile));
+            }
         }
+    }
+    flock(dirsFd, LOCK_UN);
+    return dirs != NULL ? 0 : -1;
+}
 
+// Counts a visit to a directory in the directory history
+void dirsVisit(const char * path){
+    size_t length = strlen(path);
+    if (length >= DIRS_PATH || dirsOpen() != 0) {
+        return;
+    }
+    flock(dirsFd, LOCK_EX);
+    uint32_t hash = dirsHash(path, length);
+    uint32_t slot = dirsFind(path, length, hash);
+    struct dirEntry * entry;
+    if (dirs->slots[slot] != 0) {
+        entry = &dirs->entries[dirs->slots[slot] - 1];
     } else {
-        perror("Unexpected Signal Received");
+        uint32_t n = dirs->count;
+        if (n < DIRS_CAPACITY) {
+            dirs->count++;
+            dirs->slots[slot] = n + 1;
+        } else {
+            // Full: the lowest ranked directory makes way
+            n = 0;
+            for (uint32_t other = 1; other < dirs->count; other++) {
+                if (dirs->entries[other].rank < dirs->entries[n].rank) {
+                    n = other;
+                }
+            }
+            dirs->totalRank -= dirs->entries[n].rank;
+        }
+        entry = &dirs->entries[n];
+        entry->rank = 0;
+        entry->hash = hash;
+        entry->length = (uint16_t) length;
+        memcpy(entry->path, path, length + 1);
+        memset(&dirs->signatures[n], 0, sizeof(struct dirSignature));
+        dirsSignature(path, length, &dirs->signatures[n]);
+        if (dirs->slots[slot] == 0) {
+            dirsReindex();
+        }
     }
+    entry->rank += 1;
+    entry->lastVisit = time(NULL);
+    dirs->totalRank += 1;
 
-    // Detach from the shared memory segment
-    shmdt(alarm_shm);
+    if (dirs->totalRank > DIRS_MAX_RANK) {
+        double total = 0;
+        for (uint32_t n = 0; n < dirs->count; ) {
+            dirs->entries[n].rank *= DIRS_AGING;
+            if (dirs->entries[n].rank < DIRS_MIN_RANK) {
+                dirs->count--;
+                dirs->entries[n] = dirs->entries[dirs->count];
+                dirs->signatures[n] = dirs->signatures[dirs->count];
+            } else {
+                total += dirs->entries[n++].rank;
+            }
+        }
+        dirs->totalRank = total;
+        dirsReindex();
+    }
+    flock(dirsFd, LOCK_UN);
 }
 
-int task3(){
-    // Shared memory segment
+// Drops the entries of a damaged history which can't be used (a path too long, or not ending where its length says)
+// and rebuilds the hash table if they had to go, a hash was wrong or it points past the entries, so that nothing read from the file is
+// trusted before it has been checked. Called with the file locked.
+void dirsRepair(){
+    int damaged = 0;
+    double total = 0;
+    for (uint32_t n = 0; n < dirs->count; ) {
+        struct dirEntry * entry = &dirs->entries[n];
+        if (entry->length >= DIRS_PATH || strnlen(entry->path, DIRS_PATH) != entry->length || !(entry->rank >= 0)) {
+            dirs->count--;
+            dirs->entries[n] = dirs->entries[dirs->count];
+            dirs->signatures[n] = dirs->signatures[dirs->count];
+            damaged = 1;
+        } else {
+            if (entry->hash != dirsHash(entry->path, entry->length)) {
+                entry->hash = dirsHash(entry->path, entry->length);
+                damaged = 1;
+            }
+            total += dirs->entries[n++].rank;
+        }
+    }
+    for (uint32_t slot = 0; slot < DIRS_SLOTS && !damaged; slot++) {
+        damaged = dirs->slots[slot] > dirs->count;
+    }
+    if (damaged) {
+        dirs->totalRank = total;
+        dirsReindex();
+    }
+}
 
-    // Time Panel Private Shared Memory Segment identifier
-    key_t timeKey = 0x0002;
-    size_t timeSize = sizeof(struct timeZones);   //timeY*timeX
-    // Create the Private Shared Memory Segment
-    int time_shmid = shmget(timeKey, timeSize, IPC_CREAT | 0666);
-    if (time_shmid < 0) {
-        perror("shmget");
-        exit(1);
+uint32_t dirsHash(const char * path, size_t length){
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) path[i]) * 16777619u;
     }
-    // Attach to the segment
-    struct timeZones * time_shm = (struct timeZones *) shmat(time_shmid, NULL, 0);
-    if (time_shm == (struct timeZones *) -1) {
-        perror("shmat");
-        exit(1);
+    return hash;
+}
+
+// Adds the pairs of consecutive characters of text to a signature
+void dirsSignature(const char * text, size_t length, struct dirSignature * signature){
+    for (size_t i = 0; i + 1 < length; i++) {
+        uint32_t pair = (uint32_t) (unsigned char) text[i] << 8 | (unsigned char) text[i + 1];
+        unsigned int bit = (pair * 0x9E3779B1u) >> 24;
+        signature->bits[bit >> 6] |= 1ULL << (bit & 63);
     }
+}
 
-    struct timeval USAtime;
-    struct timeval MALTAtime;
-    struct timeval TOKYOtime;
+// Finds the slot of a path in the hash table: the one holding it, or else the empty slot where it would go
+uint32_t dirsFind(const char * path, size_t length, uint32_t hash){
+    uint32_t slot = hash & (DIRS_SLOTS - 1);
+    while (dirs->slots[slot] != 0) {
+        struct dirEntry * entry = &dirs->entries[dirs->slots[slot] - 1];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->path, path, length) == 0) {
+            break;
+        }
+        slot = (slot + 1) & (DIRS_SLOTS - 1);
+    }
+    return slot;
+}
 
-    // while global is not 1
-    while (runLoop == 1) {
-        sleep(refreshTime);
+// Rebuilds the hash table after entries have been moved or replaced (aging, a full history, forgetting)
+void dirsReindex(){
+    memset(dirs->slots, 0, sizeof(dirs->slots));
+    for (uint32_t n = 0; n < dirs->count; n++) {
+        struct dirEntry * entry = &dirs->entries[n];
+        dirs->slots[dirsFind(entry->path, entry->length, entry->hash)] = n + 1;
+    }
+}
 
-        // Getting the current epoch time storing it in USAtime
-        gettimeofday(&USAtime, NULL);
-        // Reducing 6 Hours worth of seconds from the epoch time to adjust for the Time Zone
-        USAtime.tv_sec -= 6*(60*60);
-        // Storing the formatted time in the Shared Memory Segment
-        sprintf(time_shm->USAtime, "WHITE HOUSE [USA]: %s",ctime((const time_t *) &USAtime.tv_sec));
+// Frecency: how often a directory was visited, weighted by how long ago the last visit was
+double dirsScore(struct dirEntry * entry, time_t now){
+    time_t age = now - (time_t) entry->lastVisit;
+    if (age < 60*60) {
+        return entry->rank * 4;
+    } else if (age < 24*60*60) {
+        return entry->rank * 2;
+    } else if (age < 7*24*60*60) {
+        return entry->rank / 2;
+    }
+    return entry->rank / 4;
+}
 
-        gettimeofday(&MALTAtime, NULL);
-        MALTAtime.tv_sec += 1*(60*60);
-        sprintf(time_shm->MALTAtime, "MALTA [MSIDA]: %s",ctime((const time_t *) &MALTAtime.tv_sec));
+// Whether a directory contains every fragment, in order
+int dirsMatch(struct dirEntry * entry, char ** fragments, int count){
+    const char * at = entry->path;
+    const char * end = entry->path + entry->length;
+    for (int n = 0; n < count; n++) {
+        size_t length = strlen(fragments[n]);
+        const char * found = memmem(at, (size_t) (end - at), fragments[n], length);
+        if (found == NULL) {
+            return 0;
+        }
+        at = found + length;
+    }
+    return 1;
+}
 
-        gettimeofday(&TOKYOtime, NULL);
-        TOKYOtime.tv_sec += 9*(60*60);
-        sprintf(time_shm->TOKYOtime, "JAPAN [TOKYO]: %s",ctime((const time_t *) &TOKYOtime.tv_sec));
+// Removes a directory which no longer exists from the directory history
+void dirsForget(const char * path){
+    flock(dirsFd, LOCK_EX);
+    for (uint32_t n = 0; n < dirs->count; n++) {
+        if (strcmp(dirs->entries[n].path, path) == 0) {
+            dirs->totalRank -= dirs->entries[n].rank;
+            dirs->count--;
+            dirs->entries[n] = dirs->entries[dirs->count];
+            dirs->signatures[n] = dirs->signatures[dirs->count];
+            dirsReindex();
+            break;
+        }
     }
+    flock(dirsFd, LOCK_UN);
+}
 
-    // Destroying the Shared Memory Segment when we are done
-    if(shmctl(time_shmid, IPC_RMID ,NULL) == -1) {
-        perror("shmctl");
-        exit(1);
+// j: changes to the best match of the fragments in the directory history (forgetting the matches which no longer
+// exist on the way), or with no fragments lists the 10 highest ranked directories
+void jumpDirectory(char ** fragments, int count, struct commandOutput * out){
+    if (dirsOpen() != 0) {
+        commandPrint(out, "j: the directory history can't be opened");
+        return;
+    }
+    time_t now = time(NULL);
+    if (count == 0) {
+        struct dirEntry * top[10];
+        double topScore[10];
+        int shown = 0;
+        flock(dirsFd, LOCK_SH);
+        for (uint32_t n = 0; n < dirs->count; n++) {
+            double score = dirsScore(&dirs->entries[n], now);
+            int at = shown < 10 ? shown++ : 10;
+            while (at > 0 && topScore[at - 1] < score) {
+                if (at < 10) {
+                    top[at] = top[at - 1];
+                    topScore[at] = topScore[at - 1];
+                }
+                at--;
+            }
+            if (at < 10) {
+                top[at] = &dirs->entries[n];
+                topScore[at] = score;
+            }
+        }
+        for (int n = 0; n < shown; n++) {
+            commandPrint(out, "%8.1f  %s",topScore[n],top[n]->path);
+        }
+        flock(dirsFd, LOCK_UN);
+        if (shown == 0) {
+            commandPrint(out, "j: no directory has been visited yet");
+        }
+        return;
     }
+    // Every pair of consecutive characters of the fragments has to be in a matching path
+    struct dirSignature wanted = { { 0, 0, 0, 0 } };
+    for (int n = 0; n < count; n++) {
+        dirsSignature(fragments[n], strlen(fragments[n]), &wanted);
+    }
+    for (;;) {
+        struct dirEntry * best = NULL;
+        double bestScore = 0;
+        char path[DIRS_PATH];
+        flock(dirsFd, LOCK_SH);
+        for (uint32_t n = 0; n < dirs->count; n++) {
+            struct dirEntry * entry = &dirs->entries[n];
+            uint64_t * bits = dirs->signatures[n].bits;
+            if ((bits[0] & wanted.bits[0]) != wanted.bits[0] || (bits[1] & wanted.bits[1]) != wanted.bits[1]
+                || (bits[2] & wanted.bits[2]) != wanted.bits[2] || (bits[3] & wanted.bits[3]) != wanted.bits[3]
+                || !dirsMatch(entry, fragments, count)) {
+                continue;
+            }
+            // The current directory is never the best match, and a shorter path wins a tie
+            double score = dirsScore(entry, now);
+            if (strcmp(entry->path, shell->cwd) != 0
+                && (best == NULL || score > bestScore || (score == bestScore && entry->length < best->length))) {
+                best = entry;
+                bestScore = score;
+            }
+        }
+        if (best != NULL) {
+            memcpy(path, best->path, best->length + 1);
+        }
+        flock(dirsFd, LOCK_UN);
+        if (best == NULL) {
+            commandPrint(out, "j: no visited directory matches");
+            return;
+        }
+        if (access(path, X_OK) == 0) {
+            changeDirectory(path, out);
+            return;
+        }
+        dirsForget(path);
+    }
+}
 
-    return 0;
-}
\ No newline at end of file
+// Runs an external command through /bin/sh like system() did, streaming its output to out as it is produced, and
+// reaps it with wait4 so that the resources it used (and those of anything it waited for) are recorded
+int runExternal(const char * name, const char * line, struct commandRecord * record, struct commandOutput * out){
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int outPipe[2];
+    if (pipe2(outPipe, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    // A bigger pipe means fewer context switches between a chatty command and us (but more kernel memory per session)
+    if (!leanMode) {
+        fcntl(outPipe[0], F_SETPIPE_SZ, 1 << 20);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(outPipe[0]);
+        close(outPipe[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        // The alarm signals may be blocked in this thread, and the command should not inherit that
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        // dup2 clears close-on-exec on the copies. Errors are shown with the output, rather than written over the panels.
+        dup2(outPipe[1], STDOUT_FILENO);
+        dup2(outPipe[1], STDERR_FILENO);
+        if (shell != &mainShell) {
+            // A command of a server session reads nothing: the server's input is not the client's terminal
+            int none = open("/dev/null", O_RDONLY);
+            dup2(none, STDIN_FILENO);
+            setpgid(0, 0);
+            // The server ignores SIGPIPE (for its clients), which would otherwise be inherited
+            signal(SIGPIPE, SIG_DFL);
+        }
+        execl("/bin/sh", "sh", "-c", line, (char *) NULL);
+        _exit(127);
+    }
+    close(outPipe[1]);
+    if (shell != &mainShell) {
+        // As well as in the child, so that the group exists before the server can end it
+        setpgid(pid, pid);
+    }
+    atomic_store(&shell->child, pid);
+    if (currentSession != NULL) {
+        serverWaitBegin();
+    }
+    streamOutput(outPipe[0], out);
+    close(outPipe[0]);
+
+    int status;
+    struct rusage usage;
+    int held = releasePrint();
+    int waited;
+    while ((waited = wait4(pid, &status, 0, &usage)) < 0 && errno == EINTR) {
+    }
+    atomic_store(&shell->child, 0);
+    retakePrint(held);
+    if (currentSession != NULL) {
+        serverWaitEnd();
+    }
+    if (waited < 0) {
+        return -1;
+    }
+    snprintf(record->name, sizeof(record->name), "%s", name);
+    record->wallMs = elapsedMs(&start);
+    statRecord(&mySlot->external, (unsigned long long) (record->wallMs * 1e6));
+    record->userMs = usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0;
+    record->sysMs = usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+    record->maxRssKb = usage.ru_maxrss;
+    record->voluntarySwitches = usage.ru_nvcsw;
+    record->involuntarySwitches = usage.ru_nivcsw;
+    record->status = status;
+    return 0;
+}
+
+// Native versions of common external commands, which print straight to out instead of starting /bin/sh and the
+// command. Each one is only used while it is enabled (set native=...), and only for command lines which need nothing
+// from a shell (quotes, variables, wildcards, redirection, ...) and use options it knows; anything else still runs
+// as an external command.
+struct nativeCommand{
+    const char * name;
+    // Returns 0 once the command has run, or -1 (having printed nothing) if it has to run externally after all
+    int (*run)(int argc, char ** argv, struct commandOutput * out);
+};
+struct nativeCommand nativeCommands[NATIVE_COMMANDS] = {
+    { "ls", nativeLs }, { "cat", nativeCat }, { "echo", nativeEcho },
+    { "pwd", nativePwd }, { "wc", nativeWc }, { "head", nativeHead },
+};
+#define NATIVE_ARGS 32
+// Scratch space of the native commands, kept from one command to the next so that once it has grown to fit, they
+// allocate nothing. Only used with printLock held.
+struct byteBuffer nativeText;
+struct byteBuffer nativeNames;
+char ** nativeSorted = NULL;
+size_t nativeSortedCapacity = 0;
+#define SHELL_CHARACTERS "\"'\\$`*?[~|&;<>()#"
+
+// Runs a command natively if it is enabled and can be. Returns 0 if it did, -1 if it should run externally.
+int runNative(const char * command, const char * line, struct commandOutput * out){
+    int index = 0;
+    while (index < NATIVE_COMMANDS && strcmp(command, nativeCommands[index].name) != 0) {
+        index++;
+    }
+    // The arguments as they were typed, which have to fit in words
+    const char * argument = line + strspn(line, " \t");
+    argument += strcspn(argument, " \t");
+    char words[256];
+    if (index == NATIVE_COMMANDS || !(shell->native & (1u << index))
+        || argument[strcspn(argument, SHELL_CHARACTERS)] != '\0' || strlen(argument) >= sizeof(words)) {
+        return -1;
+    }
+    snprintf(words, sizeof(words), "%s", argument);
+    char * argv[NATIVE_ARGS + 1];
+    int argc = 0;
+    argv[argc++] = (char *) nativeCommands[index].name;
+    char * save;
+    for (char * word = strtok_r(words, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+        if (argc == NATIVE_ARGS) {
+            return -1;
+        }
+        argv[argc++] = word;
+    }
+    argv[argc] = NULL;
+    return nativeCommands[index].run(argc, argv, out);
+}
+
+// Parses the value of the native variable: all, none or a comma separated list of command names
+int nativeParse(const char * value, unsigned int * mask){
+    if (strcmp(value, "all") == 0) {
+        *mask = (1u << NATIVE_COMMANDS) - 1;
+        return 0;
+    }
+    unsigned int parsed = 0;
+    char names[128];
+    snprintf(names, sizeof(names), "%s", value);
+    char * save;
+    for (char * name = strtok_r(names, ",", &save); name != NULL && strcmp(value, "none") != 0; name = strtok_r(NULL, ",", &save)) {
+        int index = 0;
+        while (index < NATIVE_COMMANDS && strcmp(name, nativeCommands[index].name) != 0) {
+            index++;
+        }
+        if (index == NATIVE_COMMANDS) {
+            return -1;
+        }
+        parsed |= 1u << index;
+    }
+    *mask = parsed;
+    return 0;
+}
+
+void nativeFormat(unsigned int mask, char * value, size_t size){
+    size_t used = 0;
+    value[0] = '\0';
+    for (int index = 0; index < NATIVE_COMMANDS; index++) {
+        if ((mask & (1u << index)) && used < size) {
+            used += snprintf(value + used, size - used, "%s%s", used ? "," : "", nativeCommands[index].name);
+        }
+    }
+    if (used == 0) {
+        snprintf(value, size, "none");
+    }
+}
+
+// Opens a file for a native command: a regular file is mapped, and anything else (a pipe, a device, or a file of
+// /proc, whose size is 0) is left open in fd for the command to stream, as it may never end.
+// Returns -1 with errno set if it can't be opened.
+int nativeOpen(const char * path, struct nativeFile * file){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    int looked = fstat(fd, &st) == 0;
+    if (!looked || S_ISDIR(st.st_mode)) {
+        // st is only looked at if fstat filled it in
+        int error = looked ? EISDIR : errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+    file->fd = fd;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void * map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+            file->data = map;
+            file->size = (size_t) st.st_size;
+            file->mapped = 1;
+            close(fd);
+            file->fd = -1;
+        }
+    }
+    return 0;
+}
+
+void nativeClose(struct nativeFile * file){
+    if (file->mapped) {
+        munmap(file->data, file->size);
+    }
+    if (file->fd >= 0) {
+        close(file->fd);
+    }
+}
+
+// Whether every file can be mapped, as wc and head need; if one can't (a pipe, a device, a file of /proc), the command
+// runs externally. Files which can't be looked at are left for the command to report.
+int nativeMappable(int argc, char ** argv, int first){
+    for (int n = first; n < argc; n++) {
+        struct stat st;
+        if (stat(argv[n], &st) == 0 && !S_ISDIR(st.st_mode) && (!S_ISREG(st.st_mode) || st.st_size == 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int nativeNameOrder(const void * a, const void * b){
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// ls [-a|-A|-1] [file...]: one name per line (as ls prints to a pipe), sorted bytewise. Directories are read with
+// getdents64 into one buffer of names, with no stat per entry.
+int nativeLs(int argc, char ** argv, struct commandOutput * out){
+    int all = 0, almostAll = 0, first = 1;
+    while (first < argc && argv[first][0] == '-' && argv[first][1] != '\0') {
+        for (const char * option = argv[first] + 1; *option; option++) {
+            if (*option == 'a') {
+                all = 1;
+            } else if (*option == 'A') {
+                almostAll = 1;
+            } else if (*option != '1') {
+                return -1;
+            }
+        }
+        first++;
+    }
+    char * current[] = { "." };
+    char ** operands = first < argc ? argv + first : current;
+    int count = first < argc ? argc - first : 1;
+
+    // Like ls: the operands which don't exist are reported first, then the other files, then each directory
+    struct byteBuffer * text = &nativeText;
+    text->length = 0;
+    int directories = 0;
+    for (int n = 0; n < count; n++) {
+        struct stat st;
+        if (stat(operands[n], &st) != 0) {
+            commandPrint(out, "ls: cannot access '%s': %s",operands[n],strerror(errno));
+            operands[n] = NULL;
+        } else if (S_ISDIR(st.st_mode)) {
+            directories++;
+        } else {
+            bufferPrintf(text, "%s\n", operands[n]);
+            operands[n] = (char *) "";
+        }
+    }
+    int files = text->length > 0;
+    for (int n = 0; n < count; n++) {
+        if (operands[n] == NULL || operands[n][0] == '\0') {
+            continue;
+        }
+        int fd = open(operands[n], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            commandPrint(out, "ls: cannot open directory '%s': %s",operands[n],strerror(errno));
+            continue;
+        }
+        struct byteBuffer * names = &nativeNames;
+        names->length = 0;
+        size_t entries = 0;
+        char entryBuffer[32768];
+        long got;
+        while ((got = syscall(SYS_getdents64, fd, entryBuffer, sizeof(entryBuffer))) > 0) {
+            for (long at = 0; at < got; ) {
+                // struct linux_dirent64: inode (8 bytes), offset (8), record length (2), type (1), name
+                unsigned short recordLength;
+                memcpy(&recordLength, entryBuffer + at + 16, sizeof(recordLength));
+                const char * name = entryBuffer + at + 19;
+                at += recordLength;
+                if (name[0] == '.' && !all && (!almostAll || name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue;
+                }
+                bufferAppend(names, name, strlen(name) + 1);
+                entries++;
+            }
+        }
+        close(fd);
+        if (entries > nativeSortedCapacity) {
+            char ** grown = realloc(nativeSorted, entries * sizeof(char *));
+            if (grown == NULL) {
+                continue;
+            }
+            nativeSorted = grown;
+            nativeSortedCapacity = entries;
+        }
+        char ** sorted = nativeSorted;
+        char * name = names->data;
+        for (size_t entry = 0; entry < entries; entry++) {
+            sorted[entry] = name;
+            name += strlen(name) + 1;
+        }
+        qsort(sorted, entries, sizeof(char *), nativeNameOrder);
+        if (files || directories > 1) {
+            bufferPrintf(text, "%s%s:\n", text->length > 0 ? "\n" : "", operands[n]);
+        }
+        for (size_t entry = 0; entry < entries; entry++) {
+            bufferPrintf(text, "%s\n", sorted[entry]);
+        }
+    }
+    streamBlock(text->data, text->length, out);
+    return 0;
+}
+
+// cat file...: each file is mapped and shown straight from the mapping, or streamed if it can't be
+int nativeCat(int argc, char ** argv, struct commandOutput * out){
+    if (argc < 2) {
+        return -1;
+    }
+    for (int n = 1; n < argc; n++) {
+        if (argv[n][0] == '-') {
+            return -1;
+        }
+    }
+    for (int n = 1; n < argc; n++) {
+        struct nativeFile file;
+        if (nativeOpen(argv[n], &file) != 0) {
+            commandPrint(out, "cat: %s: %s",argv[n],strerror(errno));
+            continue;
+        }
+        if (file.fd >= 0) {
+            streamOutput(file.fd, out);
+        } else {
+            streamBlock(file.data, file.size, out);
+        }
+        nativeClose(&file);
+    }
+    return 0;
+}
+
+// echo [-n] word...
+int nativeEcho(int argc, char ** argv, struct commandOutput * out){
+    int first = argc > 1 && strcmp(argv[1], "-n") == 0 ? 2 : 1;
+    struct byteBuffer * text = &nativeText;
+    text->length = 0;
+    for (int n = first; n < argc; n++) {
+        bufferPrintf(text, "%s%s", n > first ? " " : "", argv[n]);
+    }
+    if (first == 1) {
+        bufferAppend(text, "\n", 1);
+    }
+    streamBlock(text->data, text->length, out);
+    return 0;
+}
+
+int nativePwd(int argc, char ** argv, struct commandOutput * out){
+    (void) argv;
+    if (argc > 1) {
+        return -1;
+    }
+    commandPrint(out, "%s",shell->cwd);
+    return 0;
+}
+
+// wc [-lwc] file...: lines, words and bytes, laid out like GNU wc
+int nativeWc(int argc, char ** argv, struct commandOutput * out){
+    int show[3] = { 0, 0, 0 }, first = 1;
+    while (first < argc && argv[first][0] == '-') {
+        for (const char * option = argv[first] + 1; *option; option++) {
+            const char * at = strchr("lwc", *option);
+            if (at == NULL) {
+                return -1;
+            }
+            show[at - "lwc"] = 1;
+        }
+        first++;
+    }
+    if (first == argc || !nativeMappable(argc, argv, first)) {
+        return -1;
+    }
+    if (!show[0] && !show[1] && !show[2]) {
+        show[0] = show[1] = show[2] = 1;
+    }
+    // The counts are as wide as the digits of the total size, or 1 for a single count of a single file
+    unsigned long long sizes = 0;
+    int width = 1;
+    for (int n = first; n < argc; n++) {
+        struct stat st;
+        if (stat(argv[n], &st) == 0) {
+            if (S_ISREG(st.st_mode)) {
+                sizes += (unsigned long long) st.st_size;
+            } else {
+                width = 7;
+            }
+        }
+    }
+    char digits[32];
+    int sizeWidth = snprintf(digits, sizeof(digits), "%llu", sizes);
+    if (sizeWidth > width) {
+        width = sizeWidth;
+    }
+    if (show[0] + show[1] + show[2] == 1 && argc - first == 1) {
+        width = 1;
+    }
+
+    unsigned long long totals[3] = { 0, 0, 0 };
+    for (int n = first; n < argc; n++) {
+        struct nativeFile file;
+        if (nativeOpen(argv[n], &file) != 0) {
+            commandPrint(out, "wc: %s: %s",argv[n],strerror(errno));
+            continue;
+        }
+        unsigned long long counts[3] = { 0, 0, file.size };
+        int inWord = 0;
+        // Lines alone only need the newlines, which memchr finds much faster than looking at every byte
+        const char * newline = file.data;
+        while (!show[1] && file.size > 0 && (newline = memchr(newline, '\n', (size_t) (file.data + file.size - newline))) != NULL) {
+            counts[0]++;
+            newline++;
+        }
+        for (size_t at = 0; show[1] && at < file.size; at++) {
+            unsigned char c = (unsigned char) file.data[at];
+            int space = c == ' ' || (c >= '\t' && c <= '\r');
+            counts[0] += c == '\n';
+            counts[1] += !space && !inWord;
+            inWord = !space;
+        }
+        nativeClose(&file);
+        nativeCounts(counts, show, width, argv[n], out);
+        for (int count = 0; count < 3; count++) {
+            totals[count] += counts[count];
+        }
+    }
+    if (argc - first > 1) {
+        nativeCounts(totals, show, width, "total", out);
+    }
+    return 0;
+}
+
+void nativeCounts(unsigned long long counts[3], int show[3], int width, const char * name, struct commandOutput * out){
+    char line[160];
+    size_t used = 0;
+    for (int count = 0; count < 3; count++) {
+        if (show[count]) {
+            used += snprintf(line + used, sizeof(line) - used, "%s%*llu", used ? " " : "", width, counts[count]);
+        }
+    }
+    commandPrint(out, "%s %s",line,name);
+}
+
+// head [-n N|-N] file...: the first N lines (10 by default), with a header per file when there are several
+int nativeHead(int argc, char ** argv, struct commandOutput * out){
+    long lines = 10;
+    int first = 1;
+    char extra;
+    if (first < argc && strcmp(argv[first], "-n") == 0 && first + 1 < argc) {
+        if (sscanf(argv[first + 1], "%ld%c", &lines, &extra) != 1) {
+            return -1;
+        }
+        first += 2;
+    } else if (first < argc && argv[first][0] == '-') {
+        const char * number = argv[first] + (argv[first][1] == 'n' ? 2 : 1);
+        if (sscanf(number, "%ld%c", &lines, &extra) != 1) {
+            return -1;
+        }
+        first++;
+    }
+    if (first == argc || lines < 0 || !nativeMappable(argc, argv, first)) {
+        return -1;
+    }
+    for (int n = first; n < argc; n++) {
+        struct nativeFile file;
+        if (nativeOpen(argv[n], &file) != 0) {
+            commandPrint(out, "head: cannot open '%s' for reading: %s",argv[n],strerror(errno));
+            continue;
+        }
+        if (argc - first > 1) {
+            if (n > first) {
+                streamBlock("\n", 1, out);
+            }
+            commandPrint(out, "==> %s <==",argv[n]);
+        }
+        size_t end = 0;
+        for (long line = 0; line < lines && end < file.size; line++) {
+            const char * newline = memchr(file.data + end, '\n', file.size - end);
+            end = newline != NULL ? (size_t) (newline - file.data) + 1 : file.size;
+        }
+        streamBlock(file.data, end, out);
+        nativeClose(&file);
+    }
+    return 0;
+}
+
+// The most lines the output panel can show at once; only these are drawn from each read
+#define MAX_VISIBLE_LINES 512
+
+// Reads the output of an external command until it closes its end of the pipe. Every read goes to the transcript,
+// the stream and the reply as it is, and its complete lines to the output panel and the history (streamLines). Only
+// an unfinished line at the end of a read is moved back to the start of the buffer. printLock is only held while a
+// read is being shown, not while waiting for the next one, and the output panel is refreshed after each.
+void streamOutput(int fd, struct commandOutput * out){
+    int keep = out->screen || out->stream != NULL;
+    size_t pending = 0;     // an unfinished line at the start of the buffer
+    int lastNewline = 1;
+    struct sgrState sgr = { A_NORMAL, -1, -1 };
+    for (;;) {
+        int held = releasePrint();
+        ssize_t received = read(fd, outputBuffer + pending, outputBufferSize - pending);
+        retakePrint(held);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            break;
+        }
+        commandWrite(out, outputBuffer + pending, (size_t) received);
+        lastNewline = outputBuffer[pending + (size_t) received - 1] == '\n';
+        size_t end = pending + (size_t) received;
+        if (!keep) {
+            continue;
+        }
+        size_t from = streamLines(outputBuffer, end, &sgr, out);
+        if (out->screen && shell->outputPanel != NULL) {
+            timedRefresh(shell->outputPanel);
+        }
+        pending = end - from;
+        if (pending == outputBufferSize) {
+            // A line longer than the whole buffer is shown as far as it fits
+            streamTail(outputBuffer, pending, &sgr, out);
+            pending = 0;
+        } else if (pending > 0 && from != 0) {
+            memmove(outputBuffer, outputBuffer + from, pending);
+        }
+    }
+    if (keep) {
+        streamTail(outputBuffer, pending, &sgr, out);
+    }
+    // Output which does not end with a newline is still followed by one, so that the next line starts afresh
+    if (!lastNewline) {
+        commandWrite(out, "\n", 1);
+    }
+}
+
+// Prints output which is already in memory as a whole (a mapped file, or what a native command produced) in the same
+// way as streamOutput, without copying it anywhere first
+void streamBlock(const char * data, size_t length, struct commandOutput * out){
+    if (length == 0) {
+        return;
+    }
+    commandWrite(out, data, length);
+    if (out->screen || out->stream != NULL) {
+        struct sgrState sgr = { A_NORMAL, -1, -1 };
+        size_t from = streamLines(data, length, &sgr, out);
+        streamTail(data + from, length - from, &sgr, out);
+    }
+    if (data[length - 1] != '\n') {
+        commandWrite(out, "\n", 1);
+    }
+}
+
+// Adds the complete lines of data[0..end) to the history and gives them to the output panel as slices of data. Since
+// the panel can only show its last outputY-2 lines, the lines which would be scrolled away by the same call are only
+// counted, not drawn. Returns where the unfinished line at the end starts (end if there is none).
+size_t streamLines(const char * data, size_t end, struct sgrState * sgr, struct commandOutput * out){
+    // Slices of the last lines which the output panel shows, in a ring
+    const char * lineStart[MAX_VISIBLE_LINES];
+    size_t lineLength[MAX_VISIBLE_LINES];
+    unsigned long lines = 0;
+    size_t visible = (size_t) (shell->outputY - 2);
+    if (visible > MAX_VISIBLE_LINES) {
+        visible = MAX_VISIBLE_LINES;
+    } else if (visible < 1) {
+        visible = 1;
+    }
+    const char * from = data;
+    const char * newline;
+    while ((newline = memchr(from, '\n', (size_t) (data + end - from))) != NULL) {
+        size_t length = (size_t) (newline - from);
+        historyAdd(from, length);
+        if (out->screen && (!shell->filtering || patternMatch(&shell->filterPattern, from, length))) {
+            lineStart[lines % visible] = from;
+            lineLength[lines % visible] = length;
+            lines++;
+        }
+        from = newline + 1;
+    }
+    if (lines > visible) {
+        // The colours set by the lines which are not drawn still apply to those which are
+        if (!shell->filtering) {
+            sgrScan(sgr, data, (size_t) (lineStart[lines % visible] - data));
+        }
+        panelAdvance(lines - visible);
+    }
+    for (unsigned long n = lines > visible ? lines - visible : 0; n < lines; n++) {
+        streamLine(lineStart[n % visible], lineLength[n % visible], sgr);
+    }
+    return (size_t) (from - data);
+}
+
+// Keeps and shows a line which did not end with a newline
+void streamTail(const char * line, size_t length, struct sgrState * sgr, struct commandOutput * out){
+    if (length == 0) {
+        return;
+    }
+    historyAdd(line, length);
+    if (out->screen) {
+        streamLine(line, length, sgr);
+    }
+}
+
+// Draws a line of an external command's output. While filtering, the lines shown are not consecutive, so each one
+// only has the colours it sets itself.
+void streamLine(const char * line, size_t length, struct sgrState * sgr){
+    if (shell->filtering) {
+        struct sgrState own = { A_NORMAL, -1, -1 };
+        panelLine(line, length, &own);
+    } else {
+        panelLine(line, length, sgr);
+    }
+}
+
+// Writes output as it is to the transcript, the stream and the reply (but not to the output panel)
+void commandWrite(struct commandOutput * out, const char * data, size_t length){
+    if (out->transcript && shell->outputFP != NULL) {
+        fwrite(data, 1, length, shell->outputFP);
+    }
+    if (out->stream != NULL) {
+        fwrite(data, 1, length, out->stream);
+    }
+    if (out->reply != NULL) {
+        bufferAppend(out->reply, data, length);
+    }
+}
+
+// Draws a line on the current line of the output panel, replacing what was there, and moves to the next line
+// (starting from the top again once the panel is full). Runs of plain text are drawn as they are; SGR sequences
+// change the colours and attributes (when sgr is given), other escape sequences and control characters are skipped
+// and tabs are expanded, so the line never runs into the border.
+void panelLine(const char * line, size_t length, struct sgrState * sgr){
+    WINDOW * panel = shell->outputPanel;
+    int width = getmaxx(panel) - 2;
+    int column = 0;
+    wmove(panel, shell->outputLC, 1);
+    if (sgr != NULL) {
+        wattrset(panel, sgr->attributes | COLOR_PAIR(SGR_PAIR(sgr->fg, sgr->bg) < COLOR_PAIRS ? SGR_PAIR(sgr->fg, sgr->bg) : 0));
+    }
+    size_t n = 0;
+    while (n < length && column < width) {
+        size_t run = plainRun(line + n, length - n);
+        if (run > 0) {
+            if (run > (size_t) (width - column)) {
+                run = (size_t) (width - column);
+            }
+            waddnstr(panel, line + n, (int) run);
+            column += (int) run;
+            n += run;
+            continue;
+        }
+        unsigned char c = (unsigned char) line[n];
+        if (c == 0x1b) {
+            size_t escape = escapeLength(line + n, length - n);
+            // CSI ... m is an SGR sequence
+            if (sgr != NULL && escape >= 3 && line[n + 1] == '[' && line[n + escape - 1] == 'm') {
+                sgrApply(sgr, line + n + 2, escape - 3);
+                short pair = SGR_PAIR(sgr->fg, sgr->bg);
+                wattrset(panel, sgr->attributes | COLOR_PAIR(pair < COLOR_PAIRS ? pair : 0));
+            }
+            n += escape;
+            continue;
+        }
+        if (c == '\t') {
+            do {
+                waddch(panel, ' ');
+                column++;
+            } while (column % 8 != 0 && column < width);
+        } else if (c >= 0x80) {
+            // A character of the terminal's character set (UTF-8) is drawn as it is, and any other byte as ?
+            int columns;
+            size_t bytes = panelCharacter(line + n, length - n, &columns);
+            if (column + (columns < 0 ? 1 : columns) > width) {
+                break;
+            }
+            if (columns < 0) {
+                waddch(panel, '?');
+                column++;
+                n++;
+            } else {
+                waddnstr(panel, line + n, (int) bytes);
+                column += columns;
+                n += bytes;
+            }
+            continue;
+        }
+        n++;
+    }
+    wattrset(panel, A_NORMAL);
+    if (column < width) {
+        mvwhline(panel, shell->outputLC, 1 + column, ' ', width - column);
+    }
+    panelAdvance(1);
+}
+
+// Decodes the multibyte character at the start of data: returns its length, and sets columns to its width, or to -1
+// if it is not a printable character (or the terminal's character set has none beyond ASCII)
+size_t panelCharacter(const char * data, size_t length, int * columns){
+    *columns = -1;
+    if (MB_CUR_MAX == 1) {
+        return 1;
+    }
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    wchar_t character;
+    size_t bytes = mbrtowc(&character, data, length, &state);
+    if (bytes == (size_t) -1 || bytes == (size_t) -2 || bytes == 0) {
+        return 1;
+    }
+    *columns = wcwidth(character);
+    return bytes;
+}
+
+// Returns the length of the plain text (printable ASCII) at the start of data. With SSE2 this checks 16 bytes at a
+// time: a byte is not plain if, as a signed byte, it is below 0x20 (which includes everything from 0x80) or is 0x7f.
+size_t plainRun(const char * data, size_t length){
+    size_t n = 0;
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    while (n + 16 <= length) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (data + n));
+        __m128i special = _mm_or_si128(_mm_cmplt_epi8(bytes, space), _mm_cmpeq_epi8(bytes, del));
+        int mask = _mm_movemask_epi8(special);
+        if (mask != 0) {
+            return n + (size_t) __builtin_ctz((unsigned int) mask);
+        }
+        n += 16;
+    }
+#endif
+    while (n < length && (signed char) data[n] >= 0x20 && data[n] != 0x7f) {
+        n++;
+    }
+    return n;
+}
+
+// Returns the length of the escape sequence at the start of data: CSI (ESC [ parameters final byte), OSC (ESC ]
+// ... BEL or ESC \) or a two byte escape. A sequence cut short by the end of the line takes the rest of it.
+size_t escapeLength(const char * data, size_t length){
+    if (length < 2) {
+        return length;
+    }
+    size_t n = 2;
+    if (data[1] == '[') {
+        while (n < length && !(data[n] >= 0x40 && data[n] <= 0x7e)) {
+            n++;
+        }
+        return n < length ? n + 1 : length;
+    }
+    if (data[1] == ']') {
+        while (n < length && data[n] != 0x07 && !(data[n] == 0x1b && n + 1 < length && data[n + 1] == '\\')) {
+            n++;
+        }
+        if (n < length) {
+            n += data[n] == 0x07 ? 1 : 2;
+        }
+        return n < length ? n : length;
+    }
+    return 2;
+}
+
+// Applies the parameters of an SGR sequence (the part between "ESC [" and "m")
+void sgrApply(struct sgrState * sgr, const char * params, size_t length){
+    int values[32];
+    int count = 0;
+    int value = 0;
+    for (size_t n = 0; n <= length && count < 32; n++) {
+        if (n == length || params[n] == ';' || params[n] == ':') {
+            values[count++] = value;
+            value = 0;
+        } else if (params[n] >= '0' && params[n] <= '9') {
+            value = value * 10 + (params[n] - '0');
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int code = values[i];
+        if (code == 0) {
+            sgr->attributes = A_NORMAL;
+            sgr->fg = -1;
+            sgr->bg = -1;
+        } else if (code == 1) {
+            sgr->attributes |= A_BOLD;
+        } else if (code == 2) {
+            sgr->attributes |= A_DIM;
+        } else if (code == 3) {
+            sgr->attributes |= A_ITALIC;
+        } else if (code == 4) {
+            sgr->attributes |= A_UNDERLINE;
+        } else if (code == 5) {
+            sgr->attributes |= A_BLINK;
+        } else if (code == 7) {
+            sgr->attributes |= A_REVERSE;
+        } else if (code == 8) {
+            sgr->attributes |= A_INVIS;
+        } else if (code == 22) {
+            sgr->attributes &= ~(A_BOLD | A_DIM);
+        } else if (code == 23) {
+            sgr->attributes &= ~A_ITALIC;
+        } else if (code == 24) {
+            sgr->attributes &= ~A_UNDERLINE;
+        } else if (code == 25) {
+            sgr->attributes &= ~A_BLINK;
+        } else if (code == 27) {
+            sgr->attributes &= ~A_REVERSE;
+        } else if (code == 28) {
+            sgr->attributes &= ~A_INVIS;
+        } else if (code >= 30 && code <= 37) {
+            sgr->fg = (short) (code - 30);
+        } else if (code == 39) {
+            sgr->fg = -1;
+        } else if (code >= 40 && code <= 47) {
+            sgr->bg = (short) (code - 40);
+        } else if (code == 49) {
+            sgr->bg = -1;
+        } else if (code >= 90 && code <= 97) {
+            // Bright colours are shown as bold
+            sgr->fg = (short) (code - 90);
+            sgr->attributes |= A_BOLD;
+        } else if (code >= 100 && code <= 107) {
+            sgr->bg = (short) (code - 100);
+        } else if ((code == 38 || code == 48) && i + 1 < count) {
+            // 256 colour (5;n) and true colour (2;r;g;b) are brought down to the nearest of the 8 standard colours
+            short colour = -1;
+            if (values[i + 1] == 5 && i + 2 < count) {
+                int index = values[i + 2];
+                if (index < 16) {
+                    colour = (short) (index % 8);
+                } else if (index < 232) {
+                    index -= 16;
+                    colour = (short) ((index / 36 >= 3 ? 1 : 0) | ((index / 6) % 6 >= 3 ? 2 : 0) | (index % 6 >= 3 ? 4 : 0));
+                } else {
+                    colour = index >= 244 ? COLOR_WHITE : COLOR_BLACK;
+                }
+                i += 2;
+            } else if (values[i + 1] == 2 && i + 4 < count) {
+                colour = (short) ((values[i + 2] >= 128 ? 1 : 0) | (values[i + 3] >= 128 ? 2 : 0) | (values[i + 4] >= 128 ? 4 : 0));
+                i += 4;
+            }
+            if (code == 38) {
+                sgr->fg = colour;
+            } else {
+                sgr->bg = colour;
+            }
+        }
+    }
+}
+
+// Applies the SGR sequences in output which is not drawn, finding the escapes with memchr
+void sgrScan(struct sgrState * sgr, const char * data, size_t length){
+    const char * end = data + length;
+    const char * escape;
+    while ((escape = memchr(data, 0x1b, (size_t) (end - data))) != NULL) {
+        size_t escapeLen = escapeLength(escape, (size_t) (end - escape));
+        if (escapeLen >= 3 && escape[1] == '[' && escape[escapeLen - 1] == 'm') {
+            sgrApply(sgr, escape + 2, escapeLen - 3);
+        }
+        data = escape + escapeLen;
+    }
+}
+
+// Returns the signature bit a trigram is hashed to
+unsigned int trigramBit(const char * text){
+    uint32_t trigram = (uint32_t) (unsigned char) text[0] | (uint32_t) (unsigned char) text[1] << 8 | (uint32_t) (unsigned char) text[2] << 16;
+    return (trigram * 2654435761u) >> 20;
+}
+
+// Sets aside room for the whole output history at once (lean mode), so that adding to it never allocates. The pages
+// are only touched, and so only take up memory, as lines are added. The arena is split into 16 blocks, so that
+// making way for new lines drops a sixteenth of the history at a time.
+void historyReserve(size_t bytes, size_t lines){
+    char * arena = malloc(bytes);
+    history.lines = malloc(lines * sizeof(*history.lines));
+    history.signatures = malloc((lines / HISTORY_GROUP + 2) * sizeof(*history.signatures));
+    if (arena == NULL || history.lines == NULL || history.signatures == NULL) {
+        history.full = 1;
+        return;
+    }
+    history.blockCount = 16;
+    history.blockSize = bytes / history.blockCount;
+    for (size_t block = 0; block < history.blockCount; block++) {
+        history.blocks[block] = arena + block * history.blockSize;
+    }
+    history.lineCapacity = lines;
+    history.signatureCapacity = lines / HISTORY_GROUP + 2;
+    history.fixed = 1;
+}
+
+// Starts filling the next arena block, reusing the oldest one (and dropping the lines it held) once all are in use.
+// Returns -1 if a new block could not be allocated.
+int historyNextBlock(){
+    size_t block = history.blocksStarted % history.blockCount;
+    if (history.blocksStarted >= history.blockCount) {
+        size_t oldest = history.blockFirstLine[(block + 1) % history.blockCount];
+        if (history.firstLine < oldest) {
+            history.firstLine = oldest;
+        }
+    }
+    if (history.blocks[block] == NULL && (history.blocks[block] = malloc(history.blockSize)) == NULL) {
+        return -1;
+    }
+    history.blockFirstLine[block] = history.lineCount;
+    history.blocksStarted++;
+    history.arenaUsed = 0;
+    return 0;
+}
+
+// Doubles the rings of the lines and the signatures, moving what they hold to where it goes in the larger ones.
+// Returns -1 if they can't grow any more.
+int historyGrowLines(){
+    if (history.fixed || history.lineCapacity >= HISTORY_MAX_LINES) {
+        return -1;
+    }
+    size_t capacity = history.lineCapacity > 0 ? history.lineCapacity * 2 : 4096;
+    size_t groups = capacity / HISTORY_GROUP + 2;
+    struct historyLine * lines = malloc(capacity * sizeof(*lines));
+    struct groupSignature * signatures = malloc(groups * sizeof(*signatures));
+    if (lines == NULL || signatures == NULL) {
+        free(lines);
+        free(signatures);
+        return -1;
+    }
+    for (size_t line = history.firstLine; line < history.lineCount; line++) {
+        lines[line % capacity] = history.lines[line % history.lineCapacity];
+    }
+    for (size_t group = history.firstLine / HISTORY_GROUP; group * HISTORY_GROUP < history.lineCount; group++) {
+        signatures[group % groups] = history.signatures[group % history.signatureCapacity];
+    }
+    free(history.lines);
+    free(history.signatures);
+    history.lines = lines;
+    history.lineCapacity = capacity;
+    history.signatures = signatures;
+    history.signatureCapacity = groups;
+    return 0;
+}
+
+// Adds a line to the output history and indexes its trigrams, dropping the oldest lines to make way once the history
+// is at its largest. Lines longer than HISTORY_MAX_LINE are cut short.
+void historyAdd(const char * line, size_t length){
+    if (historyPaused || history.full) {
+        return;
+    }
+    if (length > HISTORY_MAX_LINE) {
+        length = HISTORY_MAX_LINE;
+    }
+    if (history.blockCount == 0) {
+        history.blockCount = HISTORY_BLOCKS;
+        history.blockSize = HISTORY_ARENA_BLOCK;
+    }
+    if ((history.blocksStarted == 0 || history.arenaUsed + length > history.blockSize) && historyNextBlock() != 0) {
+        history.full = 1;
+        return;
+    }
+    if (history.lineCount - history.firstLine == history.lineCapacity && historyGrowLines() != 0) {
+        if (history.lineCapacity == 0) {
+            history.full = 1;
+            return;
+        }
+        // As many lines as the rings hold: the oldest one makes way
+        history.firstLine++;
+    }
+    char * text = history.blocks[(history.blocksStarted - 1) % history.blockCount] + history.arenaUsed;
+    size_t group = history.lineCount / HISTORY_GROUP;
+    struct groupSignature * signature = &history.signatures[group % history.signatureCapacity];
+    if (history.lineCount % HISTORY_GROUP == 0) {
+        memset(signature, 0, sizeof(*signature));
+    }
+    struct historyLine * kept = &history.lines[history.lineCount % history.lineCapacity];
+    kept->text = text;
+    kept->length = (unsigned int) length;
+    history.lineCount++;
+    memcpy(text, line, length);
+    history.arenaUsed += length;
+
+    uint64_t * bits = signature->bits;
+    for (size_t n = 0; n + 3 <= length; n++) {
+        unsigned int bit = trigramBit(text + n);
+        bits[bit / 64] |= 1ULL << (bit % 64);
+    }
+}
+
+// Adds the trigrams of a literal part of a pattern, which every match contains, and keeps the longest such part
+void patternLiteral(struct historyPattern * pattern, const char * run, size_t length){
+    if (length > pattern->literalLength) {
+        memcpy(pattern->literal, run, length);
+        pattern->literalLength = length;
+    }
+    for (size_t n = 0; n + 3 <= length && pattern->trigramCount < PATTERN_TRIGRAMS; n++) {
+        unsigned int bit = trigramBit(run + n);
+        int known = 0;
+        for (int i = 0; i < pattern->trigramCount && !known; i++) {
+            known = pattern->trigramBits[i] == bit;
+        }
+        if (!known) {
+            pattern->trigramBits[pattern->trigramCount++] = bit;
+        }
+    }
+}
+
+// Compiles a search pattern and finds the literal parts every match has to contain: runs of plain characters outside
+// groups and brackets, less any character made optional by the quantifier after it. With an alternation anywhere
+// there are none. Returns -1, with the reason in error, if the pattern is not a valid regular expression.
+int patternCompile(struct historyPattern * pattern, const char * source, char * error, size_t size){
+    // Compiled in the C locale, the pattern matches bytes (as the literal parts and trigrams do), whatever the
+    // character set of the output panel, and is matched faster
+    locale_t previous = byteLocale != (locale_t) 0 ? uselocale(byteLocale) : (locale_t) 0;
+    int result = regcomp(&pattern->regex, source, REG_EXTENDED | REG_NOSUB);
+    if (previous != (locale_t) 0) {
+        uselocale(previous);
+    }
+    if (result != 0) {
+        regerror(result, &pattern->regex, error, size);
+        return -1;
+    }
+    pattern->literalOnly = 1;
+    pattern->literalLength = 0;
+    pattern->trigramCount = 0;
+    if (strchr(source, '|') != NULL) {
+        pattern->literalOnly = 0;
+        return 0;
+    }
+    char run[HISTORY_MAX_LINE];
+    size_t runLength = 0;
+    int depth = 0;
+    for (const char * c = source; ; c++) {
+        int plain = *c == '\\' ? c[1] != '\0' && !isalnum((unsigned char) c[1]) : *c != '\0' && strchr(".[]()^$*+?{}", *c) == NULL;
+        if (plain && depth == 0) {
+            if (*c == '\\') {
+                c++;
+            }
+            if (runLength < sizeof(run)) {
+                run[runLength++] = *c;
+            }
+            continue;
+        }
+        if ((*c == '*' || *c == '?' || *c == '{') && runLength > 0) {
+            runLength--;
+        }
+        patternLiteral(pattern, run, runLength);
+        runLength = 0;
+        if (*c == '\0') {
+            break;
+        }
+        pattern->literalOnly = 0;
+        if (*c == '\\' && c[1] != '\0') {
+            c++;
+        } else if (*c == '(') {
+            depth++;
+        } else if (*c == ')' && depth > 0) {
+            depth--;
+        } else if (*c == '[' || *c == '{') {
+            // Skipping the bracket expression (a ']' straight after '[' or '[^' is part of it) or the interval
+            char close = *c == '[' ? ']' : '}';
+            if (close == ']' && c[1] == '^') {
+                c++;
+            }
+            if (close == ']' && c[1] == ']') {
+                c++;
+            }
+            while (c[1] != '\0' && c[1] != close) {
+                c++;
+            }
+            if (c[1] == '\0') {
+                break;
+            }
+            c++;
+        }
+    }
+    return 0;
+}
+
+// Returns whether a line matches a pattern
+int patternMatch(struct historyPattern * pattern, const char * text, size_t length){
+    if (pattern->literalLength > 0 && memmem(text, length, pattern->literal, pattern->literalLength) == NULL) {
+        return 0;
+    }
+    if (pattern->literalOnly) {
+        return 1;
+    }
+    // REG_STARTEND matches the line in place, without it having to end with '\0'
+    regmatch_t range = { 0, (regoff_t) length };
+    return regexec(&pattern->regex, text, 1, &range, REG_STARTEND) == 0;
+}
+
+// Finds the most recent lines of the history which match a pattern, newest first, until max have been found. Only the
+// groups whose signature has the bit of every trigram of the pattern are looked at; scanned is set to the number of
+// lines which were checked.
+size_t historySearch(struct historyPattern * pattern, size_t * found, size_t max, size_t * scanned){
+    size_t matches = 0;
+    *scanned = 0;
+    size_t group = history.lineCount > history.firstLine ? (history.lineCount - 1) / HISTORY_GROUP + 1 : 0;
+    while (group > history.firstLine / HISTORY_GROUP && matches < max) {
+        group--;
+        uint64_t * bits = history.signatures[group % history.signatureCapacity].bits;
+        int candidate = 1;
+        for (int i = 0; i < pattern->trigramCount && candidate; i++) {
+            unsigned int bit = pattern->trigramBits[i];
+            candidate = (bits[bit / 64] >> (bit % 64)) & 1;
+        }
+        if (!candidate) {
+            continue;
+        }
+        // The first group may have lost its oldest lines
+        size_t first = group * HISTORY_GROUP > history.firstLine ? group * HISTORY_GROUP : history.firstLine;
+        size_t line = group * HISTORY_GROUP + HISTORY_GROUP < history.lineCount ? group * HISTORY_GROUP + HISTORY_GROUP : history.lineCount;
+        for (; line > first && matches < max; line--) {
+            (*scanned)++;
+            struct historyLine * kept = &history.lines[(line - 1) % history.lineCapacity];
+            if (patternMatch(pattern, kept->text, kept->length)) {
+                found[matches++] = line - 1;
+            }
+        }
+    }
+    return matches;
+}
+
+// Prints the most recent lines of the history which match a pattern, the oldest first (on screen, as many as the
+// output panel shows), followed by how many were found, how many lines were looked at and how long it took
+#define MAX_MATCHES 1000
+void printMatches(struct historyPattern * pattern, const char * label, struct commandOutput * out){
+    size_t found[MAX_MATCHES];
+    size_t max = MAX_MATCHES;
+    if (out->screen && shell->outputY - 3 < MAX_MATCHES) {
+        max = shell->outputY > 4 ? (size_t) (shell->outputY - 3) : 1;
+    }
+    unsigned long long start = rawNs();
+    size_t scanned;
+    size_t matches = historySearch(pattern, found, max, &scanned);
+    double ms = (double) (rawNs() - start) / 1e6;
+
+    historyPaused = 1;
+    for (size_t n = matches; n > 0; n--) {
+        struct historyLine * line = &history.lines[found[n - 1] % history.lineCapacity];
+        commandPrint(out, "%7zu  %.*s",found[n - 1] + 1,(int) (line->length < 400 ? line->length : 400),line->text);
+    }
+    commandPrint(out, "%s: %s%zu matches, %zu of %zu lines looked at in %.3f ms%s",label,matches == max ? "the last " : "",
+                 matches,scanned,history.lineCount - history.firstLine,ms,
+                 history.full ? " (the history is full)" : history.firstLine > 0 ? " (older lines have made way)" : "");
+    historyPaused = 0;
+}
+
+void panelAdvance(unsigned long lines){
+    int panelLines = shell->outputY - 2;
+    if (panelLines < 1) {
+        return;
+    }
+    shell->outputLC = (int) ((shell->outputLC - 1 + lines) % (unsigned long) panelLines) + 1;
+}
+
+// Keeps the record of a command that has just finished, and adds it to the totals of its name
+void recordCommand(struct commandRecord * record){
+    shell->lastCommand = *record;
+    shell->commandsRun++;
+    recentCommands[commandsRun % RECENT_COMMANDS] = *record;
+    commandsRun++;
+
+    // The name's row, or else an empty one, or else the least recently used one
+    struct commandTotals * totals = &commandTable[0];
+    for (int n = 0; n < COMMAND_NAMES; n++) {
+        if (strcmp(commandTable[n].name, record->name) == 0) {
+            totals = &commandTable[n];
+            break;
+        }
+        if (commandTable[n].lastUsed < totals->lastUsed) {
+            totals = &commandTable[n];
+        }
+    }
+    if (strcmp(totals->name, record->name) != 0) {
+        memset(totals, 0, sizeof(struct commandTotals));
+        snprintf(totals->name, sizeof(totals->name), "%s", record->name);
+    }
+    totals->runs++;
+    if (!WIFEXITED(record->status) || WEXITSTATUS(record->status) != 0) {
+        totals->failures++;
+    }
+    totals->wallMs += record->wallMs;
+    totals->cpuMs += record->userMs + record->sysMs;
+    if (record->wallMs > totals->maxWallMs) {
+        totals->maxWallMs = record->wallMs;
+    }
+    if (record->maxRssKb > totals->maxRssKb) {
+        totals->maxRssKb = record->maxRssKb;
+    }
+    totals->lastUsed = commandsRun;
+}
+
+void formatRecord(struct commandRecord * record, char * text, size_t size){
+    char ending[32];
+    if (WIFEXITED(record->status)) {
+        snprintf(ending, sizeof(ending), "exit %d", WEXITSTATUS(record->status));
+    } else {
+        snprintf(ending, sizeof(ending), "signal %d", WTERMSIG(record->status));
+    }
+    snprintf(text, size, "%s: real %.3f ms, user %.3f ms, sys %.3f ms, max RSS %ld KB, %ld/%ld context switches, %s",
+             record->name, record->wallMs, record->userMs, record->sysMs, record->maxRssKb,
+             record->voluntarySwitches, record->involuntarySwitches, ending);
+}
+
+// Prints the totals of every external command name, the one which took the longest in total first
+void printCommandTable(struct commandOutput * out){
+    int order[COMMAND_NAMES];
+    int rows = 0;
+    for (int n = 0; n < COMMAND_NAMES; n++) {
+        if (commandTable[n].runs == 0) {
+            continue;
+        }
+        int at = rows++;
+        while (at > 0 && commandTable[order[at - 1]].wallMs < commandTable[n].wallMs) {
+            order[at] = order[at - 1];
+            at--;
+        }
+        order[at] = n;
+    }
+    if (rows == 0) {
+        commandPrint(out, "No external command has been run yet");
+        return;
+    }
+    commandPrint(out, "%-19s %6s %6s %10s %10s %10s %10s", "command", "runs", "failed", "total ms", "avg ms", "max ms",
+                 "max RSS KB");
+    for (int row = 0; row < rows; row++) {
+        struct commandTotals * totals = &commandTable[order[row]];
+        commandPrint(out, "%-19s %6lu %6lu %10.1f %10.3f %10.3f %10ld", totals->name, totals->runs, totals->failures,
+                     totals->wallMs, totals->wallMs / totals->runs, totals->maxWallMs, totals->maxRssKb);
+    }
+}
+
+// Draws the border of the prompt panel, with the status line of the last external command its shell ran in its bottom edge
+void drawPromptBox(WINDOW * promptPanel){
+    box(promptPanel, 0, 0);
+    if (shell->commandsRun > 0) {
+        char status[512];
+        formatRecord(&shell->lastCommand, status, sizeof(status));
+        mvwprintw(promptPanel, getmaxy(promptPanel) - 1, 2, " %.*s ", getmaxx(promptPanel) - 6, status);
+    }
+}
+
+unsigned long long rawNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return (unsigned long long) now.tv_sec * 1000000000ULL + (unsigned long long) now.tv_nsec;
+}
+
+// Adds one timing to a counter. The workers of a server share the slots, so the maximum is raised with compare and swap.
+void statRecord(struct statCounter * counter, unsigned long long ns){
+    atomic_fetch_add_explicit(&counter->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&counter->totalNs, ns, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&counter->maxNs, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&counter->maxNs, &max, ns, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void histogramRecord(struct histogram * histogram, unsigned long long ns){
+    int bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS && ns > histogramBounds[bucket] * 1e9) {
+        bucket++;
+    }
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sumNs, ns, memory_order_relaxed);
+}
+
+// Records a frame (one update of a panel, or one key echoed in the prompt) which started at frameStart
+void frameDone(unsigned long long frameStart){
+    unsigned long long ns = rawNs() - frameStart;
+    statRecord(&mySlot->frame, ns);
+    histogramRecord(&stats->renderLatency, ns);
+}
+
+// printLock, timing how long it was waited for and how long it was held. A thread working for a session of a server
+// then selects its terminal, as ncurses draws on one terminal at a time.
+void lockPrint(){
+    unsigned long long start = rawNs();
+    pthread_mutex_lock(&printLock);
+    lockTakenNs = rawNs();
+    printHeld = 1;
+    if (currentSession != NULL && currentSession->terminal != NULL) {
+        set_term(currentSession->terminal->screen);
+    }
+    statRecord(&mySlot->lockWait, lockTakenNs - start);
+}
+
+void unlockPrint(){
+    statRecord(&mySlot->lockHold, rawNs() - lockTakenNs);
+    printHeld = 0;
+    pthread_mutex_unlock(&printLock);
+}
+
+// Lets printLock go, if the calling thread holds it, while it waits for something other than the terminal (the
+// output of an external command), so that the panels carry on meanwhile. Returns whether it was held, for retakePrint.
+int releasePrint(){
+    if (!printHeld) {
+        return 0;
+    }
+    unlockPrint();
+    return 1;
+}
+
+void retakePrint(int held){
+    if (held) {
+        lockPrint();
+    }
+}
+
+// Refreshes a window, timing it and counting the bytes it wrote to the terminal against the calling panel. A refresh
+// which takes longer than TTY_STALL_NS was held up by the terminal (which adaptive refresh needs to know).
+int timedRefresh(WINDOW * window){
+    unsigned long long written = threadWritten();
+    unsigned long long start = rawNs();
+    int result = wrefresh(window);
+    unsigned long long end = rawNs();
+    statRecord(&mySlot->refresh, end - start);
+    atomic_fetch_add_explicit(&mySlot->ttyBytes, threadWritten() - written, memory_order_relaxed);
+    if (end - start > TTY_STALL_NS) {
+        atomic_store_explicit(currentSession != NULL ? &currentSession->ttyStallNs : &stats->ttyStallNs, end, memory_order_relaxed);
+    }
+    return result;
+}
+
+// The bytes written by the calling thread so far (wchar in /proc/thread-self/io), or 0 if the kernel does not say.
+// ncurses writes to the terminal with write(2) from its own buffer, leaving no stream or callback to count the bytes
+// with, and nothing else is written by a thread while it refreshes, so the difference across wrefresh is what it drew.
+unsigned long long threadWritten(){
+    if (threadIoFd == -1) {
+        threadIoFd = open("/proc/thread-self/io", O_RDONLY | O_CLOEXEC);
+        if (threadIoFd < 0) {
+            threadIoFd = -2;
+        }
+    }
+    if (threadIoFd < 0) {
+        return 0;
+    }
+    char text[256];
+    ssize_t length = pread(threadIoFd, text, sizeof(text) - 1, 0);
+    if (length <= 0) {
+        return 0;
+    }
+    text[length] = '\0';
+    char * wchar = strstr(text, "wchar:");
+    return wchar != NULL ? strtoull(wchar + 6, NULL, 10) : 0;
+}
+
+// In a forked child the thread is another task, so it opens its own /proc/thread-self/io (async-signal-safe)
+void threadForked(){
+    if (threadIoFd >= 0) {
+        close(threadIoFd);
+    }
+    threadIoFd = -1;
+}
+
+#ifdef COUNT_ALLOCATIONS
+// Counting allocator (cmake -DOW_COUNT_ALLOCATIONS=ON): every malloc, calloc, realloc and aligned allocation,
+// including those made inside ncurses and libc, is counted against the panel or thread making it and shown by "stats",
+// so that allocations in what should be a steady state (--lean especially) show up
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * data, size_t size);
+extern void * __libc_memalign(size_t alignment, size_t size);
+extern void * __libc_valloc(size_t size);
+extern void * __libc_pvalloc(size_t size);
+void * malloc(size_t size){
+    if (mySlot != NULL) {
+        atomic_fetch_add_explicit(&mySlot->allocations, 1, memory_order_relaxed);
+    }
+    return __libc_malloc(size);
+}
+void * calloc(size_t count, size_t size){
+    if (mySlot != NULL) {
+        atomic_fetch_add_explicit(&mySlot->allocations, 1, memory_order_relaxed);
+    }
+    return __libc_calloc(count, size);
+}
+void * realloc(void * data, size_t size){
+    if (mySlot != NULL) {
+        atomic_fetch_add_explicit(&mySlot->allocations, 1, memory_order_relaxed);
+    }
+    return __libc_realloc(data, size);
+}
+void * memalign(size_t alignment, size_t size){
+    if (mySlot != NULL) {
+        atomic_fetch_add_explicit(&mySlot->allocations, 1, memory_order_relaxed);
+    }
+    return __libc_memalign(alignment, size);
+}
+void * aligned_alloc(size_t alignment, size_t size){
+    return memalign(alignment, size);
+}
+int posix_memalign(void ** data, size_t alignment, size_t size){
+    if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void * aligned = memalign(alignment, size);
+    if (aligned == NULL) {
+        return ENOMEM;
+    }
+    *data = aligned;
+    return 0;
+}
+void * valloc(size_t size){
+    if (mySlot != NULL) {
+        atomic_fetch_add_explicit(&mySlot->allocations, 1, memory_order_relaxed);
+    }
+    return __libc_valloc(size);
+}
+void * pvalloc(size_t size){
+    if (mySlot != NULL) {
+        atomic_fetch_add_explicit(&mySlot->allocations, 1, memory_order_relaxed);
+    }
+    return __libc_pvalloc(size);
+}
+#endif
+
+// The heap allocations made by every panel and thread so far (always 0 unless built with COUNT_ALLOCATIONS)
+unsigned long long allocationsMade(){
+    unsigned long long made = 0;
+    for (int slot = 0; slot < STATS_SLOTS; slot++) {
+        made += atomic_load(&stats->slots[slot].allocations);
+    }
+    return made;
+}
+
+// Formats the statistics of every slot, two lines each (times are averages/maximums in microseconds). Returns the
+// number of lines.
+int statsLines(char lines[][160], int max, struct ttySnapshot * seen){
+    int count = 0;
+    // The bytes written to the terminal per second are taken over the time since this caller last looked at the
+    // statistics (seen, which is then updated), or since startup for a caller which keeps no snapshot
+    unsigned long long nowNs = rawNs();
+    double seconds = seen != NULL && seen->ns != 0 ? (double) (nowNs - seen->ns) / 1e9 : elapsedMs(&startTime) / 1000;
+    double ttyRate[STATS_SLOTS];
+    double ttyTotalRate = 0;
+    for (int slot = 0; slot < STATS_SLOTS; slot++) {
+        unsigned long long bytes = atomic_load(&stats->slots[slot].ttyBytes);
+        unsigned long long before = seen != NULL && seen->ns != 0 ? seen->bytes[slot] : 0;
+        ttyRate[slot] = seconds > 0 ? (double) (bytes - before) / seconds : 0;
+        ttyTotalRate += ttyRate[slot];
+        if (seen != NULL) {
+            seen->bytes[slot] = bytes;
+        }
+    }
+    if (seen != NULL) {
+        seen->ns = nowNs;
+    }
+    for (int slot = 0; slot < STATS_SLOTS && count + 2 <= max; slot++) {
+        struct statSlot * s = &stats->slots[slot];
+        #define AVG_US(c) (atomic_load(&(c).count) ? atomic_load(&(c).totalNs) / 1e3 / atomic_load(&(c).count) : 0.0)
+        #define MAX_US(c) (atomic_load(&(c).maxNs) / 1e3)
+        snprintf(lines[count++], 160, "%-11s frames %llu, %.1f/%.1f us  refresh %.1f/%.1f us  tty %.1f KB, %.0f B/s",
+                 statSlotNames[slot], atomic_load(&s->frame.count), AVG_US(s->frame), MAX_US(s->frame),
+                 AVG_US(s->refresh), MAX_US(s->refresh), atomic_load(&s->ttyBytes) / 1024.0, ttyRate[slot]);
+        snprintf(lines[count++], 160, "%-11s lock wait %.1f/%.1f us  hold %.1f/%.1f us  getch %.1f us  external %llu, %.1f ms  skipped %llu"
+#ifdef COUNT_ALLOCATIONS
+                 "  allocs %llu"
+#endif
+                 , "", AVG_US(s->lockWait), MAX_US(s->lockWait), AVG_US(s->lockHold), MAX_US(s->lockHold),
+                 AVG_US(s->input), atomic_load(&s->external.count), AVG_US(s->external) / 1e3,
+                 atomic_load(&s->skippedFrames)
+#ifdef COUNT_ALLOCATIONS
+                 , atomic_load(&s->allocations)
+#endif
+                 );
+        #undef AVG_US
+        #undef MAX_US
+    }
+    if (count < max) {
+        snprintf(lines[count++], 160, "alarm queue depth %llu (max %llu)  tty %.0f B/s",
+                 atomic_load(&stats->slots[STATS_ALARM_PANEL].alarmDepth),
+                 atomic_load(&stats->slots[STATS_ALARM_PANEL].alarmDepthMax), ttyTotalRate);
+    }
+    if (count < max) {
+        int publisher = atomic_load(&stats->clockPublisher);
+        if (publisher != 0) {
+            snprintf(lines[count++], 160, "times produced here %llu, shown from the shared clock of PID %d%s",
+                     atomic_load(&stats->timesProduced), publisher, publisher == getpid() ? " (this one)" : "");
+        } else {
+            snprintf(lines[count++], 160, "times produced here %llu, not from the shared clock", atomic_load(&stats->timesProduced));
+        }
+    }
+    return count;
+}
+
+// Writes every counter to a file, one "slot.counter value" per line
+int dumpStats(const char * path){
+    FILE * dumpFP = fopen(path, "w");
+    if (dumpFP == NULL) {
+        return -1;
+    }
+    const char * counterNames[] = { "refresh", "lock_wait", "lock_hold", "input", "external", "frame" };
+    for (int slot = 0; slot < STATS_SLOTS; slot++) {
+        struct statSlot * s = &stats->slots[slot];
+        struct statCounter * counters[] = { &s->refresh, &s->lockWait, &s->lockHold, &s->input, &s->external, &s->frame };
+        char name[32];
+        snprintf(name, sizeof(name), "%s", statSlotNames[slot]);
+        for (char * c = name; *c != '\0'; c++) {
+            if (*c == ' ') {
+                *c = '_';
+            }
+        }
+        for (int n = 0; n < 6; n++) {
+            fprintf(dumpFP, "%s.%s.count %llu\n", name, counterNames[n], atomic_load(&counters[n]->count));
+            fprintf(dumpFP, "%s.%s.total_ns %llu\n", name, counterNames[n], atomic_load(&counters[n]->totalNs));
+            fprintf(dumpFP, "%s.%s.max_ns %llu\n", name, counterNames[n], atomic_load(&counters[n]->maxNs));
+        }
+        fprintf(dumpFP, "%s.tty_bytes %llu\n", name, atomic_load(&s->ttyBytes));
+        fprintf(dumpFP, "%s.skipped_frames %llu\n", name, atomic_load(&s->skippedFrames));
+#ifdef COUNT_ALLOCATIONS
+        fprintf(dumpFP, "%s.allocations %llu\n", name, atomic_load(&s->allocations));
+#endif
+    }
+    fprintf(dumpFP, "alarm_queue_depth %llu\n", atomic_load(&stats->slots[STATS_ALARM_PANEL].alarmDepth));
+    fprintf(dumpFP, "alarm_queue_depth_max %llu\n", atomic_load(&stats->slots[STATS_ALARM_PANEL].alarmDepthMax));
+    return fclose(dumpFP);
+}
+
+// Shows, redraws or hides the statistics overlay, which covers the top right of the output panel. Called with
+// printLock held.
+void updateStatsOverlay(WINDOW ** overlay, struct ttySnapshot * seen, WINDOW * outputPanel){
+    if (!atomic_load(&stats->overlay)) {
+        if (*overlay != NULL) {
+            delwin(*overlay);
+            *overlay = NULL;
+            touchwin(outputPanel);
+            timedRefresh(outputPanel);
+        }
+        return;
+    }
+    if (*overlay == NULL) {
+        int y, x, height, width;
+        getbegyx(outputPanel, y, x);
+        getmaxyx(outputPanel, height, width);
+        int overlayY = height - 2 < 13 ? height - 2 : 13;
+        int overlayX = width - 2 < 100 ? width - 2 : 100;
+        if (overlayY < 3 || overlayX < 10 || (*overlay = newwin(overlayY, overlayX, y + 1, x + width - overlayX - 1)) == NULL) {
+            return;
+        }
+    }
+    char lines[16][160];
+    int count = statsLines(lines, getmaxy(*overlay) - 2, seen);
+    werase(*overlay);
+    box(*overlay, 0, 0);
+    mvwprintw(*overlay, 0, 2, " stats (avg/max) ");
+    for (int line = 0; line < count; line++) {
+        mvwprintw(*overlay, line + 1, 1, "%.*s", getmaxx(*overlay) - 2, lines[line]);
+    }
+    timedRefresh(*overlay);
+}
+
+// Prints one line of output, on the next line of the output panel (starting from the top again once it is full,
+// and unless it is filtered out) and in the output file, and/or in the reply to a control socket client
+void commandPrint(struct commandOutput * out, const char * format, ...){
+    char line[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    size_t length = strlen(line);
+    if ((out->screen || out->stream != NULL) && !historyPaused) {
+        historyAdd(line, length);
+    }
+    if (out->screen && (!shell->filtering || historyPaused || patternMatch(&shell->filterPattern, line, length))) {
+        panelLine(line, length, NULL);
+    }
+    if (out->transcript && shell->outputFP != NULL) {
+        fprintf(shell->outputFP, "%s\n",line);
+    }
+    if (out->stream != NULL) {
+        fprintf(out->stream, "%s\n",line);
+    }
+    if (out->reply != NULL) {
+        bufferAppend(out->reply, line, strlen(line));
+        bufferAppend(out->reply, "\n", 1);
+    }
+}
+
+// Sets an internal shell variable, returning -1 if there is no such variable and -2 (saying why) if the value can't
+// be used
+int setVariable(const char * var, const char * value, struct commandOutput * out){
+    const char * problem = checkVariable(var, value);
+    if (problem != NULL){
+        commandPrint(out, "%s",problem);
+        return -2;
+    }
+    if (strcmp(var, "prompt") == 0){
+        snprintf(shell->prompt, sizeof(shell->prompt), "%s", value);
+        commandPrint(out, "prompt was set to: %s",shell->prompt);
+    } else if (strcmp(var, "path") == 0){
+        snprintf(shell->path, sizeof(shell->path), "%s", value);
+        commandPrint(out, "path was set to: %s",shell->path);
+    } else if (strcmp(var, "refresh") == 0){
+        refreshTime = atoi(value);
+        commandPrint(out, "refresh was set to: %u",refreshTime);
+    } else if (strcmp(var, "buffer") == 0){
+        sscanf(value, "%dx%d",&shell->buffery,&shell->bufferx);
+        if (shell->outputPanel != NULL) {
+            wresize(shell->outputPanel, shell->buffery, shell->bufferx); timedRefresh(shell->outputPanel);
+        }
+        commandPrint(out, "buffer was set to: %dx%d",shell->buffery,shell->bufferx);
+    } else if (strcmp(var, "adaptive") == 0){
+        atomic_store(&stats->adaptive, strcmp(value, "on") == 0);
+        commandPrint(out, "adaptive was set to: %s",atomic_load(&stats->adaptive) ? "on" : "off");
+    } else if (strcmp(var, "native") == 0){
+        char names[64];
+        nativeParse(value, &shell->native);
+        nativeFormat(shell->native, names, sizeof(names));
+        commandPrint(out, "native was set to: %s",names);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Checks a value for an internal shell variable as if it came from the configuration file. Returns NULL (also for an
+// unknown variable, which setVariable reports), or why it can't be used.
+const char * checkVariable(const char * var, const char * value){
+    struct shellConfig checked;
+    char assignment[512];
+    if (snprintf(assignment, sizeof(assignment), "%s=%s", var, value) >= (int) sizeof(assignment)) {
+        return "the value is too long";
+    }
+    const char * problem = configSet(&checked, assignment);
+    return problem != NULL && strcmp(problem, "unknown variable") != 0 ? problem : NULL;
+}
+
+// Formats the value of an internal shell variable, returning -1 if there is no such variable
+int getVariable(const char * var, char * value, size_t size){
+    if (strcmp(var, "prompt") == 0){
+        snprintf(value, size, "%s", shell->prompt);
+    } else if (strcmp(var, "path") == 0){
+        snprintf(value, size, "%s", shell->path);
+    } else if (strcmp(var, "refresh") == 0){
+        snprintf(value, size, "%u", refreshTime);
+    } else if (strcmp(var, "buffer") == 0){
+        snprintf(value, size, "%dx%d", shell->buffery, shell->bufferx);
+    } else if (strcmp(var, "adaptive") == 0){
+        snprintf(value, size, "%s", atomic_load(&stats->adaptive) ? "on" : "off");
+    } else if (strcmp(var, "native") == 0){
+        nativeFormat(shell->native, value, size);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int bufferPrintf(struct byteBuffer * buffer, const char * format, ...){
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (length < 0) {
+        return -1;
+    }
+    return bufferAppend(buffer, text, (size_t) length < sizeof(text) ? (size_t) length : sizeof(text) - 1);
+}
+
+int bufferAppend(struct byteBuffer * buffer, const char * data, size_t length){
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+        char * grown = realloc(buffer->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return 0;
+}
+
+// Removes the first length bytes of the buffer
+void bufferConsume(struct byteBuffer * buffer, size_t length){
+    memmove(buffer->data, buffer->data + length, buffer->length - length);
+    buffer->length -= length;
+}
+
+// Control socket protocol: one request per line, answered by any output lines followed by "OK" or "ERR <reason>".
+//   run <command line>   runs a command as if it was entered at the prompt ('run exit' exits Orange Wave)
+//   set <var>=<value>    sets an internal shell variable
+//   get <var>            replies with the value of an internal shell variable
+//   stats                replies with the alarm statistics, one "name value" per line
+//   subscribe            from then on, sends "ALARM <time> seq <seq> colour <colour> count <alarms>" lines as alarms
+//                        arrive (count is more than 1 when alarms arrived faster than the client was woken up)
+//   unsubscribe, quit
+// Requests may be pipelined; they are answered in order. run, set and get need printLock (and run may take as long as
+// the command does), so they are handed to a runner thread and the client's later requests wait for them, while the
+// event loop carries on serving the other clients and the subscribers.
+#define CONTROL_MAX_LINE 4096
+// A client which lets more than this much of its replies pile up (a subscriber which stopped reading) is dropped
+#define CONTROL_MAX_PENDING (1 << 20)
+
+struct controlClient{
+    int fd;
+    int subscribed;
+    // Whether the client is closed once its replies have been sent (quit, or it is done sending), and what epoll is
+    // waiting for (-1 once it waits for nothing, and the client is out of the epoll set)
+    int closing;
+    int finished;
+    int events;
+    struct byteBuffer in;
+    struct byteBuffer out;
+    // What the client last saw of the terminal bytes, for "run stats"
+    struct ttySnapshot ttySeen;
+    // Whether a request of the client is with the runner, or waiting for it to be free
+    int busy;
+    int waiting;
+    struct controlClient * prev, * next;
+};
+
+struct controlState{
+    int epoll;
+    struct alarmInfo * alarm_shm;
+    struct controlClient * clients;
+    // Clients dropped while handling a batch of events, freed once the batch is over
+    struct controlClient * dropped;
+    unsigned long clientCount;
+    unsigned long commands;
+    // The runner: one request at a time, handed over with jobLock and jobCond, and handed back through jobDoneFd.
+    // jobClient is cleared if the client is dropped while its request runs. The client's terminal byte snapshot goes
+    // with the request (jobTtySeen), and back to the client with the reply.
+    pthread_t runner;
+    pthread_mutex_t jobLock;
+    pthread_cond_t jobCond;
+    int jobQueued;
+    int jobQuit;
+    int jobDoneFd;
+    int jobExiting;
+    struct controlClient * jobClient;
+    char jobLine[CONTROL_MAX_LINE + 1];
+    struct byteBuffer jobReply;
+    struct ttySnapshot jobTtySeen;
+};
+
+// Wakes the control socket, so that it can pass the alarm on to its subscribers (async-signal-safe)
+void notifyAlarm(struct alarmInfo * alarm_shm){
+    if (alarmEventFd >= 0 && atomic_load_explicit(&alarm_shm->subscribers, memory_order_relaxed) > 0) {
+        int savedErrno = errno;
+        uint64_t one = 1;
+        ssize_t written = write(alarmEventFd, &one, sizeof(one));
+        (void) written;
+        errno = savedErrno;
+    }
+}
+
+void controlDrop(struct controlState * state, struct controlClient * client){
+    if (client->fd < 0) {
+        return;
+    }
+    epoll_ctl(state->epoll, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->fd = -1;
+    if (state->jobClient == client) {
+        state->jobClient = NULL;
+    }
+    if (client->subscribed) {
+        atomic_fetch_sub(&state->alarm_shm->subscribers, 1);
+    }
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else {
+        state->clients = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
+    client->next = state->dropped;
+    state->dropped = client;
+    state->clientCount--;
+}
+
+// Sends as much of the pending replies as the socket takes, waiting for it to become writable only while some are
+// left. Returns -1 once the client should be dropped.
+int controlFlush(struct controlState * state, struct controlClient * client){
+    while (client->out.length > 0) {
+        ssize_t sent = send(client->fd, client->out.data, client->out.length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        bufferConsume(&client->out, (size_t) sent);
+    }
+    if (client->out.length > CONTROL_MAX_PENDING
+        || ((client->closing || client->finished) && client->out.length == 0 && !client->busy && !client->waiting)) {
+        return -1;
+    }
+    // A client which is done sending is only watched while replies are left to send
+    int events = (client->finished ? 0 : EPOLLIN) | (client->out.length > 0 ? EPOLLOUT : 0);
+    if (events == 0) {
+        events = -1;
+    }
+    if (events != client->events) {
+        struct epoll_event event = { .events = events > 0 ? (uint32_t) events : 0, .data.ptr = client };
+        epoll_ctl(state->epoll, events < 0 ? EPOLL_CTL_DEL : client->events < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                  client->fd, &event);
+        client->events = events;
+    }
+    return 0;
+}
+
+// Splits a request line into the request and the rest of the line
+char * controlSplit(char * line, char * request, size_t size){
+    char format[16];
+    snprintf(format, sizeof(format), "%%%zus", size - 1);
+    request[0] = '\0';
+    sscanf(line, format, request);
+    char * rest = line + strspn(line, " \t");
+    rest += strlen(request);
+    return rest + strspn(rest, " \t");
+}
+
+// Answers a run, set or get request with commandLock and printLock held, on the runner thread. Returns 1 if Orange
+// Wave should exit.
+int controlLocked(char * line, struct byteBuffer * out, struct ttySnapshot * ttySeen){
+    char request[16];
+    char * rest = controlSplit(line, request, sizeof(request));
+    struct commandOutput reply = { .reply = out, .ttySeen = ttySeen };
+    char value[512];
+    int exiting = 0;
+    pthread_mutex_lock(&commandLock);
+    lockPrint();
+    if (strcmp(request, "run") == 0) {
+        exiting = runCommand(rest, &reply);
+        bufferAppend(out, "OK\n", 3);
+    } else if (strcmp(request, "set") == 0) {
+        char * equals = strchr(rest, '=');
+        const char * problem = NULL;
+        int result = -1;
+        if (equals != NULL) {
+            *equals = '\0';
+            // A value which can't be used is refused with the reason, and nothing is set
+            problem = checkVariable(rest, equals + 1);
+            result = problem == NULL ? setVariable(rest, equals + 1, &reply) : -2;
+        }
+        if (problem != NULL) {
+            commandPrint(&reply, "ERR %s", problem);
+        } else {
+            commandPrint(&reply, result == 0 ? "OK" : "ERR expected a variable=value (prompt, path, refresh, buffer, adaptive or native)");
+        }
+    } else if (getVariable(rest, value, sizeof(value)) == 0) {
+        commandPrint(&reply, "%s", value);
+        commandPrint(&reply, "OK");
+    } else {
+        commandPrint(&reply, "ERR %s is not an internal variable", rest);
+    }
+    unlockPrint();
+    pthread_mutex_unlock(&commandLock);
+    return exiting;
+}
+
+// Runs the requests handed over by the event loop, one at a time, until it is told to quit
+void * controlRunner(void * arg){
+    struct controlState * state = (struct controlState *) arg;
+    mySlot = &stats->slots[STATS_CONTROL];
+    pthread_mutex_lock(&state->jobLock);
+    for (;;) {
+        while (!state->jobQueued && !state->jobQuit) {
+            pthread_cond_wait(&state->jobCond, &state->jobLock);
+        }
+        if (!state->jobQueued) {
+            break;
+        }
+        pthread_mutex_unlock(&state->jobLock);
+        int exiting = controlLocked(state->jobLine, &state->jobReply, &state->jobTtySeen);
+        pthread_mutex_lock(&state->jobLock);
+        state->jobExiting = exiting;
+        state->jobQueued = 0;
+        uint64_t one = 1;
+        ssize_t written = write(state->jobDoneFd, &one, sizeof(one));
+        (void) written;
+    }
+    pthread_mutex_unlock(&state->jobLock);
+    return NULL;
+}
+
+// Hands a request to the runner. Returns -1 if the runner is still busy with another one.
+int controlHandOver(struct controlState * state, struct controlClient * client, const char * line){
+    pthread_mutex_lock(&state->jobLock);
+    int free = state->jobClient == NULL && !state->jobQueued;
+    if (free) {
+        snprintf(state->jobLine, sizeof(state->jobLine), "%s", line);
+        state->jobReply.length = 0;
+        state->jobTtySeen = client->ttySeen;
+        state->jobClient = client;
+        state->jobQueued = 1;
+        pthread_cond_signal(&state->jobCond);
+    }
+    pthread_mutex_unlock(&state->jobLock);
+    return free ? 0 : -1;
+}
+
+// Answers one request of a client, or hands it to the runner. Returns -1 if it has to wait for the runner to be free.
+int controlRequest(struct controlState * state, struct controlClient * client, char * line){
+    char request[16];
+    char * rest = controlSplit(line, request, sizeof(request));
+
+    struct commandOutput reply = { .reply = &client->out };
+    if (strcmp(request, "run") == 0 || strcmp(request, "set") == 0 || strcmp(request, "get") == 0) {
+        if (controlHandOver(state, client, line) != 0) {
+            return -1;
+        }
+        if (request[0] != 'g') {
+            state->commands++;
+        }
+        client->busy = 1;
+    } else if (strcmp(request, "stats") == 0) {
+        struct alarmInfo alarm;
+        readAlarmInfo(state->alarm_shm, &alarm);
+        commandPrint(&reply, "alarms %lu", alarm.received);
+        commandPrint(&reply, "last_alarm %s", alarm.received > 0 ? alarm.message : "-");
+        commandPrint(&reply, "rt_received %lu", alarm.rtReceived);
+        commandPrint(&reply, "rt_lost %lu", alarm.rtLost);
+        commandPrint(&reply, "rt_latency_avg_us %lld",
+                     alarm.rtReceived > 0 ? alarm.rtLatencySumUs / (long long) alarm.rtReceived : 0);
+        commandPrint(&reply, "rt_latency_max_us %lld", alarm.rtLatencyMaxUs);
+        commandPrint(&reply, "clients %lu", state->clientCount);
+        commandPrint(&reply, "commands %lu", state->commands);
+        commandPrint(&reply, "OK");
+    } else if (strcmp(request, "subscribe") == 0 || strcmp(request, "unsubscribe") == 0) {
+        int subscribe = request[0] == 's';
+        if (subscribe != client->subscribed) {
+            atomic_fetch_add(&state->alarm_shm->subscribers, subscribe ? 1 : -1);
+            client->subscribed = subscribe;
+        }
+        commandPrint(&reply, "OK");
+    } else if (strcmp(request, "quit") == 0) {
+        commandPrint(&reply, "OK");
+        client->closing = 1;
+    } else if (request[0] != '\0') {
+        commandPrint(&reply, "ERR unknown request (run, set, get, stats, subscribe, unsubscribe or quit)");
+    }
+    (void) rest;
+    return 0;
+}
+
+// Answers the complete lines a client has sent, as far as they can be before one has to wait for the runner
+void controlProcess(struct controlState * state, struct controlClient * client){
+    size_t start = 0;
+    char * newline;
+    client->waiting = 0;
+    while (!client->closing && !client->busy
+           && (newline = memchr(client->in.data + start, '\n', client->in.length - start)) != NULL) {
+        *newline = '\0';
+        if (newline > client->in.data + start && newline[-1] == '\r') {
+            newline[-1] = '\0';
+        }
+        if (controlRequest(state, client, client->in.data + start) != 0) {
+            // Put back as it was, to be tried again once the runner is free
+            *newline = '\n';
+            if (newline > client->in.data + start && newline[-1] == '\0') {
+                newline[-1] = '\r';
+            }
+            client->waiting = 1;
+            break;
+        }
+        start = (size_t) (newline - client->in.data) + 1;
+    }
+    bufferConsume(&client->in, start);
+}
+
+// Passes what the runner replied on to its client, and lets the clients which were waiting for it carry on
+void controlJobDone(struct controlState * state){
+    uint64_t count;
+    if (read(state->jobDoneFd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    pthread_mutex_lock(&state->jobLock);
+    struct controlClient * client = state->jobClient;
+    state->jobClient = NULL;
+    int exiting = state->jobExiting;
+    pthread_mutex_unlock(&state->jobLock);
+    if (client != NULL) {
+        client->busy = 0;
+        client->ttySeen = state->jobTtySeen;
+        if (bufferAppend(&client->out, state->jobReply.data, state->jobReply.length) != 0) {
+            controlDrop(state, client);
+            client = NULL;
+        }
+    }
+    if (exiting) {
+        requestStop();
+    }
+    // The clients which were waiting go first, so that one busy client can't keep the runner to itself
+    for (struct controlClient * other = state->clients, * next; other != NULL; other = next) {
+        next = other->next;
+        if (other->waiting) {
+            controlProcess(state, other);
+            if (controlFlush(state, other) != 0) {
+                controlDrop(state, other);
+            }
+        }
+    }
+    if (client != NULL) {
+        controlProcess(state, client);
+        if (controlFlush(state, client) != 0) {
+            controlDrop(state, client);
+        }
+    }
+}
+
+// Reads what a client sent and answers every complete line. Returns -1 once the client should be dropped.
+int controlRead(struct controlState * state, struct controlClient * client){
+    char chunk[4096];
+    int finished = 0;
+    for (;;) {
+        ssize_t received = recv(client->fd, chunk, sizeof(chunk), 0);
+        if (received > 0) {
+            if (bufferAppend(&client->in, chunk, (size_t) received) != 0) {
+                return -1;
+            }
+        } else if (received == 0) {
+            finished = 1;
+            break;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+
+    controlProcess(state, client);
+    // A client whose requests wait for the runner may have several lines pending, but none longer than a line
+    if (client->in.length > CONTROL_MAX_PENDING
+        || (client->in.length > CONTROL_MAX_LINE && memchr(client->in.data, '\n', client->in.length) == NULL)) {
+        return -1;
+    }
+    // A client which is done sending still gets its replies, as far as the socket takes them
+    if (finished) {
+        client->finished = 1;
+    }
+    return controlFlush(state, client);
+}
+
+// Passes the latest alarm on to every subscriber
+void controlAlarm(struct controlState * state){
+    uint64_t count;
+    if (read(alarmEventFd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    struct alarmInfo alarm;
+    readAlarmInfo(state->alarm_shm, &alarm);
+    char line[128];
+    int length;
+    if (alarm.queued) {
+        length = snprintf(line, sizeof(line), "ALARM %s seq %u colour %d count %llu\n",
+                          alarm.message, alarm.seq, alarm.colour, (unsigned long long) count);
+    } else {
+        length = snprintf(line, sizeof(line), "ALARM %s seq - colour %d count %llu\n",
+                          alarm.message, alarm.colour, (unsigned long long) count);
+    }
+    struct controlClient * client = state->clients;
+    while (client != NULL) {
+        struct controlClient * next = client->next;
+        if (client->subscribed) {
+            if (bufferAppend(&client->out, line, (size_t) length) != 0 || controlFlush(state, client) != 0) {
+                controlDrop(state, client);
+            }
+        }
+        client = next;
+    }
+}
+
+// Removes a socket left behind at path by a session which did not exit cleanly, and nothing else. Returns -1 with
+// errno set if something other than a socket is there.
+int removeSocket(const char * path){
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        errno = EEXIST;
+        return -1;
+    }
+    return unlink(path) == 0 || errno == ENOENT ? 0 : -1;
+}
+
+// Binds a Unix socket at path which only this user can connect to, and listens on it
+int listenPrivate(int listener, const char * path){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    // Nobody can connect before listen, so the socket is never open to others
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || chmod(path, 0600) != 0
+        || listen(listener, SOMAXCONN) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Whether the process at the other end of a Unix socket runs as this user
+int peerIsUser(int fd){
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 && peer.uid == getuid();
+}
+
+// Control socket event loop: a single thread serves every client with non-blocking sockets and epoll, until the
+// stop pipe is closed
+void * controlThread(void * arg){
+    mySlot = &stats->slots[STATS_CONTROL];
+    struct controlState state;
+    memset(&state, 0, sizeof(state));
+    state.alarm_shm = (struct alarmInfo *) arg;
+    struct commandOutput screen = { .screen = 1, .transcript = 1 };
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    state.epoll = epoll_create1(EPOLL_CLOEXEC);
+    state.jobDoneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&state.jobLock, NULL);
+    pthread_cond_init(&state.jobCond, NULL);
+    if (listener < 0 || state.epoll < 0 || state.jobDoneFd < 0 || removeSocket(controlPath) != 0
+        || listenPrivate(listener, controlPath) != 0
+        || pthread_create(&state.runner, threadAttributes, controlRunner, &state) != 0) {
+        int error = errno;
+        // Only a socket of our own is removed
+        if (error != EEXIST) {
+            removeSocket(controlPath);
+        }
+        lockPrint();
+        commandPrint(&screen, "Control socket %s: %s",controlPath,strerror(error));
+        timedRefresh(shell->outputPanel);
+        unlockPrint();
+        if (listener >= 0) {
+            close(listener);
+        }
+        if (state.epoll >= 0) {
+            close(state.epoll);
+        }
+        if (state.jobDoneFd >= 0) {
+            close(state.jobDoneFd);
+        }
+        return NULL;
+    }
+
+    // The listener, the alarm eventfd and the stop pipe are told apart from the clients by their data pointers
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &listener };
+    epoll_ctl(state.epoll, EPOLL_CTL_ADD, listener, &event);
+    event.data.ptr = &alarmEventFd;
+    if (alarmEventFd >= 0) {
+        epoll_ctl(state.epoll, EPOLL_CTL_ADD, alarmEventFd, &event);
+    }
+    event.data.ptr = &stopPipe[0];
+    epoll_ctl(state.epoll, EPOLL_CTL_ADD, stopPipe[0], &event);
+    event.data.ptr = &state.jobDoneFd;
+    epoll_ctl(state.epoll, EPOLL_CTL_ADD, state.jobDoneFd, &event);
+
+    struct epoll_event events[64];
+    int running = 1;
+    while (running) {
+        int count = epoll_wait(state.epoll, events, 64, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int e = 0; e < count; e++) {
+            void * tag = events[e].data.ptr;
+            if (tag == &stopPipe[0]) {
+                running = 0;
+            } else if (tag == &alarmEventFd) {
+                controlAlarm(&state);
+            } else if (tag == &state.jobDoneFd) {
+                controlJobDone(&state);
+            } else if (tag == &listener) {
+                int fd;
+                while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    // The socket is only open to this user anyway, but its directory may not be
+                    struct controlClient * client = peerIsUser(fd) ? calloc(1, sizeof(struct controlClient)) : NULL;
+                    if (client == NULL) {
+                        close(fd);
+                        continue;
+                    }
+                    client->fd = fd;
+                    client->events = EPOLLIN;
+                    struct epoll_event clientEvent = { .events = EPOLLIN, .data.ptr = client };
+                    epoll_ctl(state.epoll, EPOLL_CTL_ADD, fd, &clientEvent);
+                    client->next = state.clients;
+                    if (state.clients != NULL) {
+                        state.clients->prev = client;
+                    }
+                    state.clients = client;
+                    state.clientCount++;
+                }
+            } else {
+                struct controlClient * client = (struct controlClient *) tag;
+                if (client->fd < 0) {
+                    continue;
+                }
+                int result = 0;
+                if (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    result = controlRead(&state, client);
+                } else if (events[e].events & EPOLLOUT) {
+                    result = controlFlush(&state, client);
+                }
+                if (result != 0) {
+                    controlDrop(&state, client);
+                }
+            }
+        }
+        while (state.dropped != NULL) {
+            struct controlClient * client = state.dropped;
+            state.dropped = client->next;
+            free(client->in.data);
+            free(client->out.data);
+            free(client);
+        }
+    }
+
+    // A command which is still running is waited for, as the prompt would
+    pthread_mutex_lock(&state.jobLock);
+    state.jobQuit = 1;
+    pthread_cond_signal(&state.jobCond);
+    pthread_mutex_unlock(&state.jobLock);
+    pthread_join(state.runner, NULL);
+    close(state.jobDoneFd);
+    free(state.jobReply.data);
+    while (state.clients != NULL) {
+        controlDrop(&state, state.clients);
+    }
+    while (state.dropped != NULL) {
+        struct controlClient * client = state.dropped;
+        state.dropped = client->next;
+        free(client->in.data);
+        free(client->out.data);
+        free(client);
+    }
+    close(listener);
+    close(state.epoll);
+    removeSocket(controlPath);
+    return NULL;
+}
+
+// Writes a histogram in the Prometheus exposition format, its buckets being cumulative
+void metricsHistogram(struct byteBuffer * body, const char * name, const char * help, struct histogram * histogram){
+    bufferPrintf(body, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    unsigned long long cumulative = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        cumulative += atomic_load_explicit(&histogram->buckets[bucket], memory_order_relaxed);
+        bufferPrintf(body, "%s_bucket{le=\"%g\"} %llu\n", name, histogramBounds[bucket], cumulative);
+    }
+    cumulative += atomic_load_explicit(&histogram->buckets[HISTOGRAM_BUCKETS], memory_order_relaxed);
+    bufferPrintf(body, "%s_bucket{le=\"+Inf\"} %llu\n", name, cumulative);
+    bufferPrintf(body, "%s_sum %.9f\n", name, atomic_load_explicit(&histogram->sumNs, memory_order_relaxed) / 1e9);
+    bufferPrintf(body, "%s_count %llu\n", name, cumulative);
+}
+
+// The body of /metrics. Everything is read without locking: the alarm through its seqlock, the rest from atomic
+// counters, so a scrape never holds up the screen or the signal handlers.
+void metricsBody(struct byteBuffer * body, struct alarmInfo * alarm_shm){
+    struct alarmInfo alarm;
+    readAlarmInfo(alarm_shm, &alarm);
+    const char * colours[6] = { "none", "white", "red", "orange", "green", "blue" };
+
+    bufferPrintf(body, "# HELP orangewave_alarms_total Alarms received.\n# TYPE orangewave_alarms_total counter\n");
+    bufferPrintf(body, "orangewave_alarms_total %lu\n", alarm.received);
+    bufferPrintf(body, "# HELP orangewave_alarm_colour_total Alarms received, by colour (interarrival time) bucket.\n"
+                       "# TYPE orangewave_alarm_colour_total counter\n");
+    for (int colour = 1; colour < 6; colour++) {
+        bufferPrintf(body, "orangewave_alarm_colour_total{colour=\"%s\"} %lu\n", colours[colour], alarm.colourCounts[colour]);
+    }
+    bufferPrintf(body, "# HELP orangewave_rt_alarms_received_total Queued real-time alarms received.\n"
+                       "# TYPE orangewave_rt_alarms_received_total counter\n"
+                       "orangewave_rt_alarms_received_total %lu\n", alarm.rtReceived);
+    bufferPrintf(body, "# HELP orangewave_rt_alarms_lost_total Queued real-time alarms lost (gaps in the sequence numbers).\n"
+                       "# TYPE orangewave_rt_alarms_lost_total counter\n"
+                       "orangewave_rt_alarms_lost_total %lu\n", alarm.rtLost);
+    bufferPrintf(body, "# HELP orangewave_rt_alarm_latency_seconds_sum Total delivery latency of queued real-time alarms.\n"
+                       "# TYPE orangewave_rt_alarm_latency_seconds_sum counter\n"
+                       "orangewave_rt_alarm_latency_seconds_sum %.6f\n", alarm.rtLatencySumUs / 1e6);
+    bufferPrintf(body, "# HELP orangewave_rt_alarm_latency_max_seconds Highest delivery latency of a queued real-time alarm.\n"
+                       "# TYPE orangewave_rt_alarm_latency_max_seconds gauge\n"
+                       "orangewave_rt_alarm_latency_max_seconds %.6f\n", alarm.rtLatencyMaxUs / 1e6);
+    bufferPrintf(body, "# HELP orangewave_alarm_queue_depth Alarms received between the last two alarm panel updates.\n"
+                       "# TYPE orangewave_alarm_queue_depth gauge\n"
+                       "orangewave_alarm_queue_depth %llu\n", atomic_load(&stats->slots[STATS_ALARM_PANEL].alarmDepth));
+
+    bufferPrintf(body, "# HELP orangewave_commands_total Commands run from the prompt, the control socket or a script.\n"
+                       "# TYPE orangewave_commands_total counter\n"
+                       "orangewave_commands_total %llu\n", atomic_load(&stats->commands));
+    metricsHistogram(body, "orangewave_command_duration_seconds", "Time taken to run a command.", &stats->commandLatency);
+    metricsHistogram(body, "orangewave_render_duration_seconds", "Time taken to draw a frame (a panel update or an echoed key).",
+                     &stats->renderLatency);
+
+    bufferPrintf(body, "# HELP orangewave_tty_bytes_total Bytes written to the terminal.\n# TYPE orangewave_tty_bytes_total counter\n");
+    for (int slot = 0; slot < STATS_SLOTS; slot++) {
+        bufferPrintf(body, "orangewave_tty_bytes_total{panel=\"%s\"} %llu\n", statSlotNames[slot],
+                     atomic_load(&stats->slots[slot].ttyBytes));
+    }
+    bufferPrintf(body, "# HELP orangewave_print_lock_wait_seconds_total Time spent waiting for the print lock.\n"
+                       "# TYPE orangewave_print_lock_wait_seconds_total counter\n");
+    for (int slot = 0; slot < STATS_SLOTS; slot++) {
+        bufferPrintf(body, "orangewave_print_lock_wait_seconds_total{panel=\"%s\"} %.9f\n", statSlotNames[slot],
+                     atomic_load(&stats->slots[slot].lockWait.totalNs) / 1e9);
+    }
+}
+
+// Answers one HTTP request: GET /metrics, or an error
+void metricsServe(int fd, struct alarmInfo * alarm_shm){
+    char request[4096];
+    size_t length = 0;
+    // Reading the request head, giving up on clients which take more than a second
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (length < sizeof(request) - 1) {
+        ssize_t received = recv(fd, request + length, sizeof(request) - 1 - length, 0);
+        if (received <= 0) {
+            if (received < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        length += (size_t) received;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) {
+            break;
+        }
+    }
+    request[length] = '\0';
+
+    char method[16] = "", target[256] = "";
+    sscanf(request, "%15s %255s", method, target);
+    const char * status = "200 OK";
+    struct byteBuffer body = { NULL, 0, 0 };
+    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0) {
+        status = "405 Method Not Allowed";
+        bufferPrintf(&body, "Only GET is supported\n");
+    } else if (strcmp(target, "/metrics") != 0) {
+        status = "404 Not Found";
+        bufferPrintf(&body, "Metrics are served on /metrics\n");
+    } else {
+        metricsBody(&body, alarm_shm);
+    }
+
+    struct byteBuffer response = { NULL, 0, 0 };
+    bufferPrintf(&response, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n", status, body.length);
+    if (strcmp(method, "HEAD") != 0 && body.length > 0) {
+        bufferAppend(&response, body.data, body.length);
+    }
+    size_t sent = 0;
+    while (sent < response.length) {
+        ssize_t result = send(fd, response.data + sent, response.length - sent, MSG_NOSIGNAL);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        sent += (size_t) result;
+    }
+    free(body.data);
+    free(response.data);
+}
+
+// Minimal HTTP/1.1 server for /metrics on 127.0.0.1:metricsPort. Scrapes are short, so they are answered one at a
+// time; the thread finishes when the stop pipe is closed.
+void * metricsThread(void * arg){
+    struct alarmInfo * alarm_shm = (struct alarmInfo *) arg;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t) metricsPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int reuse = 1;
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0
+        || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        struct commandOutput screen = { .screen = 1, .transcript = 1 };
+        mySlot = &stats->slots[STATS_CONTROL];
+        lockPrint();
+        commandPrint(&screen, "Metrics port %d: %s",metricsPort,strerror(errno));
+        timedRefresh(shell->outputPanel);
+        unlockPrint();
+        if (listener >= 0) {
+            close(listener);
+        }
+        return NULL;
+    }
+
+    for (;;) {
+        struct pollfd fds[2] = { { .fd = listener, .events = POLLIN }, { .fd = stopPipe[0], .events = POLLIN } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents != 0) {
+            break;
+        }
+        int fd = accept(listener, NULL, NULL);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            metricsServe(fd, alarm_shm);
+            close(fd);
+        }
+    }
+    close(listener);
+    return NULL;
+}
+
+// Alarm Panel Updater - once a second, prints the latest alarm and changes the colour of the colour panel
+void alarmPanelLoop(struct alarmInfo * alarm_shm){
+    alarm_shm->alarmLC = 1;
+    mySlot = &stats->slots[STATS_ALARM_PANEL];
+    struct alarmPanelState state;
+    alarmPanelStart(&state, alarmPanel, colourPanel, 0);
+    while(runLoop == 1) {
+        if (!stopWait(state.adaptive.backoff)) {
+            break;
+        }
+        if (adaptiveFrame(&state.adaptive)) {
+            alarmPanelFrame(&state, alarm_shm);
+        }
+    }
+    free(state.shadow.cells);
+}
+
+void * alarmPanelThread(void * arg){
+    alarmPanelLoop((struct alarmInfo *) arg);
+    return NULL;
+}
+
+// Sets up an alarm panel updater for the given panels. With ownLine, the line the alarm is printed on moves on in
+// every frame with the alarms received since the last one, rather than being taken from the alarm information: the
+// alarm handlers of a server have no panel of their own, and each of its sessions has a panel of its own height.
+void alarmPanelStart(struct alarmPanelState * state, WINDOW * alarmPanel, WINDOW * colourPanel, int ownLine){
+    shadowInit(&state->shadow, alarmPanel);
+    state->colourPanel = colourPanel;
+    state->rows = getmaxy(alarmPanel);
+    state->ownLine = ownLine;
+    state->line = 1;
+    state->shown = 0;
+    state->shownColour = -1;
+    state->shownTimeline = 0;
+    state->adaptive = (struct adaptiveState) { .backoff = 1, .fd = STDOUT_FILENO, .stallNs = &stats->ttyStallNs };
+}
+
+// One update of the alarm panel, and of the colour panel
+void alarmPanelFrame(struct alarmPanelState * state, struct alarmInfo * alarm_shm){
+    // Local copy of the alarm, taken without locking
+    struct alarmInfo alarm;
+    struct panelShadow * shadow = &state->shadow;
+    char line[128];
+    unsigned long long frameStart = rawNs();
+    readAlarmInfo(alarm_shm, &alarm);
+    unsigned long long depth = alarm.received - state->shown;
+    atomic_store_explicit(&mySlot->alarmDepth, depth, memory_order_relaxed);
+    if (depth > atomic_load_explicit(&mySlot->alarmDepthMax, memory_order_relaxed)) {
+        atomic_store_explicit(&mySlot->alarmDepthMax, depth, memory_order_relaxed);
+    }
+    if (!state->ownLine) {
+        state->line = alarm.alarmLC;
+    } else {
+        for (unsigned long next = state->shown; next < alarm.received && next < state->shown + (unsigned long) state->rows; next++) {
+            state->line = nextAlarmLine(state->line, alarm.rtReceived > 0, state->rows);
+        }
+    }
+    state->shown = alarm.received;
+
+    lockPrint();
+    int timeline = atomic_load_explicit(&stats->alarmTimeline, memory_order_relaxed);
+    if (timeline != state->shownTimeline) {
+        for (int y = 1; y <= shadow->rows; y++) {
+            shadowLine(shadow, y, "");
+        }
+        state->shownTimeline = timeline;
+    }
+    if (timeline != 0) {
+        drawTimeline(shadow, timeline, atomic_load_explicit(&stats->alarmTimelineEnd, memory_order_relaxed));
+    } else {
+        // Printing the time from the shared memory segment + Alarm Received
+        if (alarm.queued) {
+            // Queued alarms also show their sequence number, so that lost ones can be spotted
+            snprintf(line, sizeof(line), "[%s] Alarm Received #%u",alarm.message,alarm.seq);
+        } else {
+            snprintf(line, sizeof(line), "[%s] Alarm Received",alarm.message);
+        }
+        shadowLine(shadow, state->line, line);
+        // Printing that the alarm has been handled
+        if (alarm.queued) {
+            snprintf(line, sizeof(line), "[%s] Alarm Handled #%u",alarm.message,alarm.seq);
+        } else {
+            snprintf(line, sizeof(line), "[%s] Alarm Handled",alarm.message);
+        }
+        shadowLine(shadow, state->line + 1, line);
+        // Delivery statistics of the queued alarms, on the last line of the panel
+        if (alarm.rtReceived > 0) {
+            snprintf(line, sizeof(line), "RT recv:%lu lost:%lu avg:%lldus max:%lldus",
+                     alarm.rtReceived, alarm.rtLost,
+                     alarm.rtLatencySumUs / (long long) alarm.rtReceived, alarm.rtLatencyMaxUs);
+            shadowLine(shadow, state->rows-2, line);
+        }
+    }
+    // Changing the colour of the alarm panel
+    if (alarm.colour != state->shownColour) {
+        wbkgd(state->colourPanel, COLOR_PAIR(alarm.colour));
+        timedRefresh(state->colourPanel);
+        state->shownColour = alarm.colour;
+    }
+    shadowRefresh(shadow);
+    unlockPrint();
+    frameDone(frameStart);
+}
+
+// Time Panel Updater - every refreshTime seconds, prints the times produced by task3
+void timePanelLoop(struct timeZones * time_shm){
+    mySlot = &stats->slots[STATS_TIME_PANEL];
+    struct timePanelState state;
+    shadowInit(&state.shadow, timePanel);
+    state.adaptive = (struct adaptiveState) { .backoff = 1, .fd = STDOUT_FILENO, .stallNs = &stats->ttyStallNs };
+    while(runLoop == 1) {
+        if (!stopWait(refreshTime * state.adaptive.backoff)) {
+            break;
+        }
+        if (adaptiveFrame(&state.adaptive)) {
+            timePanelFrame(&state, time_shm);
+        }
+    }
+    free(state.shadow.cells);
+}
+
+void * timePanelThread(void * arg){
+    timePanelLoop((struct timeZones *) arg);
+    return NULL;
+}
+
+// One update of the time panel
+void timePanelFrame(struct timePanelState * state, struct timeZones * time_shm){
+    // Local copy of the times, taken without locking
+    struct timeZones times;
+    unsigned long long frameStart = rawNs();
+    if (panelClock != NULL && clockRead(panelClock, &times, time(NULL))) {
+        atomic_store_explicit(&stats->clockPublisher, panelClock->publisher, memory_order_relaxed);
+    } else {
+        atomic_store_explicit(&stats->clockPublisher, 0, memory_order_relaxed);
+        readTimeZones(time_shm, &times);
+    }
+    if (adaptiveDegraded(&state->adaptive)) {
+        dropSeconds(times.USAtime);
+        dropSeconds(times.MALTAtime);
+        dropSeconds(times.TOKYOtime);
+    }
+
+    lockPrint();
+    shadowLine(&state->shadow, 1, times.USAtime);
+    shadowLine(&state->shadow, 2, times.MALTAtime);
+    shadowLine(&state->shadow, 3, times.TOKYOtime);
+    shadowRefresh(&state->shadow);
+    unlockPrint();
+    frameDone(frameStart);
+}
+
+// Starts the shadow of a panel, whose inside is blank (a panel starts out with only its border)
+void shadowInit(struct panelShadow * shadow, WINDOW * window){
+    shadow->window = window;
+    shadow->rows = getmaxy(window) - 2 > 0 ? getmaxy(window) - 2 : 0;
+    shadow->columns = getmaxx(window) - 2 > 0 ? getmaxx(window) - 2 : 0;
+    shadow->cells = malloc(((size_t) (shadow->rows * shadow->columns) + 1) * sizeof(chtype));
+    for (int cell = 0; shadow->cells != NULL && cell < shadow->rows * shadow->columns; cell++) {
+        shadow->cells[cell] = ' ';
+    }
+    shadow->dirty = 0;
+}
+
+// Draws a line of text inside the border of a panel, on row y from column 1, blanking the rest of the row. Only the
+// cells which differ from the shadow are written, each run of them after a single move. The text ends at '\0' or at
+// a newline (ctime ends with one, and drawing it would clear the border).
+void shadowLine(struct panelShadow * shadow, int y, const char * text){
+    if (shadow->cells == NULL || y < 1 || y > shadow->rows) {
+        return;
+    }
+    chtype * row = shadow->cells + (y - 1) * shadow->columns;
+    int following = 0;      // whether the cursor is already on this cell, after writing the one before it
+    for (int x = 0; x < shadow->columns; x++) {
+        chtype c = ' ';
+        if (*text != '\0' && *text != '\n') {
+            c = (chtype) (unsigned char) *text++;
+        }
+        if (row[x] == c) {
+            following = 0;
+            continue;
+        }
+        if (!following) {
+            wmove(shadow->window, y, x + 1);
+        }
+        waddch(shadow->window, c);
+        row[x] = c;
+        following = 1;
+        shadow->dirty = 1;
+    }
+}
+// A single cell, attributes and all, at x (from 1) on line y
+void shadowCell(struct panelShadow * shadow, int y, int x, chtype c){
+    if (shadow->cells == NULL || y < 1 || y > shadow->rows || x < 1 || x > shadow->columns) {
+        return;
+    }
+    chtype * cell = shadow->cells + (y - 1) * shadow->columns + (x - 1);
+    if (*cell != c) {
+        mvwaddch(shadow->window, y, x, c);
+        *cell = c;
+        shadow->dirty = 1;
+    }
+}
+
+// Refreshes a panel if anything was drawn in it since the last refresh
+void shadowRefresh(struct panelShadow * shadow){
+    if (shadow->dirty) {
+        timedRefresh(shadow->window);
+        shadow->dirty = 0;
+    }
+}
+
+// Decides whether a panel updater draws this frame, and how long it waits before the next one (backoff times its
+// usual wait). Always draws when adaptive refresh is off.
+int adaptiveFrame(struct adaptiveState * state){
+    if (!atomic_load(&stats->adaptive)) {
+        state->backoff = 1;
+        return 1;
+    }
+    int queued = 0;
+    if (ioctl(state->fd, TIOCOUTQ, &queued) != 0) {
+        queued = 0;
+    }
+    struct pollfd tty = { .fd = state->fd, .events = POLLOUT };
+    unsigned long long stall = atomic_load_explicit(state->stallNs, memory_order_relaxed);
+    int backedUp = queued > ADAPTIVE_QUEUE_BYTES || poll(&tty, 1, 0) == 0 || stall > state->checkedNs;
+    state->checkedNs = rawNs();
+    if (backedUp) {
+        if (state->backoff < ADAPTIVE_MAX_BACKOFF) {
+            state->backoff *= 2;
+        }
+        state->congestedNs = rawNs();
+        atomic_fetch_add_explicit(&mySlot->skippedFrames, 1, memory_order_relaxed);
+        return 0;
+    }
+    if (state->backoff > 1) {
+        state->backoff /= 2;
+    }
+    return 1;
+}
+
+// Returns whether the terminal was backed up recently enough for the time panel to leave out the seconds
+int adaptiveDegraded(struct adaptiveState * state){
+    return atomic_load(&stats->adaptive) && state->congestedNs != 0 &&
+           rawNs() - state->congestedNs < ADAPTIVE_HOLD_SECONDS * 1000000000ULL;
+}
+
+// Removes the seconds from the first time (hh:mm:ss) in a string
+void dropSeconds(char * text){
+    for (char * c = text; c[0] != '\0'; c++) {
+        if (c[0] == ':' && isdigit((unsigned char) c[1]) && isdigit((unsigned char) c[2]) && c[3] == ':' &&
+            isdigit((unsigned char) c[4]) && isdigit((unsigned char) c[5])) {
+            memmove(c + 3, c + 6, strlen(c + 6) + 1);
+            return;
+        }
+    }
+}
+
+// Sleeps for the given number of seconds, returning early when the program is exiting. Returns 0 once the loops
+// should stop. Child processes wait on the stop pipe, which wakes them as soon as its write end is closed; in thread
+// mode this waits on stopCond, so that every thread wakes up as soon as requestStop() is called.
+int stopWait(unsigned int seconds){
+    if (!threadMode) {
+        struct pollfd stop = { .fd = stopPipe[0], .events = POLLIN };
+        // Anything but a timeout (or a signal, after which runLoop is checked) means the write end was closed
+        if (poll(&stop, 1, (int) seconds * 1000) > 0) {
+            runLoop = 0;
+        }
+        return runLoop == 1;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += seconds;
+    pthread_mutex_lock(&stopLock);
+    while (runLoop == 1 && pthread_cond_timedwait(&stopCond, &stopLock, &deadline) != ETIMEDOUT) {
+    }
+    pthread_mutex_unlock(&stopLock);
+    return runLoop == 1;
+}
+
+// Tells every loop to finish
+void requestStop(){
+    pthread_mutex_lock(&stopLock);
+    runLoop = 0;
+    pthread_cond_broadcast(&stopCond);
+    // Under stopLock, as the control socket thread may ask to stop at the same time as the prompt
+    if (stopPipe[1] >= 0) {
+        close(stopPipe[1]);
+        stopPipe[1] = -1;
+    }
+    pthread_mutex_unlock(&stopLock);
+}
+
+// Tells main that this producer has set up its Shared Memory Segment
+void signalReady(){
+    char ready = 1;
+    if (write(readyPipe[1], &ready, 1) != 1) {
+        perror("ready");
+    }
+}
+
+// Startup barrier: waits (for at most 5 seconds) until count producers have called signalReady(). Returns 0 once
+// they all have, or -1 if one of them failed or took too long.
+int waitReady(int count){
+    char ready[8];
+    int received = 0;
+    while (received < count) {
+        struct pollfd pfd = { .fd = readyPipe[0], .events = POLLIN };
+        int result = poll(&pfd, 1, 5000);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            fprintf(stderr, "Timed out waiting for the alarm and time producers.\n");
+            return -1;
+        }
+        ssize_t n = read(readyPipe[0], ready, (size_t) (count - received));
+        if (n <= 0) {
+            return -1;
+        }
+        received += (int) n;
+    }
+    return 0;
+}
+
+// Creates the directory of the PID files, or checks that the one already there is a directory (not a link to one)
+// which only this user can use, since the alarm logs and control sockets of the sessions go there too. Returns -1
+// with errno set if it can't be used.
+int pidDirOpen(const char * dir){
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    struct stat st;
+    if (lstat(dir, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (st.st_uid != getuid() || (st.st_mode & 0777) != 0700) {
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+}
+
+// Writes this session's PID to <dir>/<pid>.pid, where presblock -D <dir> picks it up. The file is written under a
+// hidden name first and then renamed, so presblock never reads half a PID.
+int writePidFile(const char * dir){
+    char tempPath[PATH_MAX];
+    snprintf(pidFilePath, sizeof(pidFilePath), "%s/%d.pid", dir, (int) getpid());
+    snprintf(tempPath, sizeof(tempPath), "%s/.%d.tmp", dir, (int) getpid());
+    FILE * pidFP = fopen(tempPath, "w");
+    if (pidFP == NULL) {
+        pidFilePath[0] = '\0';
+        return -1;
+    }
+    fprintf(pidFP, "%d\n", (int) getpid());
+    fclose(pidFP);
+    if (rename(tempPath, pidFilePath) != 0) {
+        unlink(tempPath);
+        pidFilePath[0] = '\0';
+        return -1;
+    }
+    return 0;
+}
+
+double elapsedMs(struct timespec * since){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+// SIGTERM handler: the loops see runLoop change the next time they wake up (poll and getch are interrupted by it)
+void stop_handler(int sig){
+    (void) sig;
+    runLoop = 0;
+}
+
+// Waits up to timeoutMs for a child to exit. A child which is still running is sent SIGTERM (so it can still clean
+// up) and given the same time again, then it is killed. Returns 0 if the child exited by itself.
+int reapChild(pid_t pid, int timeoutMs){
+    for (int attempt = 0; attempt < 3; attempt++) {
+        if (attempt == 1) {
+            kill(pid, SIGTERM);
+        } else if (attempt == 2) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+            return -1;
+        }
+        for (int waited = 0; waited <= timeoutMs; waited++) {
+            pid_t result = waitpid(pid, NULL, WNOHANG);
+            if (result == pid || (result < 0 && errno == ECHILD)) {
+                return attempt == 0 ? 0 : -1;
+            }
+            struct timespec millisecond = { 0, 1000000 };
+            nanosleep(&millisecond, NULL);
+        }
+    }
+    return -1;
+}
+
+// Seqlock: the writer makes the version odd before changing the struct and even again afterwards. Readers copy the
+// struct and retry if the version was odd or changed meanwhile, so neither side ever blocks (a signal handler cannot
+// take a lock anyway).
+void seqlockWriteBegin(atomic_uint * version){
+    atomic_fetch_add_explicit(version, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void seqlockWriteEnd(atomic_uint * version){
+    atomic_fetch_add_explicit(version, 1, memory_order_release);
+}
+
+void readAlarmInfo(struct alarmInfo * src, struct alarmInfo * dst){
+    unsigned int before, after;
+    do {
+        before = atomic_load_explicit(&src->version, memory_order_acquire);
+        memcpy(dst, src, sizeof(struct alarmInfo));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&src->version, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+void readTimeZones(struct timeZones * src, struct timeZones * dst){
+    unsigned int before, after;
+    do {
+        before = atomic_load_explicit(&src->version, memory_order_acquire);
+        memcpy(dst, src, sizeof(struct timeZones));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&src->version, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+int task2(){
+
+    if (threadMode) {
+        // In thread mode the alarm information lives in this process, and this thread is the one handling the alarm
+        // signals (they are blocked in every other thread)
+        pthread_sigmask(SIG_UNBLOCK, &alarmSignals, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &time2);
+        signalReady();
+        while (stopWait(60)) {
+        }
+        return 0;
+    }
+
+    // Shared memory segment
+
+    // Alarm Panel Private Shared Memory Segment identifier
+    key_t alarmKey = 0x0001;
+    size_t alarmSize = sizeof(struct alarmInfo);   //alarmY*alarmX
+    // Create the Private Shared Memory Segment
+    int alarm_shmid = shmget(alarmKey, alarmSize, IPC_CREAT | 0666);
+    if (alarm_shmid < 0) {
+        perror("shmget");
+        exit(1);
+    }
+    // Attach to the segment
+    struct alarmInfo * alarm_shm = (struct alarmInfo *) shmat(alarm_shmid, NULL, 0);
+    if (alarm_shm == (struct alarmInfo *) -1) {
+        perror("shmat");
+        exit(1);
+    }
+    signalReady();
+
+    // Set the current time for the presblock
+    clock_gettime(CLOCK_MONOTONIC, &time2);
+
+    // Does not allow the Shared Memory Segment to be destroyed until the program is ready to exit
+    while (stopWait(60)) {
+    }
+
+    // Destroying the Shared Memory Segment when we are done
+    if(shmctl(alarm_shmid, IPC_RMID ,NULL) == -1) {
+        perror("shmctl");
+        exit(1);
+    }
+
+    return 0;
+}
+// Attaches the signal handlers of this process to the Alarm Shared Memory Segment. This is done once, on the first
+// alarm, rather than attaching and detaching on every signal, which would cost three system calls per alarm.
+struct alarmInfo * attachAlarmShm(){
+    if (threadMode) {
+        return threadAlarm;
+    }
+    if (handlerAlarmShm != NULL) {
+        return handlerAlarmShm;
+    }
+
+    key_t alarmKey = 0x0001;
+    size_t alarmSize = sizeof(struct alarmInfo);   // alarmY*alarmX (+colourY?)
+    int alarm_shmid = shmget(alarmKey, alarmSize, 0666);
+    if (alarm_shmid < 0) {
+        perror("shmget");
+        exit(1);
+    }
+    // Attaching to the Private Shared Memory Segment which is storing the Alarm Panel
+    struct alarmInfo * alarm_shm = (struct alarmInfo *) shmat(alarm_shmid, NULL, 0);
+    if (alarm_shm == (struct alarmInfo *) -1) {
+        perror("shmat");
+        exit(1);
+    }
+    handlerAlarmShm = alarm_shm;
+    return alarm_shm;
+}
+
+// Records an alarm in the Alarm Shared Memory Segment: its colour (from the interarrival time), its time and the
+// line of the alarm panel it will be printed on
+void recordAlarm(struct alarmInfo * alarm_shm){
+    time1 = time2;
+    clock_gettime(CLOCK_MONOTONIC, &time2);
+
+    int timeDiff = time2.tv_sec - time1.tv_sec;
+
+    // Decide which colour pair to display based on the interarrival time (limits from the configuration file) and
+    // store it in the Shared Memory Segment
+    if (timeDiff < config.colourLimits[0]){
+        // white
+        alarm_shm->colour = 1;
+    } else if (timeDiff < config.colourLimits[1]){
+        // red
+        alarm_shm->colour = 2;
+    } else if (timeDiff < config.colourLimits[2]){
+        // orange
+        alarm_shm->colour = 3;
+    } else if (timeDiff < config.colourLimits[3]){
+        // green
+        alarm_shm->colour = 4;
+    } else {
+        // blue
+        alarm_shm->colour = 5;
+    }
+
+    // The wall clock time (UTC) the alarm was received at, which is both logged and shown, so that a time read off the
+    // alarm panel can be given to "alarms since"
+    struct timespec received;
+    clock_gettime(CLOCK_REALTIME, &received);
+    alarm_shm->received++;
+    alarm_shm->colourCounts[alarm_shm->colour]++;
+    alarmLogAppend(alarm_shm, &received);
+
+    // Store the time at which the alarm was received in the Shared Memory Segment, as HH:MM:SS (by hand, as gmtime is
+    // not async-signal-safe)
+    int daySeconds = (int) (received.tv_sec % 86400);
+    int fields[3] = { daySeconds / 3600, daySeconds / 60 % 60, daySeconds % 60 };
+    for (int field = 0; field < 3; field++) {
+        alarm_shm->message[field * 3] = (char) ('0' + fields[field] / 10);
+        alarm_shm->message[field * 3 + 1] = (char) ('0' + fields[field] % 10);
+        alarm_shm->message[field * 3 + 2] = field < 2 ? ':' : '\0';
+    }
+
+    // Change the y-coordinate at which the alarm prompts will be printed inside tha alarm panel
+    alarm_shm->alarmLC = nextAlarmLine(alarm_shm->alarmLC, alarm_shm->rtReceived > 0, alarmY);
+}
+
+// The line the next alarm is printed on, after the one printed on line, in an alarm panel of the given height. Once
+// queued alarms have come in, their statistics take the last line of the panel, so the alarms wrap around one line
+// earlier.
+int nextAlarmLine(int line, int queued, int rows){
+    int last = queued ? rows-5 : rows-4;
+    return line < last ? line + 2 : 1;
+}
+
+// Signal Handling method for the presblock daemon
+void signal_handler(int sig){
+    struct alarmInfo * alarm_shm = attachAlarmShm();
+
+    if (sig == SIGALRM){
+        seqlockWriteBegin(&alarm_shm->version);
+        alarm_shm->queued = 0;
+        recordAlarm(alarm_shm);
+        seqlockWriteEnd(&alarm_shm->version);
+        notifyAlarm(alarm_shm);
+        recordEvent(EVENT_ALARM, 0, 0);
+    } else {
+        perror("Unexpected Signal Received");
+    }
+}
+
+// Signal Handling method for every alarm signal while replaying a session log: until the replay is over, only the
+// alarms it raises (sent by this process) are passed on to the usual handlers, and those from presblock or a timer are
+// dropped
+void replay_signal_handler(int sig, siginfo_t * info, void * context){
+    int ours = info->si_pid == getpid() && (info->si_code == SI_USER || info->si_code == SI_QUEUE);
+    if (atomic_load(&replayActive) && !ours) {
+        return;
+    }
+    if (sig == SIGALRM) {
+        signal_handler(sig);
+    } else {
+        rt_signal_handler(sig, info, context);
+    }
+}
+
+// Signal Handling method for queued real-time alarms (presblock -q). Unlike SIGALRM these are never coalesced, and
+// their payload lets us account for every alarm: lost ones show up as gaps in the sequence numbers, and the send
+// time gives the end to end delivery latency (CLOCK_MONOTONIC is shared by all processes on the host).
+void rt_signal_handler(int sig, siginfo_t * info, void * context){
+    (void) sig; (void) context;
+    struct alarmInfo * alarm_shm = attachAlarmShm();
+
+    uint64_t payload = (uint64_t) (uintptr_t) info->si_value.sival_ptr;
+    unsigned int seq = (unsigned int) (payload >> RT_TIME_BITS);
+    uint64_t sentLow = payload & RT_TIME_MASK;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t nowUs = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    // Rebuild the full send time from its low 40 bits, which wrap roughly every 12 days
+    uint64_t sentUs = (nowUs & ~RT_TIME_MASK) | sentLow;
+    if (sentUs > nowUs) {
+        sentUs -= (1ULL << RT_TIME_BITS);
+    }
+    long long latencyUs = (long long) (nowUs - sentUs);
+
+    seqlockWriteBegin(&alarm_shm->version);
+    if (alarm_shm->rtReceived > 0) {
+        // Sequence numbers wrap at 2^24; anything more than half the range ahead is a reordered alarm, not a gap
+        unsigned int gap = (seq - alarm_shm->seq - 1) & ((1U << RT_SEQ_BITS) - 1);
+        if (gap < (1U << (RT_SEQ_BITS - 1))) {
+            alarm_shm->rtLost += gap;
+        }
+    } else {
+        // Alarms sent before the first one we received are also lost
+        alarm_shm->rtLost += seq;
+    }
+    alarm_shm->rtReceived++;
+    alarm_shm->rtLatencySumUs += latencyUs;
+    if (latencyUs > alarm_shm->rtLatencyMaxUs) {
+        alarm_shm->rtLatencyMaxUs = latencyUs;
+    }
+
+    alarm_shm->queued = 1;
+    alarm_shm->seq = seq;
+    recordAlarm(alarm_shm);
+    seqlockWriteEnd(&alarm_shm->version);
+    notifyAlarm(alarm_shm);
+    recordEvent(EVENT_RT_ALARM, sig - SIGRTMIN, seq);
+}
+
+int task3(){
+    // Shared memory segment (in thread mode the struct simply lives in this process)
+    struct timeZones * time_shm = threadTimes;
+    int time_shmid = -1;
+
+    if (!threadMode) {
+        // Time Panel Private Shared Memory Segment identifier
+        key_t timeKey = 0x0002;
+        size_t timeSize = sizeof(struct timeZones);   //timeY*timeX
+        // Create the Private Shared Memory Segment
+        time_shmid = shmget(timeKey, timeSize, IPC_CREAT | 0666);
+        if (time_shmid < 0) {
+            perror("shmget");
+            exit(1);
+        }
+        // Attach to the segment
+        time_shm = (struct timeZones *) shmat(time_shmid, NULL, 0);
+        if (time_shm == (struct timeZones *) -1) {
+            perror("shmat");
+            exit(1);
+        }
+    }
+
+    // while global is not 1 (the times are produced straight away, then every refreshTime seconds). While a session
+    // is replayed, the times after the first come from its log instead.
+    // The shared clock is left alone while a session is replayed, as the times have to be the ones recorded
+    struct sharedClock * clock = replayPath == NULL ? clockOpen(1) : NULL;
+    int ready = 0;
+    while (runLoop == 1) {
+        if (replayPath == NULL || !ready) {
+            time_t now = time(NULL);
+            if (clock == NULL || !clockPublish(clock, now)) {
+                publishTimes(time_shm, now);
+                atomic_fetch_add(&stats->timesProduced, 1);
+            }
+            recordEvent(EVENT_TICK, 0, (uint32_t) now);
+        }
+
+        if (!ready) {
+            signalReady();
+            ready = 1;
+        }
+        // The publisher keeps to once a second, whatever its own refresh time, as every time panel relies on it
+        if (!stopWait(clockPublisher ? 1 : refreshTime)) {
+            break;
+        }
+    }
+    clockClose(clock, 1);
+
+    // Destroying the Shared Memory Segment when we are done
+    if(!threadMode && shmctl(time_shmid, IPC_RMID ,NULL) == -1) {
+        perror("shmctl");
+        exit(1);
+    }
+
+    return 0;
+}
+
+// Stores the times of every time zone, at the given time, in the Time Shared Memory Segment
+void publishTimes(struct timeZones * time_shm, time_t now){
+    char text[32];
+    char * slots[CONFIG_CLOCKS] = { time_shm->USAtime, time_shm->MALTAtime, time_shm->TOKYOtime };
+    uint64_t clocks = clocksSignature();
+    seqlockWriteBegin(&time_shm->version);
+    time_shm->clocks = clocks;
+    time_shm->produced = now;
+    for (int i = 0; i < CONFIG_CLOCKS; i++) {
+        // Adding the clock's offset to the epoch time to adjust for its Time Zone
+        time_t local = now + config.clocks[i].offsetMinutes*60;
+        // Storing the formatted time in the Shared Memory Segment
+        snprintf(slots[i], sizeof(time_shm->USAtime), "%s: %s",config.clocks[i].label,ctime_r(&local, text));
+    }
+    seqlockWriteEnd(&time_shm->version);
+}
+
+// Which clocks the times are for, as FNV-1a over their labels and offsets
+uint64_t clocksSignature(){
+    const unsigned char * bytes = (const unsigned char *) config.clocks;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sizeof(config.clocks); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Maps the shared clock read-only, creating it if need be. task3 (the producer) keeps its descriptor for the lock;
+// the time panel only needs the mapping. Returns NULL if there is no shared memory, or it holds something else.
+struct sharedClock * clockOpen(int producer){
+    char name[64];
+    snprintf(name, sizeof(name), "/orangewave-clock-%d", (int) getuid());
+    int fd = producer ? shm_open(name, O_RDWR | O_CREAT, 0600) : shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    // Another user could have made the object first (its name is easily guessed), so one which is not this user's
+    // alone is not used, and the times are produced locally instead
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_uid != getuid() || (info.st_mode & (S_IWGRP | S_IWOTH)) != 0
+        || (info.st_size != 0 && info.st_size != sizeof(struct sharedClock))
+        || (info.st_size == 0 && (!producer || ftruncate(fd, sizeof(struct sharedClock)) != 0))) {
+        close(fd);
+        return NULL;
+    }
+    struct sharedClock * clock = mmap(NULL, sizeof(struct sharedClock), PROT_READ, MAP_SHARED, fd, 0);
+    if (clock == MAP_FAILED || (clock->magic[0] != '\0' && memcmp(clock->magic, CLOCK_MAGIC, 8) != 0)) {
+        if (clock != MAP_FAILED) {
+            munmap(clock, sizeof(struct sharedClock));
+        }
+        close(fd);
+        return NULL;
+    }
+    if (producer) {
+        sharedClockFd = fd;
+    } else {
+        close(fd);
+    }
+    return clock;
+}
+
+void clockClose(struct sharedClock * clock, int producer){
+    if (clock == NULL) {
+        return;
+    }
+    munmap(clock, sizeof(struct sharedClock));
+    if (producer) {
+        // Which also gives up the lock, if this was the publisher
+        close(sharedClockFd);
+        sharedClockFd = -1;
+        clockPublisher = 0;
+    }
+}
+
+// Copies the shared times, if they are fresh and for the same clocks as this session's. Unlike readTimeZones, this
+// gives up on a version which stays odd: the publisher may have been killed half way through publishing.
+int clockRead(struct sharedClock * clock, struct timeZones * dst, time_t now){
+    unsigned int before, after;
+    int attempts = 0;
+    do {
+        if (++attempts > 1000) {
+            return 0;
+        }
+        before = atomic_load_explicit(&clock->times.version, memory_order_acquire);
+        memcpy(dst, &clock->times, sizeof(struct timeZones));
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&clock->times.version, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return dst->clocks == clocksSignature() && dst->produced + CLOCK_STALE >= now && dst->produced <= now + 1;
+}
+
+// Called by task3 every tick: the publisher publishes, and anyone else takes over if the times have gone stale and the
+// lock is free. Returns whether the shared times are the ones to show (otherwise task3 produces its own).
+int clockPublish(struct sharedClock * clock, time_t now){
+    if (!clockPublisher) {
+        struct timeZones shared;
+        if (clockRead(clock, &shared, now) || shared.produced + CLOCK_STALE >= now) {
+            // Fresh, whether or not for the same clocks: someone else is publishing
+            return shared.clocks == clocksSignature() && shared.produced + CLOCK_STALE >= now;
+        }
+        if (flock(sharedClockFd, LOCK_EX | LOCK_NB) != 0) {
+            return 0;
+        }
+        if (mprotect(clock, sizeof(struct sharedClock), PROT_READ | PROT_WRITE) != 0) {
+            flock(sharedClockFd, LOCK_UN);
+            return 0;
+        }
+        // A publisher killed half way through publishing leaves the version odd
+        if (atomic_load(&clock->times.version) & 1) {
+            atomic_fetch_add(&clock->times.version, 1);
+        }
+        memcpy(clock->magic, CLOCK_MAGIC, 8);
+        // The PID of the session (task3 is its child in process mode), as in its PID file
+        clock->publisher = (int32_t) (threadMode ? getpid() : getppid());
+        clockPublisher = 1;
+    }
+    publishTimes(&clock->times, now);
+    atomic_fetch_add(&stats->timesProduced, 1);
+    return 1;
+}
+
+// Maps the alarm log, creating it if need be. A kept log is locked for as long as the session runs, so that two
+// sessions never append to the same one, and one of another size (or without the magic) starts again from nothing.
+// The log of a session is always a new file (one left behind by an earlier session with the same PID is removed
+// first), and a kept one is only used if it is a regular file of this user's, never through a symbolic link, so that
+// nothing else can be truncated or written over.
+int alarmLogOpen(const char * path, int kept){
+    struct stat info;
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC | (kept ? 0 : O_EXCL), 0600);
+    if (fd < 0 && !kept && errno == EEXIST && lstat(path, &info) == 0 && S_ISREG(info.st_mode)
+        && info.st_uid == getuid() && unlink(path) == 0) {
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_uid != getuid() || info.st_nlink != 1) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    if ((kept && flock(fd, LOCK_EX | LOCK_NB) != 0)
+        || (info.st_size != sizeof(struct alarmLog) && (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(struct alarmLog)) != 0))) {
+        close(fd);
+        return -1;
+    }
+    struct alarmLog * log = mmap(NULL, sizeof(struct alarmLog), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (log == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    // The descriptor of a kept log stays open (close-on-exec) for its lock
+    if (!kept) {
+        close(fd);
+    }
+    if (memcmp(log->magic, ALARM_LOG_MAGIC, 8) != 0 || log->capacity != ALARM_LOG_RECORDS) {
+        memcpy(log->magic, ALARM_LOG_MAGIC, 8);
+        log->capacity = ALARM_LOG_RECORDS;
+        atomic_store(&log->count, 0);
+    }
+    snprintf(alarmLogPath, sizeof(alarmLogPath), "%s", path);
+    alarmLogKept = kept;
+    alarmLog = log;
+    return 0;
+}
+
+void alarmLogClose(){
+    if (alarmLog == NULL) {
+        return;
+    }
+    munmap(alarmLog, sizeof(struct alarmLog));
+    alarmLog = NULL;
+    if (!alarmLogKept) {
+        unlink(alarmLogPath);
+    }
+}
+
+// Called by the alarm handlers (from recordAlarm) for every alarm, so nothing here may allocate or lock
+void alarmLogAppend(struct alarmInfo * alarm_shm, const struct timespec * received){
+    if (alarmLog == NULL) {
+        return;
+    }
+    uint64_t index = atomic_load_explicit(&alarmLog->count, memory_order_relaxed);
+    struct alarmRecord * record = &alarmLog->records[index % ALARM_LOG_RECORDS];
+    record->timeNs = (int64_t) received->tv_sec * 1000000000 + received->tv_nsec;
+    record->interarrivalNs = alarm_shm->received > 1 ? (uint64_t) ((time2.tv_sec - time1.tv_sec) * 1000000000LL + (time2.tv_nsec - time1.tv_nsec)) : 0;
+    record->colour = (uint8_t) alarm_shm->colour;
+    record->queued = (uint8_t) alarm_shm->queued;
+    record->seq = alarm_shm->seq;
+    atomic_store_explicit(&alarmLog->count, index + 1, memory_order_release);
+}
+
+// The first alarm of the log which can still be read, out of count appended
+uint64_t alarmLogOldest(uint64_t count){
+    return count > ALARM_LOG_RECORDS - ALARM_LOG_MARGIN ? count - (ALARM_LOG_RECORDS - ALARM_LOG_MARGIN) : 0;
+}
+
+// Binary search for the first alarm received at or after timeNs (count if there is none), counting the probes made
+uint64_t alarmLogFind(int64_t timeNs, uint64_t count, int * probes){
+    uint64_t low = alarmLogOldest(count), high = count;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (alarmLog->records[middle % ALARM_LOG_RECORDS].timeNs < timeNs) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+        if (probes != NULL) {
+            (*probes)++;
+        }
+    }
+    return low;
+}
+
+// A time for "alarms since" and "alarms scroll": HH:MM[:SS] (UTC, like the alarms, on the last day it was that time),
+// a time ago such as 90s, 5m, 2h or 1d (a leading - is allowed), or @seconds since the epoch
+int parseAlarmTime(const char * text, int64_t * timeNs){
+    time_t now = time(NULL);
+    int hours, minutes, seconds = 0;
+    long long amount;
+    char unit = 's', end;
+    if (sscanf(text, "%d:%d:%d%c", &hours, &minutes, &seconds, &end) == 3 || sscanf(text, "%d:%d%c", &hours, &minutes, &end) == 2) {
+        if (hours < 0 || hours > 23 || minutes < 0 || minutes > 59 || seconds < 0 || seconds > 59) {
+            return -1;
+        }
+        time_t at = now - now % 86400 + hours * 3600 + minutes * 60 + seconds;
+        if (at > now) {
+            at -= 86400;
+        }
+        *timeNs = (int64_t) at * 1000000000;
+        return 0;
+    }
+    if (sscanf(text, "@%lld%c", &amount, &end) == 1) {
+        *timeNs = (int64_t) amount * 1000000000;
+        return 0;
+    }
+    if (*text == '-') {
+        text++;
+    }
+    int fields = sscanf(text, "%lld%c%c", &amount, &unit, &end);
+    if (fields < 1 || fields > 2 || amount < 0) {
+        return -1;
+    }
+    long long scale = unit == 's' ? 1 : unit == 'm' ? 60 : unit == 'h' ? 3600 : unit == 'd' ? 86400 : 0;
+    if (scale == 0) {
+        return -1;
+    }
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    *timeNs = ((int64_t) wall.tv_sec - amount * scale) * 1000000000 + wall.tv_nsec;
+    return 0;
+}
+
+// alarms: how many alarms the log holds; alarms since <time>: how many came in since then, found by binary search on
+// the times, and their colours; alarms timeline [seconds per column] and alarms lines: what the alarm panel shows;
+// alarms scroll <time>|live: where the timeline ends
+void alarmsCommand(const char * argument, struct commandOutput * out){
+    const char * colours[6] = { "none", "white", "red", "orange", "green", "blue" };
+    char text[64];
+    if (alarmLog == NULL) {
+        commandPrint(out, "There is no alarm log");
+        return;
+    }
+    uint64_t count = atomic_load_explicit(&alarmLog->count, memory_order_acquire);
+    uint64_t oldest = alarmLogOldest(count);
+    if (argument[0] == '\0') {
+        if (count == oldest) {
+            commandPrint(out, "No alarms in %s",alarmLogPath);
+            return;
+        }
+        time_t first = (time_t) (alarmLog->records[oldest % ALARM_LOG_RECORDS].timeNs / 1000000000);
+        strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", gmtime(&first));
+        commandPrint(out, "%llu alarms logged in %s, %llu of them kept (since %s)",(unsigned long long) count,alarmLogPath,
+                     (unsigned long long) (count - oldest),text);
+    } else if (strncmp(argument, "since ", 6) == 0) {
+        int64_t since;
+        if (parseAlarmTime(argument + 6, &since) != 0) {
+            commandPrint(out, "alarms since HH:MM[:SS], a time ago (90s, 5m, 2h, 1d) or @seconds since the epoch");
+            return;
+        }
+        unsigned long long searchStart = rawNs();
+        int probes = 0;
+        uint64_t first = alarmLogFind(since, count, &probes);
+        double searchUs = (double) (rawNs() - searchStart) / 1e3;
+        time_t at = (time_t) (since / 1000000000);
+        strftime(text, sizeof(text), "%H:%M:%S", gmtime(&at));
+        commandPrint(out, "%llu alarms since %s (found in %d probes, %.1f us)",(unsigned long long) (count - first),text,probes,searchUs);
+        if (first == oldest && oldest > 0) {
+            commandPrint(out, "The log only goes back %llu alarms, so there may have been more",(unsigned long long) (count - oldest));
+        }
+        if (first < count) {
+            unsigned long colourCounts[6] = { 0 };
+            uint64_t interarrivalSum = 0, interarrivalMax = 0;
+            for (uint64_t index = first; index < count; index++) {
+                struct alarmRecord * record = &alarmLog->records[index % ALARM_LOG_RECORDS];
+                colourCounts[record->colour < 6 ? record->colour : 0]++;
+                interarrivalSum += record->interarrivalNs;
+                if (record->interarrivalNs > interarrivalMax) {
+                    interarrivalMax = record->interarrivalNs;
+                }
+            }
+            commandPrint(out, "white %lu, red %lu, orange %lu, green %lu, blue %lu; interarrival avg %.3f ms, max %.3f ms",
+                         colourCounts[1],colourCounts[2],colourCounts[3],colourCounts[4],colourCounts[5],
+                         (double) interarrivalSum / 1e6 / (double) (count - first),(double) interarrivalMax / 1e6);
+            struct alarmRecord * last = &alarmLog->records[(count - 1) % ALARM_LOG_RECORDS];
+            at = (time_t) (last->timeNs / 1000000000);
+            strftime(text, sizeof(text), "%H:%M:%S", gmtime(&at));
+            commandPrint(out, "The latest at %s.%03lld (%s)",text,(long long) (last->timeNs % 1000000000 / 1000000),colours[last->colour < 6 ? last->colour : 0]);
+        }
+    } else if (strncmp(argument, "timeline", 8) == 0 && (argument[8] == '\0' || argument[8] == ' ')) {
+        int seconds = argument[8] == ' ' ? atoi(argument + 9) : 1;
+        if (seconds < 1 || seconds > 86400) {
+            commandPrint(out, "alarms timeline [seconds per column, 1 to 86400]");
+            return;
+        }
+        atomic_store(&stats->alarmTimeline, seconds);
+        commandPrint(out, "The alarm panel shows the timeline, %d second%s per column",seconds,seconds == 1 ? "" : "s");
+    } else if (strcmp(argument, "lines") == 0) {
+        atomic_store(&stats->alarmTimeline, 0);
+        commandPrint(out, "The alarm panel shows the latest alarm");
+    } else if (strncmp(argument, "scroll ", 7) == 0) {
+        int64_t end;
+        if (strcmp(argument + 7, "live") == 0) {
+            atomic_store(&stats->alarmTimelineEnd, 0);
+            commandPrint(out, "The timeline follows the latest alarms");
+        } else if (parseAlarmTime(argument + 7, &end) == 0) {
+            atomic_store(&stats->alarmTimelineEnd, (long long) (end / 1000000000));
+            time_t at = (time_t) (end / 1000000000);
+            strftime(text, sizeof(text), "%H:%M:%S", gmtime(&at));
+            commandPrint(out, "The timeline ends at %s",text);
+        } else {
+            commandPrint(out, "alarms scroll HH:MM[:SS]|90s|5m|2h|1d|@seconds|live");
+        }
+    } else {
+        commandPrint(out, "alarms [since <time> | timeline [seconds] | lines | scroll <time>|live]");
+    }
+}
+
+// Draws the alarm log as a timeline: a bar per column of secondsPerColumn seconds, as high as the alarms in it (the
+// busiest column filling the panel) and in the colour most of them had, with the last column ending at end (or now).
+// The alarms before it are found by binary search, so only those on screen are read.
+void drawTimeline(struct panelShadow * shadow, int secondsPerColumn, long long end){
+    int columns = shadow->columns < TIMELINE_COLUMNS ? shadow->columns : TIMELINE_COLUMNS;
+    int bars = shadow->rows - 2;
+    char line[TIMELINE_COLUMNS + 1];
+    if (alarmLog == NULL || columns < 20 || bars < 1) {
+        shadowLine(shadow, 1, alarmLog == NULL ? "No alarm log" : "Too small for the timeline");
+        return;
+    }
+    // counts[column][0] holds every alarm in the column, and the others those of each colour
+    unsigned int counts[TIMELINE_COLUMNS][6];
+    memset(counts, 0, sizeof(counts[0]) * (size_t) columns);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t columnNs = (int64_t) secondsPerColumn * 1000000000;
+    // Live, the last column holds the current second (or the current stretch of secondsPerColumn seconds)
+    int64_t endNs = end != 0 ? (int64_t) end * 1000000000 : ((int64_t) now.tv_sec / secondsPerColumn + 1) * columnNs;
+    int64_t startNs = endNs - columnNs * columns;
+    uint64_t count = atomic_load_explicit(&alarmLog->count, memory_order_acquire);
+    unsigned int busiest = 0;
+    for (uint64_t index = alarmLogFind(startNs, count, NULL); index < count; index++) {
+        struct alarmRecord * record = &alarmLog->records[index % ALARM_LOG_RECORDS];
+        if (record->timeNs >= endNs) {
+            break;
+        }
+        int column = (int) ((record->timeNs - startNs) / columnNs);
+        if (column < 0 || column >= columns) {
+            continue;
+        }
+        counts[column][0]++;
+        counts[column][record->colour < 6 ? record->colour : 0]++;
+        if (counts[column][0] > busiest) {
+            busiest = counts[column][0];
+        }
+    }
+
+    snprintf(line, sizeof(line), "Alarms per %ds, busiest %u%s",secondsPerColumn,busiest,end != 0 ? " (scrolled)" : "");
+    shadowLine(shadow, 1, line);
+    for (int column = 0; column < columns; column++) {
+        int colour = 1;
+        for (int c = 2; c < 6; c++) {
+            if (counts[column][c] > counts[column][colour]) {
+                colour = c;
+            }
+        }
+        // Any alarm at all shows as at least one cell
+        int height = busiest > 0 ? (int) ((counts[column][0] * (unsigned int) bars + busiest - 1) / busiest) : 0;
+        for (int bar = 0; bar < bars; bar++) {
+            shadowCell(shadow, bars + 1 - bar, column + 1, bar < height ? (' ' | COLOR_PAIR(colour)) : ' ');
+        }
+    }
+    // The times at either end
+    char from[16], to[16];
+    time_t at = (time_t) (startNs / 1000000000);
+    strftime(from, sizeof(from), "%H:%M:%S", gmtime(&at));
+    at = (time_t) (endNs / 1000000000);
+    strftime(to, sizeof(to), "%H:%M:%S", gmtime(&at));
+    snprintf(line, sizeof(line), "%-*s%s",columns - (int) strlen(to),from,to);
+    shadowLine(shadow, bars + 2, line);
+}
+
+// Appends an event to the session log, when recording. Called from the alarm signal handlers, so errno is kept.
+void recordEvent(int type, int detail, uint32_t value){
+    if (recordFd < 0) {
+        return;
+    }
+    int savedErrno = errno;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    struct sessionEvent event;
+    memset(&event, 0, sizeof(event));
+    event.offsetNs = (uint64_t) ((now.tv_sec - startTime.tv_sec) * 1000000000LL + (now.tv_nsec - startTime.tv_nsec));
+    event.type = (uint8_t) type;
+    event.detail = (uint8_t) detail;
+    event.value = value;
+    if (write(recordFd, &event, sizeof(event)) != (ssize_t) sizeof(event)) {
+        // Nothing can be reported from a signal handler; the log is simply missing the event
+    }
+    errno = savedErrno;
+}
+
+// Waits until the prompt acknowledges a replayed key, returning 0 if the program is exiting instead
+int replayWaitKey(){
+    struct pollfd wait[2] = { { .fd = replayAck[0], .events = POLLIN }, { .fd = stopPipe[0], .events = POLLIN } };
+    char done;
+    while (runLoop == 1) {
+        if (poll(wait, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        if (wait[1].revents != 0) {
+            return 0;
+        }
+        if (wait[0].revents != 0) {
+            return read(replayAck[0], &done, 1) == 1;
+        }
+    }
+    return 0;
+}
+
+// Replays a session log: each event waits for its time (measured from startTime, like when it was recorded) unless
+// replaying as fast as possible, and for the one before it to be dealt with. Keys are passed to the prompt, alarms
+// are raised again with the same signal (and sequence number) so that they go through the signal handlers, and
+// times are stored in the Time Shared Memory Segment as task3 would.
+void * replayThread(void * arg){
+    struct replayTarget * target = (struct replayTarget *) arg;
+    struct commandOutput screen = { .screen = 1, .transcript = 1 };
+    FILE * log = fopen(replayPath, "rb");
+    char magic[8];
+    if (log == NULL || fread(magic, 1, sizeof(magic), log) != sizeof(magic) || memcmp(magic, SESSION_MAGIC, 8) != 0) {
+        lockPrint();
+        commandPrint(&screen, "%s is not a session log",replayPath);
+        timedRefresh(shell->outputPanel);
+        unlockPrint();
+        if (log != NULL) {
+            fclose(log);
+        }
+        atomic_store(&replayActive, 0);
+        return NULL;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    unsigned long events = 0;
+    struct sessionEvent event;
+    while (runLoop == 1 && fread(&event, sizeof(event), 1, log) == 1) {
+        long long waitNs = (long long) event.offsetNs - (long long) (elapsedMs(&startTime) * 1e6);
+        if (!replayFast && waitNs > 0) {
+            struct pollfd stop = { .fd = stopPipe[0], .events = POLLIN };
+            struct timespec timeout = { (time_t) (waitNs / 1000000000), (long) (waitNs % 1000000000) };
+            if (ppoll(&stop, 1, &timeout, NULL) > 0) {
+                break;
+            }
+        }
+        if (event.type == EVENT_KEY) {
+            char key = (char) event.detail;
+            if (write(replayKeys[1], &key, 1) != 1 || !replayWaitKey()) {
+                break;
+            }
+        } else if (event.type == EVENT_ALARM || event.type == EVENT_RT_ALARM) {
+            struct alarmInfo before, after;
+            readAlarmInfo(target->alarm_shm, &before);
+            if (event.type == EVENT_ALARM) {
+                kill(getpid(), SIGALRM);
+            } else {
+                // The same payload presblock -q sends: the sequence number, and the time it is sent
+                struct timespec now;
+                clock_gettime(CLOCK_MONOTONIC, &now);
+                uint64_t nowUs = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+                union sigval payload;
+                payload.sival_ptr = (void *) (uintptr_t) (((uint64_t) event.value << RT_TIME_BITS) | (nowUs & RT_TIME_MASK));
+                sigqueue(getpid(), SIGRTMIN + event.detail, payload);
+            }
+            // Waiting (for at most a second) until a handler has taken the alarm
+            struct timespec pause = { 0, 100000 };
+            for (int tries = 0; tries < 10000 && runLoop == 1; tries++) {
+                readAlarmInfo(target->alarm_shm, &after);
+                if (after.received != before.received) {
+                    break;
+                }
+                nanosleep(&pause, NULL);
+            }
+        } else if (event.type == EVENT_TICK) {
+            publishTimes(target->time_shm, (time_t) event.value);
+            recordEvent(EVENT_TICK, 0, event.value);
+        }
+        events++;
+    }
+    fclose(log);
+    atomic_store(&replayActive, 0);
+    if (runLoop == 1) {
+        lockPrint();
+        commandPrint(&screen, "Replayed %lu events of %s in %.1f ms",events,replayPath,elapsedMs(&start));
+        timedRefresh(shell->outputPanel);
+        unlockPrint();
+    }
+    return NULL;
+}
+
+void * task2Thread(void * arg){
+    (void) arg;
+    task2();
+    return NULL;
+}
+
+void * task3Thread(void * arg){
+    (void) arg;
+    task3();
+    return NULL;
+}
+// Server mode: the alarm and time producers run as threads, as in thread mode, and the sessions are hosted by the
+// workers (see serverSession). This thread accepts the clients and keeps time for the frames, until SIGTERM.
+int runServer(const char * path){
+    // Like the control socket, the server socket only replaces a socket and only lets this user attach
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (listener < 0 || removeSocket(path) != 0 || listenPrivate(listener, path) != 0) {
+        perror(path);
+        unlink(pidFilePath);
+        alarmLogClose();
+        return EXIT_FAILURE;
+    }
+    serverPoll = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event accepting = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(serverPoll, EPOLL_CTL_ADD, listener, &accepting);
+    // A client which goes away while its terminal is drawn on ends its session, rather than the server
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, NULL);
+    if (getcwd(mainShell.cwd, sizeof(mainShell.cwd)) == NULL) {
+        snprintf(mainShell.cwd, sizeof(mainShell.cwd), ".");
+    }
+    panelClock = clockOpen(0);
+    // newterm takes the size of a client's terminal from LINES and COLUMNS, as the socket has none. They are set here,
+    // before there are other threads, so that setScreenSize only ever replaces their values (which getenv can read
+    // meanwhile) and never adds to the environment.
+    setScreenSize(24, 80);
+
+    // As in thread mode, the alarm signals are only handled by the task2 thread, and SIGTERM by this one
+    sigset_t threadSignals = alarmSignals;
+    sigaddset(&threadSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &threadSignals, NULL);
+    pthread_t thread1, thread2;
+    if (pthread_create(&thread1, threadAttributes, task2Thread, NULL) != 0 || pthread_create(&thread2, threadAttributes, task3Thread, NULL) != 0) {
+        fprintf(stderr, "Error creating the alarm and time threads.\n");
+        exit(EXIT_FAILURE);
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    serverWorkers = cpus < 1 ? 1 : cpus > SERVER_WORKERS ? SERVER_WORKERS : (int) cpus;
+    for (int worker = 0; worker < serverWorkers; worker++) {
+        pthread_mutex_init(&serverQueues[worker].lock, NULL);
+    }
+    for (int worker = 0; worker < serverWorkers; worker++, serverThreadCount++) {
+        if (pthread_create(&serverThreads[worker], threadAttributes, serverWorker, (void *) (intptr_t) worker) != 0) {
+            fprintf(stderr, "Error creating the workers.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sigemptyset(&threadSignals);
+    sigaddset(&threadSignals, SIGTERM);
+    pthread_sigmask(SIG_UNBLOCK, &threadSignals, NULL);
+    int started = waitReady(2) == 0;
+    if (started) {
+        fprintf(stderr, "Orange Wave server PID: %d (%s) on %s, ready in %.1f ms\n", getpid(), pidFilePath, path, elapsedMs(&startTime));
+    }
+
+    struct serverSession * sessions = NULL;
+    int sessionCount = 0;
+    int nextId = 1;
+    unsigned long long nextTick = rawNs() + 1000000000ULL;
+    while (started && runLoop == 1) {
+        struct epoll_event events[64];
+        unsigned long long now = rawNs();
+        int timeout = now >= nextTick ? 0 : (int) ((nextTick - now) / 1000000) + 1;
+        int count = epoll_wait(serverPoll, events, 64, timeout);
+        for (int event = 0; event < count; event++) {
+            struct serverSession * session = events[event].data.ptr;
+            if (session != NULL) {
+                serverPost(&session->keys);
+                continue;
+            }
+            int fd;
+            while ((fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+                if (!peerIsUser(fd)) {
+                    close(fd);
+                    continue;
+                }
+                if (sessionCount == SERVER_SESSIONS || (session = calloc(1, sizeof(struct serverSession))) == NULL) {
+                    dprintf(fd, "Too many sessions.\r\n");
+                    close(fd);
+                    continue;
+                }
+                session->fd = fd;
+                session->id = nextId++;
+                clock_gettime(CLOCK_MONOTONIC, &session->started);
+                session->keys = (struct serverTask) { .session = session, .kind = TASK_KEYS };
+                session->frame = (struct serverTask) { .session = session, .kind = TASK_FRAME };
+                atomic_store(&session->tasksLeft, 2);
+                session->next = sessions;
+                sessions = session;
+                sessionCount++;
+                struct epoll_event reading = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = session };
+                epoll_ctl(serverPoll, EPOLL_CTL_ADD, fd, &reading);
+            }
+        }
+        if (rawNs() < nextTick) {
+            continue;
+        }
+        nextTick += 1000000000ULL;
+        if (nextTick < rawNs()) {
+            nextTick = rawNs() + 1000000000ULL;
+        }
+
+        // Once a second: the sessions which have ended are freed, the clients which never said hello or stopped taking
+        // output are cut off (which also lets go of a worker stuck writing to one), and every other session draws a frame
+        time_t seconds = time(NULL);
+        for (struct serverSession ** link = &sessions; *link != NULL; ) {
+            struct serverSession * session = *link;
+            if (atomic_load(&session->ended)) {
+                *link = session->next;
+                close(session->fd);
+                free(session);
+                sessionCount--;
+                continue;
+            }
+            link = &session->next;
+            struct pollfd client = { .fd = session->fd, .events = POLLOUT };
+            if (poll(&client, 1, 0) != 0) {
+                session->stalledSince = 0;
+            } else if (session->stalledSince == 0) {
+                session->stalledSince = seconds;
+            }
+            if ((!atomic_load(&session->opened) && elapsedMs(&session->started) > SERVER_HELLO_SECONDS * 1000.0) ||
+                (session->stalledSince != 0 && seconds - session->stalledSince >= SERVER_STALL_SECONDS)) {
+                shutdown(session->fd, SHUT_RDWR);
+            }
+            serverPost(&session->frame);
+        }
+    }
+
+    // The workers finish what they are running (the commands of the sessions are ended, with SIGTERM, and SIGKILL if
+    // that has not done it within 500 ms), then every session left is ended, which restores the client's terminal
+    pthread_mutex_lock(&serverIdleLock);
+    serverStopping = 1;
+    pthread_cond_broadcast(&serverIdleCond);
+    pthread_mutex_unlock(&serverIdleLock);
+    for (int sig = SIGTERM, wait = 0; atomic_load(&serverBusy) > 0; wait++) {
+        for (struct serverSession * session = sessions; session != NULL; session = session->next) {
+            int child = atomic_load(&session->shell.child);
+            if (child > 0) {
+                kill(-child, sig);
+            }
+        }
+        poll(NULL, 0, 50);
+        if (wait == 10) {
+            sig = SIGKILL;
+            // A worker may also be stuck writing to a client which takes no output
+            for (struct serverSession * session = sessions; session != NULL; session = session->next) {
+                struct pollfd client = { .fd = session->fd, .events = POLLOUT };
+                if (poll(&client, 1, 0) == 0) {
+                    shutdown(session->fd, SHUT_RDWR);
+                }
+            }
+        }
+    }
+    // No worker is started once the server is stopping
+    for (int worker = 0; worker < serverThreadCount; worker++) {
+        pthread_join(serverThreads[worker], NULL);
+    }
+    while (sessions != NULL) {
+        struct serverSession * session = sessions;
+        sessions = session->next;
+        if (!atomic_load(&session->ended)) {
+            currentSession = session;
+            shell = &session->shell;
+            sessionEnd(session);
+        }
+        close(session->fd);
+        free(session);
+    }
+    currentSession = NULL;
+    shell = &mainShell;
+    close(listener);
+    close(serverPoll);
+    removeSocket(path);
+    requestStop();
+    pthread_join(thread1, NULL);
+    pthread_join(thread2, NULL);
+    clockClose(panelClock, 0);
+    unlink(pidFilePath);
+    alarmLogClose();
+    return started ? 0 : EXIT_FAILURE;
+}
+
+// Queues a task of a session once something happened for it, unless it is queued or running already (the pending
+// flag then makes it run again, see serverRun)
+void serverPost(struct serverTask * task){
+    atomic_store(&task->pending, 1);
+    if (atomic_exchange(&task->queued, 1) == 0) {
+        serverPush(task);
+    }
+}
+
+// Puts a task on the calling worker's own queue, or (from the main thread) on the next worker's in turn, and wakes a
+// worker to run it
+void serverPush(struct serverTask * task){
+    int queue = myQueue >= 0 ? myQueue : (int) (atomic_fetch_add(&serverNext, 1) % (unsigned int) serverWorkers);
+    struct serverQueue * own = &serverQueues[queue];
+    pthread_mutex_lock(&own->lock);
+    own->tasks[own->tail++ % (2 * SERVER_SESSIONS)] = task;
+    pthread_mutex_unlock(&own->lock);
+    pthread_mutex_lock(&serverIdleLock);
+    serverQueued++;
+    pthread_cond_signal(&serverIdleCond);
+    pthread_mutex_unlock(&serverIdleLock);
+}
+
+// Takes the newest task of a worker's own queue, or else steals the oldest one of another worker's. Returns NULL if
+// every queue is empty.
+struct serverTask * serverTake(int queue){
+    struct serverTask * task = NULL;
+    if (queue >= 0) {
+        struct serverQueue * own = &serverQueues[queue];
+        pthread_mutex_lock(&own->lock);
+        if (own->tail != own->head) {
+            task = own->tasks[--own->tail % (2 * SERVER_SESSIONS)];
+        }
+        pthread_mutex_unlock(&own->lock);
+    }
+    for (int other = queue >= 0 ? 1 : 0; task == NULL && other < serverWorkers; other++) {
+        struct serverQueue * victim = &serverQueues[(queue + serverWorkers + other) % serverWorkers];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->tail != victim->head) {
+            task = victim->tasks[victim->head++ % (2 * SERVER_SESSIONS)];
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return task;
+}
+
+// A worker of the server: runs the tasks of the sessions until the server stops. Each task it waits for is counted
+// off serverQueued first, so that there is always one on some queue for it to take.
+void * serverWorker(void * arg){
+    myQueue = (int) (intptr_t) arg;
+    outputBuffer = malloc(outputBufferSize);
+    while (outputBuffer != NULL) {
+        pthread_mutex_lock(&serverIdleLock);
+        while (serverQueued == 0 && !serverStopping) {
+            pthread_cond_wait(&serverIdleCond, &serverIdleLock);
+        }
+        if (serverStopping) {
+            pthread_mutex_unlock(&serverIdleLock);
+            break;
+        }
+        serverQueued--;
+        atomic_fetch_add(&serverBusy, 1);
+        pthread_mutex_unlock(&serverIdleLock);
+        struct serverTask * task;
+        while ((task = serverTake(myQueue)) == NULL) {
+            sched_yield();
+        }
+        serverRun(task);
+        atomic_fetch_sub(&serverBusy, 1);
+    }
+    free(outputBuffer);
+    return NULL;
+}
+
+// Called by a worker before it waits for an external command: another one is started if fewer than serverWorkers
+// would be left to run the tasks of the other sessions. If it can't be, they wait for this command too.
+void serverWaitBegin(){
+    pthread_mutex_lock(&serverIdleLock);
+    serverWaiting++;
+    if (!serverStopping && serverThreadCount - serverWaiting < serverWorkers &&
+        serverThreadCount < SERVER_WORKERS + SERVER_SESSIONS &&
+        pthread_create(&serverThreads[serverThreadCount], threadAttributes, serverWorker, (void *) (intptr_t) -1) == 0) {
+        serverThreadCount++;
+    }
+    pthread_mutex_unlock(&serverIdleLock);
+}
+
+void serverWaitEnd(){
+    pthread_mutex_lock(&serverIdleLock);
+    serverWaiting--;
+    pthread_mutex_unlock(&serverIdleLock);
+}
+
+// Runs a task of a session, again for as long as something for it happened while it ran
+void serverRun(struct serverTask * task){
+    struct serverSession * session = task->session;
+    currentSession = session;
+    shell = &session->shell;
+    do {
+        atomic_store(&task->pending, 0);
+        if (!atomic_load(&session->closing)) {
+            if (task->kind == TASK_KEYS) {
+                sessionKeys(session);
+            } else {
+                sessionFrame(session);
+            }
+        }
+        if (atomic_load(&session->closing)) {
+            // Left queued, so that it never runs again; the frame task is woken up to retire too
+            serverPost(&session->frame);
+            serverRetire(session);
+            break;
+        }
+        atomic_store(&task->queued, 0);
+    } while (atomic_load(&task->pending) && atomic_exchange(&task->queued, 1) == 0);
+    currentSession = NULL;
+    shell = &mainShell;
+}
+
+// A task of a closing session is done with it. The last one ends the session, and leaves it to be freed.
+void serverRetire(struct serverSession * session){
+    if (atomic_fetch_sub(&session->tasksLeft, 1) == 1) {
+        sessionEnd(session);
+        atomic_store(&session->ended, 1);
+    }
+}
+
+// Sets the size ncurses finds for the terminal of the next SCREEN started. Returns 0 on success.
+int setScreenSize(int rows, int columns){
+    char value[16];
+    snprintf(value, sizeof(value), "%d", rows);
+    if (setenv("LINES", value, 1) != 0) {
+        return -1;
+    }
+    snprintf(value, sizeof(value), "%d", columns);
+    return setenv("COLUMNS", value, 1);
+}
+
+// Starts the terminal of a session once its client has said hello: the type and size of the client's terminal.
+// Returns -1 (having told the client why) if it can't be drawn on.
+int sessionOpen(struct serverSession * session){
+    char term[64];
+    int y, x;
+    if (sscanf(session->hello, SERVER_HELLO " %63s %d %d", term, &y, &x) != 3 || y < 8 || y > 1000 || x < 20 || x > 1000) {
+        dprintf(session->fd, "Bad hello.\r\n");
+        return -1;
+    }
+    lockPrint();
+    // The size is taken from LINES and COLUMNS by newterm, and by the first refresh of a spare SCREEN after endwin
+    if (setScreenSize(y, x) != 0) {
+        unlockPrint();
+        dprintf(session->fd, "Out of memory.\r\n");
+        return -1;
+    }
+    struct serverScreen ** spare = &spareScreens;
+    while (*spare != NULL && (strcmp((*spare)->term, term) != 0 || (*spare)->rows != y || (*spare)->columns != x)) {
+        spare = &(*spare)->next;
+    }
+    struct serverScreen * terminal = *spare;
+    if (terminal != NULL) {
+        *spare = terminal->next;
+        dup2(session->fd, fileno(terminal->file));
+        set_term(terminal->screen);
+        // The new client's screen is cleared on the first refresh, which also puts ncurses back in curses mode. What
+        // the last session drew is wiped from ncurses' picture of the screen too, or the first refresh would draw it.
+        clear();
+        wnoutrefresh(stdscr);
+    } else if ((terminal = calloc(1, sizeof(struct serverScreen))) == NULL ||
+               (terminal->file = fdopen(fcntl(session->fd, F_DUPFD_CLOEXEC, 0), "r+")) == NULL ||
+               (terminal->screen = newterm(term, terminal->file, terminal->file)) == NULL) {
+        if (terminal != NULL && terminal->file != NULL) {
+            fclose(terminal->file);
+        }
+        free(terminal);
+        unlockPrint();
+        dprintf(session->fd, "Unknown terminal type %s.\r\n", term);
+        return -1;
+    } else {
+        snprintf(terminal->term, sizeof(terminal->term), "%s", term);
+        terminal->rows = y;
+        terminal->columns = x;
+        set_term(terminal->screen);
+        // Keys are read by the key task, not ncurses, so ncurses must not put off drawing when some are waiting
+        typeahead(-1);
+    }
+    session->terminal = terminal;
+    curs_set(0);
+    createPanels(&session->panels, y, x);
+
+    // The shell starts in the server's directory, and keeps its transcript there in output.N (N being the session's
+    // number)
+    char transcript[PATH_MAX + 16];
+    snprintf(transcript, sizeof(transcript), "%s/output.%d", mainShell.cwd, session->id);
+    initShell(transcript);
+    snprintf(shell->cwd, sizeof(shell->cwd), "%s", mainShell.cwd);
+    shell->outputPanel = session->panels.output;
+    shell->outputY = session->panels.outputY;
+    shell->outputLC = 1;
+    session->prompt = (struct promptLine) { .panel = session->panels.prompt, .line = 1 };
+
+    alarmPanelStart(&session->alarmPanel, session->panels.alarm, session->panels.colour, 1);
+    shadowInit(&session->timePanel.shadow, session->panels.time);
+    session->alarmPanel.adaptive = session->timePanel.adaptive =
+        (struct adaptiveState) { .backoff = 1, .fd = session->fd, .stallNs = &session->ttyStallNs };
+
+    struct commandOutput screen = { .screen = 1, .transcript = 1, .ttySeen = &session->promptSeen };
+    commandPrint(&screen, "Orange Wave session %d of server PID %d, ready in %.1f ms",session->id,getpid(),elapsedMs(&session->started));
+    if (config.problem[0] != '\0') {
+        commandPrint(&screen, "Configuration %s: %s",configPath,config.problem);
+    }
+    timedRefresh(shell->outputPanel);
+    promptShow(&session->prompt);
+    unlockPrint();
+    atomic_store(&session->opened, 1);
+    return 0;
+}
+
+// The key task of a session: reads what its client sent (the hello first), types it at the prompt and runs the
+// commands entered, until the client goes away or 'exit' is entered
+void sessionKeys(struct serverSession * session){
+    mySlot = &stats->slots[STATS_PROMPT];
+    char keys[256];
+    ssize_t received;
+    while (runLoop == 1 && (received = recv(session->fd, keys, sizeof(keys), MSG_DONTWAIT)) > 0) {
+        ssize_t key = 0;
+        while (session->terminal == NULL && key < received) {
+            char c = keys[key++];
+            if (c == '\n') {
+                session->hello[session->helloLength] = '\0';
+                if (sessionOpen(session) != 0) {
+                    atomic_store(&session->closing, 1);
+                    return;
+                }
+            } else if (session->helloLength < sizeof(session->hello) - 1) {
+                session->hello[session->helloLength++] = c;
+            }
+        }
+        for (; key < received && runLoop == 1; key++) {
+            unsigned long long frameStart = rawNs();
+            lockPrint();
+            if (!promptKey(&session->prompt, keys[key])) {
+                unlockPrint();
+                frameDone(frameStart);
+                continue;
+            }
+            // Handling the user's chosen command
+            timedRefresh(session->prompt.panel);
+            atomic_store(&session->running, 1);
+            struct commandOutput screen = { .screen = 1, .transcript = 1, .ttySeen = &session->promptSeen };
+            int exiting = runCommand(session->prompt.text, &screen);
+            atomic_store(&session->running, 0);
+            timedRefresh(shell->outputPanel);
+            updateStatsOverlay(&session->overlay, &session->overlaySeen, shell->outputPanel);
+            if (!exiting) {
+                promptNext(&session->prompt);
+                promptShow(&session->prompt);
+            }
+            unlockPrint();
+            if (exiting) {
+                atomic_store(&session->closing, 1);
+                return;
+            }
+        }
+    }
+    if (runLoop != 1) {
+        // The server is stopping, and ends the session itself
+        return;
+    }
+    if (received == 0 || (errno != EAGAIN && errno != EINTR)) {
+        // The client has gone (or was cut off)
+        atomic_store(&session->closing, 1);
+        return;
+    }
+    struct epoll_event reading = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.ptr = session };
+    epoll_ctl(serverPoll, EPOLL_CTL_MOD, session->fd, &reading);
+}
+
+// The frame task of a session: once a second, the alarm panel and (every refreshTime seconds) the time panel are
+// drawn as their updaters would, and the statistics overlay while no command is running. Frames are skipped while the
+// client's terminal can take no more output, whether or not adaptive refresh is on.
+void sessionFrame(struct serverSession * session){
+    if (!atomic_load(&session->opened)) {
+        return;
+    }
+    struct pollfd client = { .fd = session->fd, .events = POLLOUT };
+    if (poll(&client, 1, 0) == 0) {
+        return;
+    }
+    mySlot = &stats->slots[STATS_ALARM_PANEL];
+    if (++session->alarmTicks >= session->alarmPanel.adaptive.backoff) {
+        session->alarmTicks = 0;
+        if (adaptiveFrame(&session->alarmPanel.adaptive)) {
+            alarmPanelFrame(&session->alarmPanel, threadAlarm);
+        }
+    }
+    mySlot = &stats->slots[STATS_TIME_PANEL];
+    if (++session->timeTicks >= refreshTime * session->timePanel.adaptive.backoff) {
+        session->timeTicks = 0;
+        if (adaptiveFrame(&session->timePanel.adaptive)) {
+            timePanelFrame(&session->timePanel, threadTimes);
+        }
+    }
+    mySlot = &stats->slots[STATS_PROMPT];
+    lockPrint();
+    if (session->overlay != NULL && !atomic_load(&session->running)) {
+        updateStatsOverlay(&session->overlay, &session->overlaySeen, shell->outputPanel);
+    }
+    unlockPrint();
+}
+
+// Ends the terminal of a session, which restores the client's, keeps its SCREEN for another session, and closes the
+// transcript. The socket is closed by the main thread when it frees the session.
+void sessionEnd(struct serverSession * session){
+    if (session->terminal == NULL) {
+        return;
+    }
+    lockPrint();
+    if (session->overlay != NULL) {
+        delwin(session->overlay);
+    }
+    deletePanels(&session->panels);
+    endwin();
+    int none = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (none >= 0) {
+        dup2(none, fileno(session->terminal->file));
+        close(none);
+    }
+    session->terminal->next = spareScreens;
+    spareScreens = session->terminal;
+    session->terminal = NULL;
+    if (cwdShell == shell) {
+        cwdShell = &mainShell;
+    }
+    unlockPrint();
+    // The client is let go now, rather than when the server next frees the session
+    shutdown(session->fd, SHUT_RDWR);
+    free(session->alarmPanel.shadow.cells);
+    free(session->timePanel.shadow.cells);
+    if (shell->filtering) {
+        regfree(&shell->filterPattern.regex);
+    }
+    free(shell->dirStack);
+    if (shell->outputFP != NULL) {
+        fclose(shell->outputFP);
+    }
+}
+
+// The client of server mode: the terminal is put in raw mode, so that every key goes to the session as it is typed,
+// and whatever the session draws is copied back, until either side goes away
+int runAttach(const char * path){
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The server socket path is too long.\n");
+        return EXIT_FAILURE;
+    }
+    strcpy(address.sun_path, path);
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0 || connect(server, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    struct winsize size;
+    if (ioctl(STDIN_FILENO, TIOCGWINSZ, &size) != 0 || size.ws_row == 0) {
+        size.ws_row = 24;
+        size.ws_col = 80;
+    }
+    dprintf(server, SERVER_HELLO " %s %d %d\n", getenv("TERM") != NULL ? getenv("TERM") : "xterm", size.ws_row, size.ws_col);
+
+    struct termios saved, raw;
+    int isTerminal = tcgetattr(STDIN_FILENO, &saved) == 0;
+    if (isTerminal) {
+        raw = saved;
+        cfmakeraw(&raw);
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    }
+    struct pollfd relay[2] = { { .fd = STDIN_FILENO, .events = POLLIN }, { .fd = server, .events = POLLIN } };
+    char buffer[16384];
+    while (1) {
+        if (poll(relay, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (relay[1].revents != 0) {
+            ssize_t length = read(server, buffer, sizeof(buffer));
+            if (length <= 0 || write(STDOUT_FILENO, buffer, (size_t) length) != length) {
+                break;
+            }
+        }
+        if (relay[0].revents != 0) {
+            ssize_t length = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (length <= 0) {
+                // The end of the input detaches, and the session exits as though its terminal had gone
+                shutdown(server, SHUT_WR);
+                relay[0].fd = -1;
+            } else if (write(server, buffer, (size_t) length) != length) {
+                break;
+            }
+        }
+    }
+    if (isTerminal) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved);
+    }
+    close(server);
+    return 0;
+}
@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+// Imports for running OrangeWave on a pseudo terminal
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pty.h>        // for forkpty (link with -lutil)
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include <time.h>
+
+// owbench - measures the latency from presblock sending an alarm until OrangeWave has rendered
+// "[HH:MM:SS] Alarm Handled #seq" on the screen.
+//
+// OrangeWave is run headless on a pseudo terminal with TERM=vt100. Everything it writes is fed through a small vt100
+// parser which keeps a copy of the screen, and the screen is searched for the sequence numbers of the queued alarms
+// (presblock -q) which owbench sends itself. The alarm panel only shows the latest alarm, once a second, so an alarm
+// which never shows up on the screen was either coalesced (OrangeWave received it, as its "RT recv:" count shows, but
+// a later one had replaced it by the time the panel was drawn) or lost (it never reached OrangeWave). The default rate
+// is below the panel refresh so that every alarm can be seen.
+
+#define NSEC_PER_SEC 1000000000LL
+
+// Layout of the 64-bit payload carried by queued real-time alarms; must match main.c and presblock.c
+#define RT_SEQ_BITS 24
+#define RT_TIME_BITS 40
+#define RT_TIME_MASK ((1ULL << RT_TIME_BITS) - 1)
+
+// Latency histogram buckets: bucket i holds latencies in [2^i, 2^(i+1)) microseconds
+#define HIST_BUCKETS 32
+
+#define MAX_ROWS 200
+#define MAX_COLS 400
+
+// The copy of OrangeWave's screen, updated by the vt100 parser
+struct screen {
+    int rows, cols;
+    int y, x;
+    int savedY, savedX;
+    int top, bottom;    // scrolling region
+    char cells[MAX_ROWS][MAX_COLS + 1];
+    int dirty[MAX_ROWS];
+    // Escape sequence being parsed
+    int state;
+    char params[64];
+    int paramLen;
+};
+
+enum { ST_TEXT, ST_ESC, ST_CSI, ST_CHARSET };
+
+struct bench {
+    pid_t child;
+    int master;
+    struct screen screen;
+    // Send time of every alarm, by sequence number, and the time it was first seen on the screen (0 if never)
+    long long * sentNs;
+    long long * seenNs;
+    unsigned int count, sent;
+    // The most alarms OrangeWave has said it received, from the "RT recv:" line of the alarm panel
+    unsigned long received;
+    unsigned long long bytesRead;
+};
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void screenInit(struct screen * s, int rows, int cols) {
+    memset(s, 0, sizeof(*s));
+    s->rows = rows;
+    s->cols = cols;
+    s->bottom = rows - 1;
+    for (int r = 0; r < rows; r++) {
+        memset(s->cells[r], ' ', cols);
+        s->cells[r][cols] = '\0';
+    }
+}
+
+static void screenClearLine(struct screen * s, int row, int from, int to) {
+    if (from < to) {
+        memset(&s->cells[row][from], ' ', to - from);
+        s->dirty[row] = 1;
+    }
+}
+
+// Scrolls the scrolling region up or down by one line
+static void screenScroll(struct screen * s, int up) {
+    if (up) {
+        memmove(s->cells[s->top], s->cells[s->top + 1], (size_t) (s->bottom - s->top) * sizeof(s->cells[0]));
+        screenClearLine(s, s->bottom, 0, s->cols);
+    } else {
+        memmove(s->cells[s->top + 1], s->cells[s->top], (size_t) (s->bottom - s->top) * sizeof(s->cells[0]));
+        screenClearLine(s, s->top, 0, s->cols);
+    }
+    for (int r = s->top; r <= s->bottom; r++) {
+        s->dirty[r] = 1;
+    }
+}
+
+static void screenLineFeed(struct screen * s) {
+    if (s->y == s->bottom) {
+        screenScroll(s, 1);
+    } else if (s->y < s->rows - 1) {
+        s->y++;
+    }
+}
+
+// Reads the n-th numeric parameter of the CSI sequence being parsed, or def when it is missing or zero
+static int csiParam(const struct screen * s, int n, int def) {
+    const char * p = s->params;
+    if (*p == '?') {
+        p++;
+    }
+    for (int i = 0; i < n; i++) {
+        p = strchr(p, ';');
+        if (p == NULL) {
+            return def;
+        }
+        p++;
+    }
+    int value = atoi(p);
+    return value > 0 ? value : def;
+}
+
+static void screenCsi(struct screen * s, char final) {
+    switch (final) {
+        case 'H': case 'f':
+            s->y = csiParam(s, 0, 1) - 1;
+            s->x = csiParam(s, 1, 1) - 1;
+            break;
+        case 'A': s->y -= csiParam(s, 0, 1); break;
+        case 'B': s->y += csiParam(s, 0, 1); break;
+        case 'C': s->x += csiParam(s, 0, 1); break;
+        case 'D': s->x -= csiParam(s, 0, 1); break;
+        case 'G': s->x = csiParam(s, 0, 1) - 1; break;
+        case 'd': s->y = csiParam(s, 0, 1) - 1; break;
+        case 'K': {
+            int mode = atoi(s->params);
+            if (mode == 0) screenClearLine(s, s->y, s->x, s->cols);
+            else if (mode == 1) screenClearLine(s, s->y, 0, s->x + 1);
+            else screenClearLine(s, s->y, 0, s->cols);
+            break;
+        }
+        case 'J': {
+            int mode = atoi(s->params);
+            int from = mode == 0 ? s->y + 1 : 0;
+            int to = mode == 1 ? s->y : s->rows;
+            if (mode == 0) screenClearLine(s, s->y, s->x, s->cols);
+            if (mode == 1) screenClearLine(s, s->y, 0, s->x + 1);
+            for (int r = from; r < to; r++) {
+                screenClearLine(s, r, 0, s->cols);
+            }
+            break;
+        }
+        case 'r':
+            s->top = csiParam(s, 0, 1) - 1;
+            s->bottom = csiParam(s, 1, s->rows) - 1;
+            s->y = s->x = 0;
+            break;
+        default:
+            // Attributes (m), modes (h, l) and the rest do not change the text on the screen
+            break;
+    }
+    if (s->y < 0) s->y = 0;
+    if (s->y >= s->rows) s->y = s->rows - 1;
+    if (s->x < 0) s->x = 0;
+    if (s->x >= s->cols) s->x = s->cols - 1;
+    if (s->top < 0 || s->top >= s->rows) s->top = 0;
+    if (s->bottom < s->top || s->bottom >= s->rows) s->bottom = s->rows - 1;
+}
+
+// Feeds bytes written by OrangeWave through the vt100 parser
+static void screenFeed(struct screen * s, const char * buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) buf[i];
+        switch (s->state) {
+            case ST_TEXT:
+                if (c == 0x1b) {
+                    s->state = ST_ESC;
+                } else if (c == '\r') {
+                    s->x = 0;
+                } else if (c == '\n' || c == '\v' || c == '\f') {
+                    screenLineFeed(s);
+                } else if (c == '\b') {
+                    if (s->x > 0) s->x--;
+                } else if (c == '\t') {
+                    // ncurses moves the cursor with tabs (every 8 columns on a vt100)
+                    s->x = s->x / 8 * 8 + 8;
+                    if (s->x >= s->cols) s->x = s->cols - 1;
+                } else if (c >= 0x20 && c != 0x7f) {
+                    if (s->x >= s->cols) {
+                        s->x = 0;
+                        screenLineFeed(s);
+                    }
+                    s->cells[s->y][s->x++] = (char) c;
+                    s->dirty[s->y] = 1;
+                }
+                break;
+            case ST_ESC:
+                s->state = ST_TEXT;
+                if (c == '[') {
+                    s->state = ST_CSI;
+                    s->paramLen = 0;
+                    s->params[0] = '\0';
+                } else if (c == '(' || c == ')') {
+                    s->state = ST_CHARSET;
+                } else if (c == '7') {
+                    s->savedY = s->y;
+                    s->savedX = s->x;
+                } else if (c == '8') {
+                    s->y = s->savedY;
+                    s->x = s->savedX;
+                } else if (c == 'D') {
+                    screenLineFeed(s);
+                } else if (c == 'E') {
+                    s->x = 0;
+                    screenLineFeed(s);
+                } else if (c == 'M') {
+                    if (s->y == s->top) screenScroll(s, 0);
+                    else if (s->y > 0) s->y--;
+                }
+                break;
+            case ST_CSI:
+                if (c >= 0x40 && c <= 0x7e) {
+                    s->params[s->paramLen] = '\0';
+                    screenCsi(s, (char) c);
+                    s->state = ST_TEXT;
+                } else if (s->paramLen < (int) sizeof(s->params) - 1) {
+                    s->params[s->paramLen++] = (char) c;
+                }
+                break;
+            case ST_CHARSET:
+                s->state = ST_TEXT;
+                break;
+        }
+    }
+}
+
+// Looks through the rows which changed for "Alarm Handled #seq" and records when each alarm was first seen
+static void scanScreen(struct bench * b, long long now) {
+    struct screen * s = &b->screen;
+    for (int r = 0; r < s->rows; r++) {
+        if (!s->dirty[r]) {
+            continue;
+        }
+        s->dirty[r] = 0;
+        const char * p = s->cells[r];
+        while ((p = strstr(p, "Alarm Handled #")) != NULL) {
+            p += strlen("Alarm Handled #");
+            char * end;
+            unsigned long seq = strtoul(p, &end, 10);
+            if (end != p && seq < b->sent && b->seenNs[seq] == 0) {
+                b->seenNs[seq] = now;
+            }
+        }
+        if ((p = strstr(s->cells[r], "RT recv:")) != NULL) {
+            unsigned long received = strtoul(p + strlen("RT recv:"), NULL, 10);
+            if (received > b->received) {
+                b->received = received;
+            }
+        }
+    }
+}
+
+static int screenContains(const struct screen * s, const char * text) {
+    for (int r = 0; r < s->rows; r++) {
+        if (strstr(s->cells[r], text) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reads whatever OrangeWave has written, waiting at most until the deadline; returns -1 once it has exited
+static int pump(struct bench * b, long long deadline) {
+    char buf[65536];
+    long long now = nowNs();
+    int timeout = deadline > now ? (int) ((deadline - now + 999999) / 1000000) : 0;
+    struct pollfd pfd = { .fd = b->master, .events = POLLIN };
+    if (poll(&pfd, 1, timeout) <= 0) {
+        return 0;
+    }
+    ssize_t n = read(b->master, buf, sizeof(buf));
+    if (n <= 0) {
+        return -1;
+    }
+    b->bytesRead += (unsigned long long) n;
+    screenFeed(&b->screen, buf, (size_t) n);
+    scanScreen(b, nowNs());
+    return 0;
+}
+
+static int compareLongLong(const void * a, const void * b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: owbench [-o path_to_OrangeWave] [-r rate] [-n count] [-q rt_offset] [-s startup_s]\n"
+                    "               [-t drain_s] [-R rows] [-C cols] [-P prompt] [-a OrangeWave_arg] [-c histogram.csv]\n"
+                    "               [-j summary.json]\n");
+}
+
+int main(int argc, char ** argv) {
+    const char * program = "./OrangeWave";
+    const char * csvPath = NULL;
+    const char * jsonPath = NULL;
+    const char * prompt = "OK>";
+    // Arguments passed on to OrangeWave (-a, repeatable)
+    char ** childArgs = calloc((size_t) argc + 1, sizeof(char *));
+    int childArgCount = 1;
+    double rate = 0.5, startup = 15, drain = 3;
+    unsigned int count = 30;
+    int rtOffset = 0, rows = 40, cols = 140;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:r:n:q:s:t:R:C:c:j:P:a:")) != -1) {
+        switch (opt) {
+            case 'o': program = optarg; break;
+            case 'r': rate = atof(optarg); break;
+            case 'n': count = (unsigned int) strtoul(optarg, NULL, 0); break;
+            case 'q': rtOffset = atoi(optarg); break;
+            case 's': startup = atof(optarg); break;
+            case 't': drain = atof(optarg); break;
+            case 'R': rows = atoi(optarg); break;
+            case 'C': cols = atoi(optarg); break;
+            case 'c': csvPath = optarg; break;
+            case 'j': jsonPath = optarg; break;
+            case 'P': prompt = optarg; break;
+            case 'a': childArgs[childArgCount++] = optarg; break;
+            default:
+                usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (rate <= 0 || count == 0 || count >= (1U << RT_SEQ_BITS) || rows < 8 || rows > MAX_ROWS
+        || cols < 40 || cols > MAX_COLS || rtOffset < 0 || SIGRTMIN + rtOffset > SIGRTMAX) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    struct bench * b = calloc(1, sizeof(struct bench));
+    if (b == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    b->count = count;
+    b->sentNs = calloc(count, sizeof(long long));
+    b->seenNs = calloc(count, sizeof(long long));
+    if (b->sentNs == NULL || b->seenNs == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    screenInit(&b->screen, rows, cols);
+
+    // Start OrangeWave on a pseudo terminal of the requested size
+    struct winsize size = { .ws_row = (unsigned short) rows, .ws_col = (unsigned short) cols };
+    b->child = forkpty(&b->master, NULL, NULL, &size);
+    if (b->child < 0) {
+        perror("forkpty");
+        exit(EXIT_FAILURE);
+    } else if (b->child == 0) {
+        setenv("TERM", "vt100", 1);
+        childArgs[0] = (char *) program;
+        execv(program, childArgs);
+        perror("execv");
+        _exit(127);
+    }
+
+    // Wait for the prompt, which is printed once OrangeWave is ready for input
+    long long startNs = nowNs();
+    long long readyBy = startNs + (long long) (startup * NSEC_PER_SEC);
+    while (!screenContains(&b->screen, prompt)) {
+        if (nowNs() > readyBy || pump(b, readyBy) < 0) {
+            fprintf(stderr, "OrangeWave did not show its prompt within %.1f s\n", startup);
+            kill(b->child, SIGKILL);
+            exit(EXIT_FAILURE);
+        }
+    }
+    long long readyNs = nowNs();
+
+    // Send the alarms at a fixed rate, reading the screen in between
+    long long interval = (long long) (NSEC_PER_SEC / rate);
+    long long deadline = nowNs();
+    int rtSignal = SIGRTMIN + rtOffset;
+    unsigned long notQueued = 0;
+    int exited = 0;
+    while (b->sent < count && !exited) {
+        while (nowNs() < deadline) {
+            if (pump(b, deadline) < 0) {
+                exited = 1;
+                break;
+            }
+        }
+        if (exited) {
+            break;
+        }
+        long long sentNs = nowNs();
+        union sigval value;
+        value.sival_ptr = (void *) (uintptr_t) (((uint64_t) b->sent << RT_TIME_BITS)
+                                                | (((uint64_t) sentNs / 1000) & RT_TIME_MASK));
+        b->sentNs[b->sent] = sentNs;
+        if (sigqueue(b->child, rtSignal, value) != 0) {
+            if (errno != EAGAIN) {
+                perror("sigqueue");
+                break;
+            }
+            notQueued++;
+        }
+        b->sent++;
+        deadline += interval;
+    }
+
+    // Give the last alarms time to reach the screen, then ask OrangeWave to exit
+    long long drainUntil = nowNs() + (long long) (drain * NSEC_PER_SEC);
+    while (!exited && nowNs() < drainUntil) {
+        if (pump(b, drainUntil) < 0) {
+            exited = 1;
+        }
+    }
+    if (!exited) {
+        const char * quit = "exit\r";
+        if (write(b->master, quit, strlen(quit)) < 0) {
+            perror("write");
+        }
+        long long exitBy = nowNs() + 10 * NSEC_PER_SEC;
+        while (nowNs() < exitBy && pump(b, exitBy) >= 0) {
+        }
+    }
+    kill(b->child, SIGKILL);
+    waitpid(b->child, NULL, 0);
+
+    // Work out the latencies of the alarms which made it to the screen
+    long long * latencies = calloc(b->sent + 1, sizeof(long long));
+    unsigned long long histogram[HIST_BUCKETS] = {0};
+    unsigned int rendered = 0;
+    for (unsigned int i = 0; i < b->sent; i++) {
+        if (b->seenNs[i] == 0) {
+            continue;
+        }
+        long long us = (b->seenNs[i] - b->sentNs[i]) / 1000;
+        latencies[rendered++] = us;
+        int bucket = 0;
+        while (bucket < HIST_BUCKETS - 1 && (1LL << (bucket + 1)) <= us) {
+            bucket++;
+        }
+        histogram[bucket]++;
+    }
+    qsort(latencies, rendered, sizeof(long long), compareLongLong);
+    long long p50 = rendered ? latencies[rendered / 2] : 0;
+    long long p90 = rendered ? latencies[(size_t) (rendered * 0.90)] : 0;
+    long long p99 = rendered ? latencies[(size_t) (rendered * 0.99)] : 0;
+    long long max = rendered ? latencies[rendered - 1] : 0;
+
+    // Every alarm which was rendered was received, and every one which was queued but not received was lost
+    unsigned long received = b->received > rendered ? b->received : rendered;
+    if (received > b->sent - notQueued) {
+        received = b->sent - notQueued;
+    }
+    unsigned long coalesced = received - rendered;
+    unsigned long lost = b->sent - notQueued - received;
+    printf("startup %.1f ms, sent %u alarms at %.1f/s, rendered %u, coalesced %lu, lost %lu (%lu not queued)\n",
+           (readyNs - startNs) / 1e6, b->sent, rate, rendered, coalesced, lost, notQueued);
+    printf("signal to screen latency: p50 %lld us, p90 %lld us, p99 %lld us, max %lld us; %llu bytes from the tty\n",
+           p50, p90, p99, max, b->bytesRead);
+
+    if (csvPath != NULL) {
+        FILE * fp = fopen(csvPath, "w");
+        if (fp == NULL) {
+            perror("fopen");
+        } else {
+            fprintf(fp, "bucket_low_us,bucket_high_us,count\n");
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                fprintf(fp, "%lld,%lld,%llu\n", i == 0 ? 0 : 1LL << i, 1LL << (i + 1), histogram[i]);
+            }
+            fclose(fp);
+        }
+    }
+    if (jsonPath != NULL) {
+        FILE * fp = fopen(jsonPath, "w");
+        if (fp == NULL) {
+            perror("fopen");
+        } else {
+            fprintf(fp, "{\"rate\": %.3f, \"sent\": %u, \"rendered\": %u, \"coalesced\": %lu, \"lost\": %lu, "
+                        "\"not_queued\": %lu, \"startup_ms\": %.3f, \"p50_us\": %lld, \"p90_us\": %lld, \"p99_us\": %lld, \"max_us\": %lld, "
+                        "\"tty_bytes\": %llu, \"histogram\": [",
+                    rate, b->sent, rendered, coalesced, lost, notQueued, (readyNs - startNs) / 1e6,
+                    p50, p90, p99, max, b->bytesRead);
+            for (int i = 0; i < HIST_BUCKETS; i++) {
+                fprintf(fp, "%s%llu", i ? ", " : "", histogram[i]);
+            }
+            fprintf(fp, "]}\n");
+            fclose(fp);
+        }
+    }
+
+    free(latencies);
+    free(b->sentNs);
+    free(b->seenNs);
+    free(b);
+    free(childArgs);
+    return rendered > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,38 +1,755 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #define MAX_INTERVAL 25
+#define NSEC_PER_SEC 1000000000LL
+
+// Layout of the 64-bit payload carried by queued real-time alarms; must match OrangeWave (main.c).
+// The top 24 bits hold a sequence number and the low 40 bits the CLOCK_MONOTONIC send time in microseconds.
+#define RT_SEQ_BITS 24
+#define RT_TIME_BITS 40
+#define RT_TIME_MASK ((1ULL << RT_TIME_BITS) - 1)
+
+// Timer wheel: WHEEL_SLOTS slots of tickNs each. A target sits in the slot of its next deadline; deadlines further
+// away than one lap simply stay in their slot until the wheel comes round to them again.
+#define WHEEL_SLOTS 4096
+// A target is allowed this many catch-up sends per visit, so one target far behind cannot starve the others
+#define MAX_BURST 1024
+// Above this many targets only the totals are reported, not every target
+#define REPORT_TARGETS 16
+
+// A target is signalled while live. One whose schedule has run out (or which reached -n) is completed and never
+// signalled again; one which went away (ESRCH, or EPERM) is gone until it is back: found by -p under the same PID
+// (so a new process), or found by -D in a PID file which has been written again since.
+enum targetState { TARGET_LIVE, TARGET_COMPLETED, TARGET_GONE };
+
+// Schedules which decide when the next signal is sent
+enum scheduleMode { MODE_LEGACY, MODE_FIXED, MODE_POISSON, MODE_BURST, MODE_TRACE };
+
+struct schedule {
+  enum scheduleMode mode;
+  // Target signals per second (fixed, poisson and the 'on' phase of burst)
+  double rate;
+  // Length of the on and off phases of a burst schedule, in nanoseconds
+  long long burstOn, burstOff;
+  // Offsets (ns from start) read from a trace file, replayed in order; shared by every target using the trace
+  long long * trace;
+  size_t traceLen;
+};
+
+// One OrangeWave instance being signalled, with its own schedule, generator and statistics
+struct target {
+  pid_t pid;
+  struct schedule sched;
+  // xoshiro256** state, so that every target gets an independent, repeatable stream
+  uint64_t rng[4];
+  size_t traceIdx;
+  long long start, deadline;
+  uint32_t seq;
+  unsigned long long sent, overflowed;
+  long long maxLag;
+  enum targetState state;
+  // The PID file it was last found in by -D (inode and modification time), if any
+  ino_t fileIno;
+  struct timespec fileMtime;
+  // Next target in the same timer wheel slot
+  struct target * next;
+};
+
+struct wheel {
+  struct target * slots[WHEEL_SLOTS];
+  long long base, tickNs;
+  // The last tick whose slot has been visited; starts at -1 so that tick 0 is visited too
+  long long tick;
+  size_t count;
+};
+
+// Set by SIGINT/SIGTERM so that the final report is still printed
+static volatile sig_atomic_t stopRequested = 0;
+
+static uint64_t splitmix64(uint64_t * x) {
+  uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t rngNext(uint64_t * s) {
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+// Seeds through splitmix64 so that any 64-bit seed gives a good state
+static void rngSeed(uint64_t * s, uint64_t seed) {
+  for (int i = 0; i < 4; i++) {
+    s[i] = splitmix64(&seed);
+  }
+}
+
+// Uniform double in [0, 1) built from the top 53 bits
+static double rngUniform(uint64_t * s) {
+  return (rngNext(s) >> 11) * 0x1.0p-53;
+}
+
+static long long nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void stopHandler(int sig) {
+  (void) sig;
+  stopRequested = 1;
+}
+
+// Reads a trace file holding one send time (seconds since start, may be fractional) per line
+static int loadTrace(struct schedule * sched, const char * path) {
+  FILE * fp = fopen(path, "r");
+  if (fp == NULL) {
+    perror("fopen");
+    return -1;
+  }
+  size_t cap = 1024;
+  sched->trace = malloc(cap * sizeof(long long));
+  sched->traceLen = 0;
+  double offset;
+  while (sched->trace != NULL && fscanf(fp, "%lf", &offset) == 1) {
+    if (sched->traceLen == cap) {
+      cap *= 2;
+      sched->trace = realloc(sched->trace, cap * sizeof(long long));
+      if (sched->trace == NULL) {
+        break;
+      }
+    }
+    sched->trace[sched->traceLen++] = (long long) (offset * NSEC_PER_SEC);
+  }
+  fclose(fp);
+  if (sched->trace == NULL) {
+    fprintf(stderr, "Out of memory reading trace %s\n", path);
+    return -1;
+  }
+  if (sched->traceLen == 0) {
+    fprintf(stderr, "Trace %s holds no send times\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+static int parseMode(const char * name, enum scheduleMode * mode) {
+  if (strcmp(name, "legacy") == 0) *mode = MODE_LEGACY;
+  else if (strcmp(name, "fixed") == 0) *mode = MODE_FIXED;
+  else if (strcmp(name, "poisson") == 0) *mode = MODE_POISSON;
+  else if (strcmp(name, "burst") == 0) *mode = MODE_BURST;
+  else if (strcmp(name, "trace") == 0) *mode = MODE_TRACE;
+  else return -1;
+  return 0;
+}
+
+// Returns the absolute deadline (ns, CLOCK_MONOTONIC) of the target's next signal, or -1 when its schedule is
+// exhausted. Deadlines are derived from the previous deadline rather than from the current time so that the
+// schedule never drifts.
+static long long nextDeadline(struct target * t, int verbose) {
+  const struct schedule * sched = &t->sched;
+  switch (sched->mode) {
+    case MODE_LEGACY: {
+      int delay = (int) (rngNext(t->rng) % MAX_INTERVAL);
+      if (verbose) {
+        printf("Delaying for %d seconds...\n", delay);
+        fflush(stdout);
+      }
+      return t->deadline + delay * NSEC_PER_SEC;
+    }
+    case MODE_FIXED:
+      return t->deadline + (long long) (NSEC_PER_SEC / sched->rate);
+    case MODE_POISSON:
+      // Exponentially distributed inter-arrival times give a Poisson process
+      return t->deadline + (long long) (-log(1.0 - rngUniform(t->rng)) / sched->rate * NSEC_PER_SEC);
+    case MODE_BURST: {
+      long long next = t->deadline + (long long) (NSEC_PER_SEC / sched->rate);
+      long long period = sched->burstOn + sched->burstOff;
+      long long phase = (next - t->start) % period;
+      // Skip over the off phase to the start of the next burst
+      if (phase >= sched->burstOn) {
+        next += period - phase;
+      }
+      return next;
+    }
+    case MODE_TRACE:
+      if (t->traceIdx == sched->traceLen) {
+        return -1;
+      }
+      return t->start + sched->trace[t->traceIdx++];
+  }
+  return -1;
+}
+
+// The long-run rate a schedule is aiming for, used when reporting
+static double targetRate(const struct schedule * sched) {
+  switch (sched->mode) {
+    case MODE_LEGACY:
+      return 1.0 / ((MAX_INTERVAL - 1) / 2.0);
+    case MODE_FIXED:
+    case MODE_POISSON:
+      return sched->rate;
+    case MODE_BURST:
+      return sched->rate * sched->burstOn / (double) (sched->burstOn + sched->burstOff);
+    case MODE_TRACE: {
+      if (sched->traceLen == 0) {
+        return 0;
+      }
+      long long span = sched->trace[sched->traceLen - 1];
+      return span > 0 ? sched->traceLen / ((double) span / NSEC_PER_SEC) : 0;
+    }
+  }
+  return 0;
+}
+
+// Sends one alarm. With rtSignal set the alarm is queued with sigqueue, so it is never coalesced
+// and carries its sequence number and send time; otherwise a plain SIGALRM is sent as before.
+// Returns 0 on success, 1 when the receiver's queue of pending signals is full, -1 on error (errno is kept).
+static int sendAlarm(pid_t pid, int rtSignal, uint32_t seq) {
+  if (rtSignal == 0) {
+    return kill(pid, SIGALRM) == 0 ? 0 : -1;
+  }
+  uint64_t sentUs = (uint64_t) nowNs() / 1000;
+  union sigval value;
+  value.sival_ptr = (void *) (uintptr_t) (((uint64_t) seq << RT_TIME_BITS) | (sentUs & RT_TIME_MASK));
+  if (sigqueue(pid, rtSignal, value) == 0) {
+    return 0;
+  }
+  return errno == EAGAIN ? 1 : -1;
+}
+
+static void wheelInsert(struct wheel * w, struct target * t) {
+  long long tick = (t->deadline - w->base) / w->tickNs;
+  // Anything already due goes in the next slot to be visited
+  if (tick <= w->tick) {
+    tick = w->tick + 1;
+  }
+  struct target ** slot = &w->slots[tick % WHEEL_SLOTS];
+  t->next = *slot;
+  *slot = t;
+  w->count++;
+}
+
+// Finds the time at which the next non-empty slot will have fully elapsed, or -1 when the wheel is empty
+static long long wheelNextWake(const struct wheel * w) {
+  if (w->count == 0) {
+    return -1;
+  }
+  for (long long tick = w->tick + 1; tick <= w->tick + WHEEL_SLOTS; tick++) {
+    if (w->slots[tick % WHEEL_SLOTS] != NULL) {
+      return w->base + (tick + 1) * w->tickNs;
+    }
+  }
+  return -1;
+}
+
+struct presblock {
+  struct wheel wheel;
+  struct target ** targets;
+  size_t targetCount, targetCap;
+  // Open-addressing hash of the targets by PID, so rescans stay cheap with thousands of sessions
+  struct target ** index;
+  size_t indexCap;
+  // Defaults for targets which do not give their own schedule, and for discovered targets
+  struct schedule defaults;
+  uint64_t seed;
+  unsigned long long maxCount;
+  int rtSignal;
+  // Sources which are rescanned for new targets: process names and directories of PID files
+  char ** names;
+  size_t nameCount;
+  char ** dirs;
+  size_t dirCount;
+};
+
+static size_t indexSlot(const struct presblock * pb, pid_t pid) {
+  size_t i = ((uint32_t) pid * 2654435761U) & (pb->indexCap - 1);
+  while (pb->index[i] != NULL && pb->index[i]->pid != pid) {
+    i = (i + 1) & (pb->indexCap - 1);
+  }
+  return i;
+}
+
+static struct target * findTarget(struct presblock * pb, pid_t pid) {
+  return pb->indexCap ? pb->index[indexSlot(pb, pid)] : NULL;
+}
+
+// Adds a new target to the hash, doubling it whenever it gets half full
+static void indexTarget(struct presblock * pb, struct target * t) {
+  if (pb->targetCount * 2 >= pb->indexCap) {
+    struct target ** old = pb->index;
+    size_t oldCap = pb->indexCap;
+    pb->indexCap = oldCap ? oldCap * 2 : 128;
+    pb->index = calloc(pb->indexCap, sizeof(struct target *));
+    if (pb->index == NULL) {
+      fprintf(stderr, "Out of memory adding target %d\n", (int) t->pid);
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < oldCap; i++) {
+      if (old[i] != NULL) {
+        pb->index[indexSlot(pb, old[i]->pid)] = old[i];
+      }
+    }
+    free(old);
+  }
+  pb->index[indexSlot(pb, t->pid)] = t;
+}
+
+// Starts (or restarts, when a PID which had gone is back) signalling pid with the given schedule. pidFile is the PID
+// file it was found in by -D, or NULL for the command line and -p.
+static void addTarget(struct presblock * pb, pid_t pid, const struct schedule * sched, long long now,
+                      const struct stat * pidFile) {
+  struct target * t = findTarget(pb, pid);
+  if (t != NULL) {
+    int rewritten = pidFile != NULL && (pidFile->st_ino != t->fileIno || pidFile->st_mtim.tv_sec != t->fileMtime.tv_sec
+                                        || pidFile->st_mtim.tv_nsec != t->fileMtime.tv_nsec);
+    if (pidFile != NULL) {
+      t->fileIno = pidFile->st_ino;
+      t->fileMtime = pidFile->st_mtim;
+    }
+    if (t->state != TARGET_GONE || (pidFile != NULL && !rewritten)) {
+      return;
+    }
+  }
+  if (t == NULL) {
+    if (pb->targetCount == pb->targetCap) {
+      pb->targetCap = pb->targetCap ? pb->targetCap * 2 : 64;
+      pb->targets = realloc(pb->targets, pb->targetCap * sizeof(struct target *));
+      if (pb->targets == NULL) {
+        fprintf(stderr, "Out of memory adding target %d\n", (int) pid);
+        exit(EXIT_FAILURE);
+      }
+    }
+    t = calloc(1, sizeof(struct target));
+    if (t == NULL) {
+      fprintf(stderr, "Out of memory adding target %d\n", (int) pid);
+      exit(EXIT_FAILURE);
+    }
+    t->pid = pid;
+    if (pidFile != NULL) {
+      t->fileIno = pidFile->st_ino;
+      t->fileMtime = pidFile->st_mtim;
+    }
+    indexTarget(pb, t);
+    pb->targets[pb->targetCount++] = t;
+  } else {
+    // A new session under the same PID starts its sequence numbers and statistics afresh
+    fprintf(stderr, "Target %d is back, signalling it again\n", (int) pid);
+    t->seq = 0;
+    t->sent = 0;
+    t->overflowed = 0;
+    t->maxLag = 0;
+  }
+  t->pid = pid;
+  t->sched = *sched;
+  rngSeed(t->rng, pb->seed ^ ((uint64_t) pid << 32));
+  t->traceIdx = 0;
+  t->start = now;
+  t->deadline = now;
+  t->state = TARGET_LIVE;
+  t->deadline = nextDeadline(t, pb->targetCount == 1);
+  if (t->deadline < 0) {
+    t->state = TARGET_COMPLETED;
+    return;
+  }
+  wheelInsert(&pb->wheel, t);
+}
+
+// Parses a target given on the command line as pid[:mode[:rate]]
+static int parseTarget(struct presblock * pb, const char * spec, long long now) {
+  struct schedule sched = pb->defaults;
+  char mode[16] = "";
+  double rate = 0;
+  int pid = 0;
+  int fields = sscanf(spec, "%d:%15[a-z]:%lf", &pid, mode, &rate);
+  if (fields < 1 || pid <= 0) {
+    return -1;
+  }
+  if (fields >= 2 && parseMode(mode, &sched.mode) != 0) {
+    return -1;
+  }
+  if (fields == 3) {
+    if (rate <= 0) {
+      return -1;
+    }
+    sched.rate = rate;
+  }
+  if (sched.mode == MODE_TRACE && sched.trace == NULL) {
+    return -1;
+  }
+  addTarget(pb, pid, &sched, now, NULL);
+  return 0;
+}
+
+// Reads the name of a process, and its parent's PID if ppid is not NULL. Returns -1 if it has gone.
+static int processName(int pid, char * comm, size_t size, int * ppid) {
+  char path[64], text[512];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE * fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+  size_t length = fread(text, 1, sizeof(text) - 1, fp);
+  fclose(fp);
+  text[length] = '\0';
+  // "pid (comm) state ppid ...", where comm may hold spaces and parentheses itself
+  char * from = strchr(text, '(');
+  char * to = strrchr(text, ')');
+  char state;
+  if (from == NULL || to == NULL || to < from
+      || (ppid != NULL && sscanf(to + 1, " %c %d", &state, ppid) != 2)) {
+    return -1;
+  }
+  snprintf(comm, size, "%.*s", (int) (to - from - 1), from + 1);
+  return 0;
+}
+
+// Looks for new targets: processes whose name matches one of the -p names, and PIDs listed in the -D directories
+static void discoverTargets(struct presblock * pb, long long now) {
+  if (pb->nameCount > 0) {
+    DIR * proc = opendir("/proc");
+    struct dirent * entry;
+    while (proc != NULL && (entry = readdir(proc)) != NULL) {
+      int pid = atoi(entry->d_name);
+      int ppid;
+      char comm[64], parent[64];
+      if (pid <= 0 || pid == getpid() || processName(pid, comm, sizeof(comm), &ppid) != 0) {
+        continue;
+      }
+      for (size_t i = 0; i < pb->nameCount; i++) {
+        // Only the root of a session: its producers (process mode) and the launcher and sessions of a server are
+        // children of a process of the same name, and handle no alarms of their own. Processes which can't be
+        // signalled (another user's) are left alone as well.
+        if (strcmp(comm, pb->names[i]) == 0
+            && (processName(ppid, parent, sizeof(parent), NULL) != 0 || strcmp(parent, comm) != 0)
+            && kill(pid, 0) == 0) {
+          addTarget(pb, pid, &pb->defaults, now, NULL);
+        }
+      }
+    }
+    if (proc != NULL) {
+      closedir(proc);
+    }
+  }
+
+  for (size_t i = 0; i < pb->dirCount; i++) {
+    DIR * dir = opendir(pb->dirs[i]);
+    struct dirent * entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+      // Only the PID files: not the alarm logs and control sockets of the sessions, or anything else in there
+      size_t length = strlen(entry->d_name);
+      if (entry->d_name[0] == '.' || length < 5 || strcmp(entry->d_name + length - 4, ".pid") != 0
+          || (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)) {
+        continue;
+      }
+      char path[4096], text[32];
+      snprintf(path, sizeof(path), "%s/%s", pb->dirs[i], entry->d_name);
+      // Opened without blocking and without following links, in case it is a FIFO or a link after all
+      int fd = open(path, O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+      struct stat st;
+      if (fd < 0) {
+        continue;
+      }
+      ssize_t got = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? read(fd, text, sizeof(text) - 1) : -1;
+      close(fd);
+      int pid = 0;
+      if (got > 0) {
+        text[got] = '\0';
+        pid = atoi(text);
+      }
+      if (pid > 0) {
+        addTarget(pb, pid, &pb->defaults, now, &st);
+      }
+    }
+    if (dir != NULL) {
+      closedir(dir);
+    }
+  }
+}
+
+// Sends every alarm that is due to target t, then puts it back in the wheel; returns 0 once the target is retired
+static int fireTarget(struct presblock * pb, struct target * t, long long now) {
+  for (int burst = 0; burst < MAX_BURST && t->deadline <= now; burst++) {
+    // The sequence number advances even when the alarm could not be queued, so the receiver sees it as lost
+    int result = sendAlarm(t->pid, pb->rtSignal, t->seq);
+    t->seq = (t->seq + 1) & ((1U << RT_SEQ_BITS) - 1);
+    if (result < 0) {
+      // The session has gone away (ESRCH) or is not ours (EPERM); drop it without disturbing the others
+      fprintf(stderr, "Target %d: %s, no longer signalling it\n", (int) t->pid, strerror(errno));
+      t->state = TARGET_GONE;
+      return 0;
+    } else if (result > 0) {
+      t->overflowed++;
+    }
+    t->sent++;
+
+    if (now - t->deadline > t->maxLag) {
+      t->maxLag = now - t->deadline;
+    }
+    if (pb->maxCount && t->sent >= pb->maxCount) {
+      t->state = TARGET_COMPLETED;
+      return 0;
+    }
+    t->deadline = nextDeadline(t, pb->targetCount == 1);
+    if (t->deadline < 0) {
+      t->state = TARGET_COMPLETED;
+      return 0;
+    }
+  }
+  wheelInsert(&pb->wheel, t);
+  return 1;
+}
+
+// Visits every slot which has fully elapsed since the last visit, sending the alarms which are due. The slot of
+// the current, partly elapsed tick is left alone so that nothing in it waits a whole lap.
+static void wheelAdvance(struct presblock * pb, long long now) {
+  struct wheel * w = &pb->wheel;
+  long long lastTick = (now - w->base) / w->tickNs - 1;
+  long long visits = 0;
+  while (w->tick < lastTick && visits < WHEEL_SLOTS) {
+    w->tick++;
+    visits++;
+    struct target ** slot = &w->slots[w->tick % WHEEL_SLOTS];
+    struct target * list = *slot;
+    *slot = NULL;
+    while (list != NULL) {
+      struct target * t = list;
+      list = t->next;
+      w->count--;
+      if (t->deadline > now) {
+        // Due on a later lap of the wheel
+        t->next = *slot;
+        *slot = t;
+        w->count++;
+      } else {
+        fireTarget(pb, t, now);
+      }
+    }
+  }
+  // After a long sleep every slot has been visited once, which is all that is needed
+  if (w->tick < lastTick) {
+    w->tick = lastTick;
+  }
+}
+
+static void reportLine(const char * label, double rate, unsigned long long sent, unsigned long long overflowed,
+                       long long elapsed, long long maxLag) {
+  double seconds = (double) elapsed / NSEC_PER_SEC;
+  fprintf(stderr, "%ssent %llu in %.3f s: achieved %.1f/s, target %.1f/s, max lag %.3f ms",
+          label, sent, seconds, seconds > 0 ? sent / seconds : 0.0, rate, maxLag / 1e6);
+  if (overflowed) {
+    fprintf(stderr, ", %llu not queued (receiver queue full)", overflowed);
+  }
+  fprintf(stderr, "\n");
+}
+
+// Reports the totals, and every target as well when there are only a few (or when asked to)
+static void report(const struct presblock * pb, long long start, long long now, int perTarget) {
+  unsigned long long sent = 0, overflowed = 0;
+  long long maxLag = 0;
+  double rate = 0;
+  size_t alive = 0;
+  for (size_t i = 0; i < pb->targetCount; i++) {
+    const struct target * t = pb->targets[i];
+    sent += t->sent;
+    overflowed += t->overflowed;
+    if (t->maxLag > maxLag) {
+      maxLag = t->maxLag;
+    }
+    if (t->state == TARGET_LIVE) {
+      rate += targetRate(&t->sched);
+      alive++;
+    }
+    if (pb->targetCount > 1 && (perTarget || pb->targetCount <= REPORT_TARGETS)) {
+      char label[64];
+      snprintf(label, sizeof(label), "  %d%s: ", (int) t->pid,
+               t->state == TARGET_COMPLETED ? " (done)" : t->state == TARGET_GONE ? " (gone)" : "");
+      reportLine(label, targetRate(&t->sched), t->sent, t->overflowed, now - t->start, t->maxLag);
+    }
+  }
+  if (pb->targetCount == 1) {
+    reportLine("", targetRate(&pb->targets[0]->sched), sent, overflowed, now - start, maxLag);
+  } else {
+    char label[64];
+    snprintf(label, sizeof(label), "%zu targets (%zu live): ", pb->targetCount, alive);
+    reportLine(label, rate, sent, overflowed, now - start, maxLag);
+  }
+}
+
+static void usage(void) {
+  fprintf(stderr, "usage: presblock [-m legacy|fixed|poisson|burst|trace] [-r rate] [-b on_ms:off_ms]\n"
+                  "                 [-t tracefile] [-s seed] [-n count] [-d seconds] [-i report_seconds] [-q rt_offset]\n"
+                  "                 [-p process_name] [-D pid_file_dir] [-g tick_us] [-v] [pid[:mode[:rate]] ...]\n");
+}
 
 int main(int argc, char** argv)
 {
-  if (argc < 2) {
-    fprintf(stderr, "Incorrect number of arguments; usage: presblock [pid]\n");
+  struct presblock pb;
+  memset(&pb, 0, sizeof(pb));
+  pb.defaults.mode = MODE_LEGACY;
+  pb.defaults.rate = 1.0;
+  pb.defaults.burstOn = NSEC_PER_SEC;
+  pb.defaults.burstOff = NSEC_PER_SEC;
+  pb.seed = 1;
+  pb.names = calloc(argc, sizeof(char *));
+  pb.dirs = calloc(argc, sizeof(char *));
+  double duration = 0, reportInterval = 1, tickUs = 100;
+  const char * tracePath = NULL;
+  int verbose = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "m:r:b:t:s:n:d:i:q:p:D:g:v")) != -1) {
+    switch (opt) {
+      case 'm':
+        if (parseMode(optarg, &pb.defaults.mode) != 0) {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'r': pb.defaults.rate = atof(optarg); break;
+      case 'b': {
+        double on, off;
+        if (sscanf(optarg, "%lf:%lf", &on, &off) != 2 || on <= 0 || off < 0) {
+          usage();
+          exit(EXIT_FAILURE);
+        }
+        pb.defaults.burstOn = (long long) (on * 1e6);
+        pb.defaults.burstOff = (long long) (off * 1e6);
+        break;
+      }
+      case 't': tracePath = optarg; pb.defaults.mode = MODE_TRACE; break;
+      case 's': pb.seed = strtoull(optarg, NULL, 0); break;
+      case 'n': pb.maxCount = strtoull(optarg, NULL, 0); break;
+      case 'd': duration = atof(optarg); break;
+      case 'i': reportInterval = atof(optarg); break;
+      case 'q':
+        pb.rtSignal = SIGRTMIN + atoi(optarg);
+        if (pb.rtSignal < SIGRTMIN || pb.rtSignal > SIGRTMAX) {
+          fprintf(stderr, "Real-time signal offset must be between 0 and %d\n", SIGRTMAX - SIGRTMIN);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'p': pb.names[pb.nameCount++] = optarg; break;
+      case 'D': pb.dirs[pb.dirCount++] = optarg; break;
+      case 'g': tickUs = atof(optarg); break;
+      case 'v': verbose = 1; break;
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  // With nothing to target, follow every OrangeWave session of this user through the PID files they publish
+  char defaultDir[64];
+  if (optind == argc && pb.nameCount == 0 && pb.dirCount == 0) {
+    snprintf(defaultDir, sizeof(defaultDir), "/tmp/orangewave-%d", (int) getuid());
+    pb.dirs[pb.dirCount++] = defaultDir;
+    fprintf(stderr, "No pid given, following the sessions in %s\n", defaultDir);
+  }
+  if (pb.defaults.rate <= 0 || tickUs <= 0) {
+    fprintf(stderr, "Rate and tick must be positive\n");
+    exit(EXIT_FAILURE);
+  }
+  // Every target, however it is found, follows the default schedule, so trace mode can't go without a trace
+  if ((pb.defaults.mode == MODE_TRACE || tracePath != NULL)
+      && (tracePath == NULL || loadTrace(&pb.defaults, tracePath) != 0)) {
+    fprintf(stderr, "Trace mode needs a readable trace file (-t)\n");
     exit(EXIT_FAILURE);
   }
 
-  // Convert text pid to int
-  int proc_pid = atoi(argv[1]);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stopHandler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
 
-  // Check if pid is a sane value
-  if (proc_pid > 0) {
-    for(;;) {
-      // AGENT Smith:
-      // rand() is the worst PRNG ever; FFS use something else!
-      int delay = rand() % MAX_INTERVAL;
+  long long start = nowNs();
+  pb.wheel.base = start;
+  pb.wheel.tickNs = (long long) (tickUs * 1000);
+  pb.wheel.tick = -1;
 
-      // Delay and send signal
-      printf("Delaying for %d seconds...\n", delay);
-      sleep(delay);
-      kill(proc_pid, SIGALRM);
+  for (int i = optind; i < argc; i++) {
+    // Check if every pid is a sane value
+    if (parseTarget(&pb, argv[i], start) != 0) {
+      fprintf(stderr, "Invalid pid! Exiting...\n");
+      exit(EXIT_FAILURE);
     }
-  } else {
-    fprintf(stderr, "Invalid pid! Exiting...\n");
-    exit(EXIT_FAILURE);
   }
+  discoverTargets(&pb, start);
 
-  // Unreachable code
+  long long end = duration > 0 ? start + (long long) (duration * NSEC_PER_SEC) : 0;
+  long long reportEvery = (long long) (reportInterval * NSEC_PER_SEC);
+  long long nextReport = start + reportEvery;
+  // New sessions are looked for once a second
+  long long nextScan = start + NSEC_PER_SEC;
+  int discovering = pb.nameCount > 0 || pb.dirCount > 0;
+
+  while (!stopRequested) {
+    long long now = nowNs();
+    wheelAdvance(&pb, now);
+
+    if (discovering && now >= nextScan) {
+      discoverTargets(&pb, now);
+      nextScan = now + NSEC_PER_SEC;
+    }
+    if (reportEvery > 0 && now >= nextReport) {
+      report(&pb, start, now, verbose);
+      nextReport = now + reportEvery;
+    }
+    if (end && now >= end) {
+      break;
+    }
+    // Without discovery there is nothing left to do once every target is done
+    if (pb.wheel.count == 0 && !discovering) {
+      break;
+    }
+
+    // Sleep until the next slot holding a target, but wake up for rescans, reports and the end of the run
+    long long wake = wheelNextWake(&pb.wheel);
+    if (discovering && (wake < 0 || nextScan < wake)) wake = nextScan;
+    if (reportEvery > 0 && (wake < 0 || nextReport < wake)) wake = nextReport;
+    if (end && (wake < 0 || end < wake)) wake = end;
+    if (wake > now) {
+      struct timespec ts = { .tv_sec = wake / NSEC_PER_SEC, .tv_nsec = wake % NSEC_PER_SEC };
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+  }
+
+  if (pb.targetCount > 0) {
+    report(&pb, start, nowNs(), 1);
+  }
+  for (size_t i = 0; i < pb.targetCount; i++) {
+    free(pb.targets[i]);
+  }
+  free(pb.targets);
+  free(pb.index);
+  free(pb.names);
+  free(pb.dirs);
+  free(pb.defaults.trace);
   exit(EXIT_SUCCESS);
 }